@@ -0,0 +1,127 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_BACKEND_H_
+#define _FCITX5_FBTERM_BACKEND_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fcitx::dbus {
+class Bus;
+} // namespace fcitx::dbus
+
+struct PreeditItem {
+    std::string text;
+    int format = 0; ///< fcitx::TextFormatFlags
+};
+
+struct CandidateItem {
+    std::string label;
+    std::string text;
+};
+
+/// arguments of InputContext1's UpdateClientSideUI signal
+struct ClientSideUI {
+    std::vector<PreeditItem> preedit;
+    int cursorPos = -1;
+    std::vector<PreeditItem> auxUp;
+    std::vector<PreeditItem> auxDown;
+    std::vector<CandidateItem> candidates;
+    int highlight = -1;
+    int layoutHint = 0;
+    bool hasPrev = false;
+    bool hasNext = false;
+};
+
+/**
+ * Connection to an input context of fcitx5.
+ *
+ * Callbacks are invoked from the main context the backend was created in.
+ */
+class FcitxBackend {
+public:
+    struct Callbacks {
+        /// the input context has been created
+        std::function<void()> connected;
+        std::function<void(const char *str)> commitString;
+        std::function<void(const char *name, const char *uniqueName,
+                           const char *langCode)>
+            currentIM;
+        /// the object is reused by the backend, copy what needs to be kept
+        std::function<void(const ClientSideUI &ui)> updateClientSideUI;
+    };
+
+    virtual ~FcitxBackend() = default;
+
+    virtual void setCallbacks(Callbacks callbacks) {
+        callbacks_ = std::move(callbacks);
+    }
+
+    /// true if the input context exists
+    virtual bool isValid() const = 0;
+
+    virtual void focusIn() = 0;
+
+    virtual void focusOut() = 0;
+
+    virtual void setCapability(uint64_t capability) = 0;
+
+    /// returned by processKeySync() when fcitx didn't answer in time
+    static constexpr int KeyTimedOut = -2;
+
+    /**
+     * @brief send a key event to fcitx and wait for the reply
+     * @param timeout usec to wait, 0 for the D-Bus default
+     * @return positive if fcitx handled the key, KeyTimedOut if the reply
+     * didn't come in time, other negative values on errors
+     */
+    virtual int processKeySync(uint32_t keysym, uint32_t keycode,
+                               uint32_t state, bool isRelease, uint32_t time,
+                               uint64_t timeout) = 0;
+
+    /**
+     * @brief check without blocking whether fcitx answers D-Bus calls
+     * @param callback called from the main context with true if fcitx
+     * answered within timeout, never after the backend is destroyed
+     */
+    virtual void ping(uint64_t timeout, std::function<void(bool)> callback) = 0;
+
+protected:
+    Callbacks callbacks_;
+};
+
+enum class BackendType {
+    /// FcitxGClient from fcitx5-gtk on a GLib main loop
+    GClient,
+    /// D-Bus and event loop of fcitx-utils, without GLib
+    DBus,
+};
+
+#ifdef ENABLE_GCLIENT
+constexpr BackendType DefaultBackendType = BackendType::GClient;
+#else
+constexpr BackendType DefaultBackendType = BackendType::DBus;
+#endif
+
+/// @return false if name is not gclient or dbus, or was not built
+bool parseBackendType(std::string_view name, BackendType &type);
+
+/// backend based on FcitxGClient from fcitx5-gtk
+std::unique_ptr<FcitxBackend> createGClientBackend();
+
+/**
+ * @brief backend talking to InputMethod1 directly with fcitx::dbus
+ * @param bus the session bus, attached to the event loop of the calling
+ * thread, nullptr if it is not available
+ */
+std::unique_ptr<FcitxBackend> createDBusBackend(fcitx::dbus::Bus *bus);
+
+#endif // _FCITX5_FBTERM_BACKEND_H_
@@ -0,0 +1,550 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+/**
+ * Microbenchmarks of the key translation, text layout and message encoding
+ * paths. Keys are translated with a built-in US keymap, or one read from a
+ * file written by dumpkeys, so no console is needed.
+ *
+ * With --startup, only the cost of connecting a backend to a running fcitx5
+ * is measured instead, once per process so that it includes the libraries
+ * being initialized.
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcitx-utils/utf8.h>
+#include <getopt.h>
+#include <linux/input.h>
+#include <linux/keyboard.h>
+#include "imapi.h"
+#include "keycode.h"
+#include "keymap.h"
+#include "keymapfile.h"
+#include "mainloop.h"
+#include "render.h"
+#include "uskeymap.h"
+#include "utils.h"
+
+namespace {
+
+/// operator new calls, allocations by C libraries are not counted
+std::atomic<uint64_t> allocationCount{0};
+
+} // namespace
+
+void *operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+namespace {
+
+template <typename T>
+inline void doNotOptimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Result {
+    std::string name;
+    uint64_t iterations;
+    double nsPerOp;
+    double allocsPerOp;
+    /// growth of the resident memory, -1 if not measured
+    long rssKiB = -1;
+};
+
+class Bench {
+public:
+    Bench(std::string filter, uint64_t minTimeNs)
+        : filter_(std::move(filter)), minTimeNs_(minTimeNs) {}
+
+    /// run op(i) with an increasing number of iterations until it takes
+    /// at least the minimum time
+    template <typename Op>
+    void run(const std::string &name, Op op) {
+        if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+            return;
+        }
+        uint64_t iterations = 1;
+        while (true) {
+            auto allocations = allocationCount.load();
+            auto begin = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < iterations; i++) {
+                op(i);
+            }
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - begin)
+                               .count();
+            allocations = allocationCount.load() - allocations;
+            if (static_cast<uint64_t>(elapsed) >= minTimeNs_ ||
+                iterations >= (uint64_t(1) << 40)) {
+                Result result{name, iterations,
+                              static_cast<double>(elapsed) / iterations,
+                              static_cast<double>(allocations) / iterations};
+                printf("%-36s %12llu %12.1f ns/op %8.2f allocs/op\n",
+                       name.c_str(),
+                       static_cast<unsigned long long>(iterations),
+                       result.nsPerOp, result.allocsPerOp);
+                results_.push_back(std::move(result));
+                return;
+            }
+            iterations *= 2;
+        }
+    }
+
+    const std::vector<Result> &results() const { return results_; }
+
+private:
+    std::string filter_;
+    uint64_t minTimeNs_;
+    std::vector<Result> results_;
+};
+
+struct KeyEvent {
+    unsigned short keycode;
+    char down;
+};
+
+/// key presses and releases of typing a sentence and moving around
+std::vector<KeyEvent> makeKeyEvents(const StaticKeymap &keymap) {
+    std::vector<KeyEvent> events;
+    auto tap = [&events](unsigned short keycode) {
+        events.push_back({keycode, 1});
+        events.push_back({keycode, 0});
+    };
+    for (char c : std::string_view(
+             "The quick brown fox jumps over the lazy dog, 1234567890!")) {
+        unsigned short keycode;
+        bool shift;
+        if (!keymap.find(c, keycode, shift)) {
+            continue;
+        }
+        if (shift) {
+            events.push_back({KEY_LEFTSHIFT, 1});
+        }
+        tap(keycode);
+        if (shift) {
+            events.push_back({KEY_LEFTSHIFT, 0});
+        }
+    }
+    for (unsigned short keycode :
+         {KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_F5, KEY_BACKSPACE,
+          KEY_DELETE, KEY_ENTER}) {
+        tap(keycode);
+    }
+    events.push_back({KEY_LEFTCTRL, 1});
+    tap(KEY_C);
+    events.push_back({KEY_LEFTCTRL, 0});
+    return events;
+}
+
+std::string repeat(std::string_view str, size_t times) {
+    std::string result;
+    for (size_t i = 0; i < times; i++) {
+        result += str;
+    }
+    return result;
+}
+
+/// read everything written to the other end of the IM socket
+void drain(int fd) {
+    char buf[4096];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+void appendMessage(std::string &buf, const Message &msg, const void *body,
+                   size_t bodyLen) {
+    buf.append(reinterpret_cast<const char *>(&msg), offsetof(Message, raw));
+    buf.append(static_cast<const char *>(body), bodyLen);
+}
+
+void benchKeys(Bench &bench, const StaticKeymap &keymap) {
+    KeycodeState *state = keycode_state_new(-1);
+    KeycodeState *oldState = set_current_keycode_state(state);
+    keymap.install();
+    init_keycode_state();
+    update_term_mode(0, 0, 0);
+
+    auto events = makeKeyEvents(keymap);
+    bench.run("keycode_to_keysym", [&events](uint64_t i) {
+        const auto &event = events[i % events.size()];
+        doNotOptimize(keycode_to_keysym(event.keycode, event.down));
+    });
+
+    struct Translated {
+        unsigned short keysym, keycode;
+        char down;
+        FcitxKeySym fcitxKeysym;
+    };
+    std::vector<Translated> translated;
+    init_keycode_state();
+    for (const auto &event : events) {
+        auto keysym = keycode_to_keysym(event.keycode, event.down);
+        translated.push_back(
+            {keysym, event.keycode, event.down,
+             linux_keysym_to_fcitx_keysym(keysym, event.keycode)});
+    }
+
+    bench.run("linux_keysym_to_fcitx_keysym", [&translated](uint64_t i) {
+        const auto &key = translated[i % translated.size()];
+        doNotOptimize(linux_keysym_to_fcitx_keysym(key.keysym, key.keycode));
+    });
+
+    bench.run("keysym_to_term_string", [&translated](uint64_t i) {
+        const auto &key = translated[i % translated.size()];
+        doNotOptimize(*keysym_to_term_string(key.keysym, key.down));
+    });
+
+    fcitx::KeyState modifiers = fcitx::KeyState::NoState;
+    bench.run("calculate_modifiers", [&translated, &modifiers](uint64_t i) {
+        const auto &key = translated[i % translated.size()];
+        modifiers = calculate_modifiers(modifiers, key.fcitxKeysym, key.down);
+        doNotOptimize(modifiers);
+    });
+
+    set_current_keycode_state(oldState);
+    keycode_state_free(state);
+}
+
+void benchLayout(Bench &bench) {
+    const std::pair<const char *, std::string> corpora[] = {
+        {"ascii",
+         repeat("The quick brown fox jumps over the lazy dog. ", 4)},
+        {"cjk", repeat("中文输入法框架，한국어 입력기、日本語かな漢字。", 4)},
+        {"emoji", repeat("😀👍🎉🚀✨❤️🙏🔥", 8)},
+        {"mixed", repeat("1. pinyin 拼音 😀 2. 注音 ㄅㄆㄇ ", 4)},
+    };
+
+    for (const auto &[name, text] : corpora) {
+        bench.run(std::string("text_width/") + name,
+                  [&text = text](uint64_t) {
+                      doNotOptimize(text_width(text));
+                  });
+    }
+
+    for (const auto &[name, text] : corpora) {
+        std::vector<uint32_t> chars;
+        for (auto c : fcitx::utf8::MakeUTF8CharRange(text)) {
+            chars.push_back(c);
+        }
+        bench.run(std::string("is_double_width/") + name,
+                  [&chars](uint64_t i) {
+                      doNotOptimize(is_double_width(chars[i % chars.size()]));
+                  });
+    }
+}
+
+void benchMessages(Bench &bench) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair");
+        return;
+    }
+    ImSession *session = im_session_new(fds[0]);
+    ImSession *oldSession = set_current_im_session(session);
+    struct {
+        unsigned keys = 0, cursors = 0;
+    } counts;
+    using Counts = decltype(counts);
+    ImCallbacks callbacks = {};
+    callbacks.send_key = [](void *data, char *, unsigned len) {
+        static_cast<Counts *>(data)->keys += len;
+    };
+    callbacks.cursor_position = [](void *data, unsigned, unsigned) {
+        static_cast<Counts *>(data)->cursors++;
+    };
+    register_im_callbacks(&callbacks, &counts);
+
+    // What FbTerm sends while typing: a key and the new cursor position.
+    constexpr unsigned BatchMessages = 64;
+    std::string batch;
+    for (unsigned i = 0; i < BatchMessages / 2; i++) {
+        Message msg;
+        const char keyBody[] = {'a', 'b'};
+        msg.type = SendKey;
+        msg.len = offsetof(Message, keys) + sizeof(keyBody);
+        appendMessage(batch, msg, keyBody, sizeof(keyBody));
+
+        msg.type = CursorPosition;
+        msg.len = offsetof(Message, cursor) + sizeof(msg.cursor);
+        msg.cursor.x = i;
+        msg.cursor.y = 1;
+        appendMessage(batch, msg, &msg.cursor, sizeof(msg.cursor));
+    }
+    bench.run("check_im_message/64 messages", [&batch, &fds](uint64_t) {
+        if (write(fds[1], batch.data(), batch.size()) !=
+            static_cast<ssize_t>(batch.size())) {
+            abort();
+        }
+        doNotOptimize(check_im_message());
+    });
+
+    // Drain once in a while so the socket never fills up.
+    constexpr uint64_t DrainInterval = 64;
+    bench.run("fill_rect", [&fds](uint64_t i) {
+        fill_rect(Rectangle{0, 0, 640, 48}, Gray);
+        if (i % DrainInterval == DrainInterval - 1) {
+            drain(fds[1]);
+        }
+    });
+
+    const std::string preedit = "nihao 你好";
+    const std::string candidates =
+        "1.你好 2.拟好 3.你 4.泥 5.尼 6.妮 7.逆 8.腻 9.倪 10.匿";
+    bench.run("draw_text/preedit", [&fds, &preedit](uint64_t i) {
+        draw_text(8, 0, Black, Gray, preedit.data(), preedit.size());
+        if (i % DrainInterval == DrainInterval - 1) {
+            drain(fds[1]);
+        }
+    });
+    bench.run("draw_text/candidates", [&fds, &candidates](uint64_t i) {
+        draw_text(8, 16, Black, Gray, candidates.data(), candidates.size());
+        if (i % DrainInterval == DrainInterval - 1) {
+            drain(fds[1]);
+        }
+    });
+
+    // A candidate list with the third one highlighted, as drawn per frame.
+    StyledLine line;
+    DisplayList list;
+    auto drawCandidates = [&line, &list]() {
+        const char *words[] = {"你好", "拟好", "你", "泥", "尼"};
+        line.clear();
+        for (unsigned j = 0; j < std::size(words); j++) {
+            auto foreground = j == 2 ? Gray : Black;
+            auto background = j == 2 ? Black : Gray;
+            line.append(" ", Black, Gray);
+            line.append(std::to_string(j + 1) + ".", foreground, background);
+            line.append(words[j], foreground, background);
+        }
+        list.clear();
+        list.fillRect({0, 0, 400, 32}, Gray);
+        line.draw(list, 8, 16, 8, Gray);
+    };
+    auto sendList = [&list](unsigned x, unsigned y) {
+        list.moveTo(x, y);
+        auto data = list.data();
+        iovec iov = {const_cast<char *>(data.data()), data.size()};
+        send_im_messages(&iov, 1);
+    };
+    bench.run("StyledLine/candidates",
+              [&fds, &drawCandidates, &sendList](uint64_t i) {
+                  drawCandidates();
+                  sendList(8, 16);
+                  if (i % DrainInterval == DrainInterval - 1) {
+                      drain(fds[1]);
+                  }
+              });
+    // The same frame sent again somewhere else, as on ShowUI or a move.
+    drawCandidates();
+    bench.run("DisplayList/replay", [&fds, &sendList](uint64_t i) {
+        sendList(8 + i % 2 * 8, 16);
+        if (i % DrainInterval == DrainInterval - 1) {
+            drain(fds[1]);
+        }
+    });
+    drain(fds[1]);
+
+    register_im_callbacks(nullptr, nullptr);
+    set_current_im_session(oldSession);
+    im_session_free(session);
+    close(fds[1]);
+}
+
+long residentKiB() {
+    long size = 0, resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/// time and memory from creating a backend until its input context exists
+bool benchStartup(const std::string &name, std::vector<Result> &results) {
+    static constexpr auto Timeout = std::chrono::seconds(5);
+    BackendType type;
+    if (!parseBackendType(name, type)) {
+        std::cerr << "Unknown backend " << name << std::endl;
+        return false;
+    }
+
+    auto rss = residentKiB();
+    auto allocations = allocationCount.load();
+    auto begin = std::chrono::steady_clock::now();
+    auto loop = createMainLoop(type, false);
+    auto backend = loop->createBackend();
+    std::atomic<bool> connected{false};
+    backend->setCallbacks({[&loop, &connected]() {
+                               connected = true;
+                               loop->quit();
+                           },
+                           nullptr, nullptr, nullptr});
+    std::thread timeout([&loop, &connected, begin]() {
+        while (!connected &&
+               std::chrono::steady_clock::now() - begin < Timeout) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        loop->quit();
+    });
+    loop->run();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - begin)
+                       .count();
+    allocations = allocationCount.load() - allocations;
+    connected = true;
+    timeout.join();
+    if (!backend->isValid()) {
+        std::cerr << "No input context after 5s, is fcitx5 running?"
+                  << std::endl;
+        return false;
+    }
+
+    Result result{"startup/" + name, 1, static_cast<double>(elapsed),
+                  static_cast<double>(allocations),
+                  std::max(0L, residentKiB() - rss)};
+    printf("%-36s %10.0f us to input context %8ld KiB RSS %8.0f allocs\n",
+           result.name.c_str(), result.nsPerOp / 1000, result.rssKiB,
+           result.allocsPerOp);
+    results.push_back(std::move(result));
+    return true;
+}
+
+std::string jsonEscape(const std::string &str) {
+    std::string result;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+bool writeResults(const std::string &path,
+                  const std::vector<Result> &results) {
+    std::ofstream out(path);
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto &result = results[i];
+        out << "  {\"name\": \"" << jsonEscape(result.name)
+            << "\", \"iterations\": " << result.iterations
+            << ", \"ns_per_op\": " << result.nsPerOp
+            << ", \"allocs_per_op\": " << result.allocsPerOp;
+        if (result.rssKiB >= 0) {
+            out << ", \"rss_kib\": " << result.rssKiB;
+        }
+        out << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+    return static_cast<bool>(out);
+}
+
+void printUsage(std::string_view arg0) {
+    std::cout << "Usage: " << arg0 << " [options]" << std::endl
+              << "Options:" << std::endl
+              << "  --filter=<name>   only run benchmarks containing name"
+              << std::endl
+              << "  --min-time=<ms>   minimum time of a benchmark, default 200"
+              << std::endl
+              << "  --output=<file>   write the results as JSON" << std::endl
+              << "  --keymap=<file>   translate keys with a keymap written "
+                 "by dumpkeys"
+              << std::endl
+              << "  --startup=<gclient|dbus> measure connecting to fcitx5 "
+                 "instead"
+              << std::endl
+              << "  --help            show this message" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    const struct option longOptions[] = {
+        {"filter", required_argument, nullptr, 'f'},
+        {"min-time", required_argument, nullptr, 't'},
+        {"output", required_argument, nullptr, 'o'},
+        {"startup", required_argument, nullptr, 's'},
+        {"keymap", required_argument, nullptr, 'k'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+    std::string filter, output, startup, keymapPath;
+    uint64_t minTimeMs = 200;
+    int r;
+    while ((r = getopt_long_only(argc, argv, "", longOptions, nullptr)) != -1) {
+        switch (r) {
+        case 'f':
+            filter = optarg;
+            break;
+        case 't':
+            minTimeMs = strtoull(optarg, nullptr, 10);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 's':
+            startup = optarg;
+            break;
+        case 'k':
+            keymapPath = optarg;
+            break;
+        case 'h':
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    if (!startup.empty()) {
+        if (!benchStartup(startup, results)) {
+            return 1;
+        }
+    } else {
+        static const UsKeymap usKeymap;
+        const StaticKeymap *keymap = &usKeymap;
+        std::unique_ptr<KeymapFile> keymapFile;
+        if (!keymapPath.empty()) {
+            keymapFile = KeymapFile::load(keymapPath);
+            if (!keymapFile) {
+                return 1;
+            }
+            keymap = keymapFile.get();
+        }
+        Bench bench(filter, minTimeMs * 1000000);
+        benchKeys(bench, *keymap);
+        benchLayout(bench);
+        benchMessages(bench);
+        results = bench.results();
+    }
+
+    if (!output.empty() && !writeResults(output, results)) {
+        std::cerr << "Failed to write " << output << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,338 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "broker.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <fcitx-utils/log.h>
+#include "mainloop.h"
+#include "utils.h"
+
+namespace {
+
+/// fds passed with each session: FbTerm's socket and the console
+constexpr int SessionFds = 2;
+
+/// numbers the sessions of all workers
+std::atomic<unsigned> sessionSerial{0};
+
+class BrokerWorker {
+public:
+    explicit BrokerWorker(const FcitxFbtermConfig &config)
+        : config_(config), loop_(createMainLoop(config.backend, true)),
+          thread_(&BrokerWorker::run, this) {}
+
+    ~BrokerWorker() {
+        loop_->quit();
+        thread_.join();
+    }
+
+    size_t sessionCount() const { return count_.load(); }
+
+    /// takes ownership of the fds, may be called from any thread
+    void addSession(int imSocket, int ttyFd, int clientFd) {
+        count_++;
+        loop_->invoke([this, imSocket, ttyFd, clientFd]() {
+            startSession(imSocket, ttyFd, clientFd);
+        });
+    }
+
+private:
+    struct Session {
+        ~Session() {
+            fbterm.reset();
+            im_session_free(imSession);
+            keycode_state_free(keycodeState);
+            // The launcher started by FbTerm exits when it sees EOF.
+            close(clientFd);
+        }
+
+        ImSession *imSession;
+        KeycodeState *keycodeState;
+        int clientFd;
+        std::unique_ptr<FcitxFbterm> fbterm;
+    };
+
+    void run() {
+        loop_->run();
+        sessions_.clear();
+    }
+
+    void startSession(int imSocket, int ttyFd, int clientFd) {
+        auto session = std::make_unique<Session>();
+        session->imSession = im_session_new(imSocket);
+        session->keycodeState = keycode_state_new(ttyFd);
+        session->clientFd = clientFd;
+        // Startup of a session is measured from the time it arrives.
+        auto config = config_;
+        config.startTime = 0;
+        if (!config.recordPath.empty()) {
+            config.recordPath += "." + std::to_string(++sessionSerial);
+        }
+        session->fbterm = std::make_unique<FcitxFbterm>(
+            *loop_, session->imSession, session->keycodeState, config);
+        auto *ptr = session.get();
+        session->fbterm->setDisconnectedCallback([this, ptr]() {
+            // Called from the session's own socket callback, destroy it
+            // once the callback has returned.
+            loop_->invoke([this, ptr]() { removeSession(ptr); });
+        });
+        sessions_.push_back(std::move(session));
+    }
+
+    void removeSession(Session *session) {
+        auto iter = std::find_if(
+            sessions_.begin(), sessions_.end(),
+            [session](const auto &item) { return item.get() == session; });
+        if (iter != sessions_.end()) {
+            sessions_.erase(iter);
+            count_--;
+        }
+    }
+
+    FcitxFbtermConfig config_;
+    std::unique_ptr<MainLoop> loop_;
+    std::list<std::unique_ptr<Session>> sessions_;
+    std::atomic<size_t> count_{0};
+    std::thread thread_;
+};
+
+bool fillSocketAddress(sockaddr_un &addr) {
+    auto path = brokerSocketPath();
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+int connectBroker() {
+    sockaddr_un addr;
+    if (!fillSocketAddress(addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ==
+        -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int listenBroker() {
+    sockaddr_un addr;
+    if (!fillSocketAddress(addr)) {
+        return -1;
+    }
+    // A socket that nobody answers on is left over by a dead broker.
+    if (int fd = connectBroker(); fd != -1) {
+        close(fd);
+        FCITX_ERROR() << "fcitx5-fbterm broker is already running";
+        return -1;
+    }
+    unlink(addr.sun_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    auto oldMask = umask(0077);
+    auto ret = bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    umask(oldMask);
+    if (ret == -1 || listen(fd, 16) == -1) {
+        FCITX_ERROR() << "Failed to listen on " << addr.sun_path << ": "
+                      << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// receive the fds of one session from a launcher
+bool receiveSession(int fd, int (&fds)[SessionFds]) {
+    ucred cred;
+    socklen_t credLen = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == -1 ||
+        cred.uid != getuid()) {
+        return false;
+    }
+
+    timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char byte;
+    iovec iov = {&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * SessionFds)];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return false;
+    }
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        return false;
+    }
+    auto nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    nfds = std::min<size_t>(nfds, SessionFds);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    if (nfds != SessionFds) {
+        for (size_t i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return false;
+    }
+    return true;
+}
+
+void spawnBroker(const std::string &self, int imSocket) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        return;
+    }
+    if (pid > 0) {
+        while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+        }
+        return;
+    }
+
+    // Detach from FbTerm's session and console, the broker outlives it.
+    setsid();
+    if (fork() != 0) {
+        _exit(0);
+    }
+    close(imSocket);
+    unsetenv("FBTERM_IM_SOCKET");
+    int null = open("/dev/null", O_RDWR);
+    if (null != -1) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        if (null > STDERR_FILENO) {
+            close(null);
+        }
+    }
+    execl(self.c_str(), self.c_str(), "--broker", nullptr);
+    _exit(1);
+}
+
+} // namespace
+
+std::string brokerSocketPath() { return runtimePath("fcitx5-fbterm-broker"); }
+
+int runBroker(MainLoop &loop, const FcitxFbtermConfig &config,
+              unsigned workers) {
+    int listenFd = listenBroker();
+    if (listenFd == -1) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::unique_ptr<BrokerWorker>> pool;
+    for (unsigned i = 0; i < std::max(workers, 1U); i++) {
+        pool.push_back(std::make_unique<BrokerWorker>(config));
+    }
+
+    auto listener = loop.addWatch(
+        listenFd, MainLoop::IOCondition::Input, [listenFd, &pool]() {
+            int clientFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (clientFd == -1) {
+                return true;
+            }
+            int fds[SessionFds];
+            if (!receiveSession(clientFd, fds)) {
+                close(clientFd);
+                return true;
+            }
+            auto &worker = *std::min_element(
+                pool.begin(), pool.end(), [](const auto &lhs, const auto &rhs) {
+                    return lhs->sessionCount() < rhs->sessionCount();
+                });
+            worker->addSession(fds[0], fds[1], clientFd);
+            return true;
+        });
+
+    loop.run();
+    listener.reset();
+    close(listenFd);
+    return 0;
+}
+
+bool runBrokerClient(int imSocket, const std::string &self) {
+    int fd = connectBroker();
+    if (fd == -1) {
+        spawnBroker(self, imSocket);
+        for (int retry = 0; fd == -1 && retry < 20; retry++) {
+            usleep(100000);
+            fd = connectBroker();
+        }
+    }
+    if (fd == -1) {
+        return false;
+    }
+    // The console and the IM socket only go to a broker of this user.
+    ucred cred;
+    socklen_t credLen = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == -1 ||
+        cred.uid != getuid()) {
+        FCITX_ERROR() << "The broker socket is owned by another user";
+        close(fd);
+        return false;
+    }
+
+    int fds[SessionFds] = {imSocket, STDIN_FILENO};
+    char byte = 0;
+    iovec iov = {&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+        close(fd);
+        return false;
+    }
+
+    // The broker owns the session now, wait for it to end.
+    while (read(fd, &byte, 1) == -1 && errno == EINTR) {
+    }
+    close(fd);
+    return true;
+}
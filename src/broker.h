@@ -0,0 +1,45 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_BROKER_H_
+#define _FCITX5_FBTERM_BROKER_H_
+
+#include <string>
+#include "fcitxfbterm.h"
+
+/**
+ * In broker mode one resident process serves every FbTerm of the user.
+ *
+ * The process started by FbTerm only hands its FbTerm socket and its console
+ * over to the broker with SCM_RIGHTS, then waits until the broker closes the
+ * connection, which happens when the session ends. The broker creates a
+ * FcitxFbterm for each session on one of its worker threads, so the D-Bus
+ * connection is set up once for all of them.
+ */
+
+/// path of the socket the broker listens on
+std::string brokerSocketPath();
+
+/**
+ * @brief run the broker until it is killed
+ * @param loop loop of the calling thread, accepting the sessions
+ * @param workers number of threads serving sessions, each with a loop of
+ * config.backend
+ * @return exit code of the process
+ */
+int runBroker(MainLoop &loop, const FcitxFbtermConfig &config,
+              unsigned workers);
+
+/**
+ * @brief hand the session over to the broker, starting it if needed
+ * @param imSocket the socket connected to FbTerm
+ * @param self path used to start the broker
+ * @return false if no broker could take the session, otherwise returns
+ * after the session has ended
+ */
+bool runBrokerClient(int imSocket, const std::string &self);
+
+#endif // _FCITX5_FBTERM_BROKER_H_
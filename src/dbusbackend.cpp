@@ -0,0 +1,247 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <fcitx-utils/dbus/bus.h>
+#include <fcitx-utils/dbus/servicewatcher.h>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/handlertable.h>
+#include <fcitx-utils/log.h>
+#include "backend.h"
+
+namespace {
+
+// fcitx5 itself, and the portal name it also owns, which is the only one
+// reachable from a sandbox.
+constexpr char FcitxService[] = "org.fcitx.Fcitx5";
+constexpr char PortalService[] = "org.freedesktop.portal.Fcitx";
+constexpr char InputMethodPath[] = "/org/freedesktop/portal/inputmethod";
+constexpr char InputMethodInterface[] = "org.fcitx.Fcitx.InputMethod1";
+constexpr char InputContextInterface[] = "org.fcitx.Fcitx.InputContext1";
+constexpr char PeerInterface[] = "org.freedesktop.DBus.Peer";
+
+/// the default D-Bus timeout, as used by FcitxGClient
+constexpr uint64_t CallTimeout = 25000000;
+
+using DBusPreedit = std::vector<fcitx::dbus::DBusStruct<std::string, int>>;
+using DBusCandidates =
+    std::vector<fcitx::dbus::DBusStruct<std::string, std::string>>;
+
+void fillPreeditItems(std::vector<PreeditItem> &items,
+                      const DBusPreedit &array) {
+    items.resize(array.size());
+    for (size_t i = 0; i < array.size(); i++) {
+        items[i].text = std::get<0>(array[i].data());
+        items[i].format = std::get<1>(array[i].data());
+    }
+}
+
+class DBusBackend : public FcitxBackend {
+public:
+    explicit DBusBackend(fcitx::dbus::Bus *bus) : bus_(bus) {
+        if (!bus_) {
+            return;
+        }
+        watcher_ = std::make_unique<fcitx::dbus::ServiceWatcher>(*bus_);
+        for (auto *name : {FcitxService, PortalService}) {
+            watches_.push_back(watcher_->watchService(
+                name,
+                [this](const std::string &service, const std::string &,
+                       const std::string &newOwner) {
+                    (service == FcitxService ? fcitxOwner_ : portalOwner_) =
+                        newOwner;
+                    updateOwner();
+                }));
+        }
+    }
+
+    ~DBusBackend() { destroyIC(); }
+
+    bool isValid() const override { return !icPath_.empty(); }
+
+    void focusIn() override {
+        if (isValid()) {
+            callIC("FocusIn").send();
+        }
+    }
+
+    void focusOut() override {
+        if (isValid()) {
+            callIC("FocusOut").send();
+        }
+    }
+
+    void setCapability(uint64_t capability) override {
+        if (!isValid()) {
+            return;
+        }
+        auto msg = callIC("SetCapability");
+        msg << capability;
+        msg.send();
+    }
+
+    int processKeySync(uint32_t keysym, uint32_t keycode, uint32_t state,
+                       bool isRelease, uint32_t time,
+                       uint64_t timeout) override {
+        if (!isValid()) {
+            return 0;
+        }
+        if (!timeout) {
+            timeout = CallTimeout;
+        }
+        auto msg = callIC("ProcessKeyEvent");
+        msg << keysym << keycode << state << isRelease << time;
+        auto begin = fcitx::now(CLOCK_MONOTONIC);
+        auto reply = msg.call(timeout);
+        bool handled = false;
+        if (reply.type() != fcitx::dbus::MessageType::Reply ||
+            !(reply >> handled)) {
+            // The error names for a timeout differ between the D-Bus
+            // implementations of fcitx-utils.
+            return fcitx::now(CLOCK_MONOTONIC) - begin >= timeout
+                       ? KeyTimedOut
+                       : -1;
+        }
+        return handled;
+    }
+
+    void ping(uint64_t timeout, std::function<void(bool)> callback) override {
+        if (owner_.empty()) {
+            return;
+        }
+        // Answered by the D-Bus library in fcitx's main loop, so it tells
+        // whether fcitx dispatches again. A newer ping replaces this one.
+        auto msg = bus_->createMethodCall(owner_.c_str(), "/", PeerInterface,
+                                          "Ping");
+        pingSlot_ = msg.callAsync(
+            timeout,
+            [callback = std::move(callback)](fcitx::dbus::Message &reply) {
+                callback(reply.type() == fcitx::dbus::MessageType::Reply);
+                return true;
+            });
+    }
+
+private:
+    fcitx::dbus::Message callIC(const char *member) {
+        return bus_->createMethodCall(owner_.c_str(), icPath_.c_str(),
+                                      InputContextInterface, member);
+    }
+
+    /// follow fcitx5 when it is restarted, like FcitxGClient
+    void updateOwner() {
+        const auto &owner = fcitxOwner_.empty() ? portalOwner_ : fcitxOwner_;
+        if (owner == owner_) {
+            return;
+        }
+        destroyIC();
+        owner_ = owner;
+        if (!owner_.empty()) {
+            createIC();
+        }
+    }
+
+    void createIC() {
+        auto msg = bus_->createMethodCall(owner_.c_str(), InputMethodPath,
+                                          InputMethodInterface,
+                                          "CreateInputContext");
+        msg << std::vector<fcitx::dbus::DBusStruct<std::string, std::string>>{
+            {"program", "fbterm"}, {"display", "fbterm"}};
+        createSlot_ = msg.callAsync(
+            CallTimeout, [this](fcitx::dbus::Message &reply) {
+                fcitx::dbus::ObjectPath path;
+                std::vector<uint8_t> uuid;
+                if (reply.type() != fcitx::dbus::MessageType::Reply ||
+                    !(reply >> path >> uuid)) {
+                    FCITX_ERROR() << "Failed to create input context: "
+                                  << reply.errorMessage();
+                    return true;
+                }
+                icPath_ = path.path();
+                signalSlot_ = bus_->addMatch(
+                    fcitx::dbus::MatchRule(owner_, icPath_,
+                                           InputContextInterface),
+                    [this](fcitx::dbus::Message &msg) {
+                        dispatchSignal(msg);
+                        return true;
+                    });
+                if (callbacks_.connected) {
+                    callbacks_.connected();
+                }
+                return true;
+            });
+    }
+
+    void destroyIC() {
+        createSlot_.reset();
+        signalSlot_.reset();
+        if (!icPath_.empty()) {
+            callIC("DestroyIC").send();
+            icPath_.clear();
+        }
+    }
+
+    void dispatchSignal(fcitx::dbus::Message &msg) {
+        auto member = msg.member();
+        if (member == "CommitString") {
+            std::string str;
+            if (msg >> str && callbacks_.commitString) {
+                callbacks_.commitString(str.c_str());
+            }
+        } else if (member == "CurrentIM") {
+            std::string name, uniqueName, langCode;
+            if (msg >> name >> uniqueName >> langCode &&
+                callbacks_.currentIM) {
+                callbacks_.currentIM(name.c_str(), uniqueName.c_str(),
+                                     langCode.c_str());
+            }
+        } else if (member == "UpdateClientSideUI") {
+            DBusPreedit preedit, auxUp, auxDown;
+            DBusCandidates candidates;
+            auto &ui = ui_;
+            if (!(msg >> preedit >> ui.cursorPos >> auxUp >> auxDown >>
+                  candidates >> ui.highlight >> ui.layoutHint >>
+                  ui.hasPrev >> ui.hasNext)) {
+                return;
+            }
+            fillPreeditItems(ui.preedit, preedit);
+            fillPreeditItems(ui.auxUp, auxUp);
+            fillPreeditItems(ui.auxDown, auxDown);
+            ui.candidates.resize(candidates.size());
+            for (size_t i = 0; i < candidates.size(); i++) {
+                ui.candidates[i].label = std::get<0>(candidates[i].data());
+                ui.candidates[i].text = std::get<1>(candidates[i].data());
+            }
+            if (callbacks_.updateClientSideUI) {
+                callbacks_.updateClientSideUI(ui);
+            }
+        }
+    }
+
+    fcitx::dbus::Bus *bus_;
+    std::unique_ptr<fcitx::dbus::ServiceWatcher> watcher_;
+    std::vector<std::unique_ptr<
+        fcitx::HandlerTableEntry<fcitx::dbus::ServiceWatcherCallback>>>
+        watches_;
+    std::string fcitxOwner_;
+    std::string portalOwner_;
+    /// unique name of the service the input context belongs to
+    std::string owner_;
+    std::string icPath_;
+    std::unique_ptr<fcitx::dbus::Slot> createSlot_;
+    std::unique_ptr<fcitx::dbus::Slot> signalSlot_;
+    std::unique_ptr<fcitx::dbus::Slot> pingSlot_;
+    ClientSideUI ui_;
+};
+
+} // namespace
+
+std::unique_ptr<FcitxBackend> createDBusBackend(fcitx::dbus::Bus *bus) {
+    return std::make_unique<DBusBackend>(bus);
+}
@@ -0,0 +1,948 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 duzhaokun123 <duzhaokun2@outlook.com>
+ * SPDX-FileCopyrightText: 2010~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <fcitx-utils/capabilityflags.h>
+#include <fcitx-utils/fs.h>
+#include <fcitx-utils/keysymgen.h>
+#include <fcitx-utils/log.h>
+#include <fcitx-utils/textformatflags.h>
+#include <fcitx-utils/utf8.h>
+#include "fcitxfbterm.h"
+#include "imcodec.h"
+#include "keymap.h"
+#include "metrics.h"
+#include "utils.h"
+
+using namespace std;
+using namespace fcitx;
+
+FcitxFbterm::FcitxFbterm(MainLoop &loop, ImSession *session,
+                         KeycodeState *keycodeState,
+                         const FcitxFbtermConfig &config,
+                         std::unique_ptr<FcitxBackend> backend)
+    : loop_(loop), session_(session), keycodeState_(keycodeState),
+      foreground_(config.foreground), background_(config.background),
+      keyTimeout_(config.keyTimeout), speculate_(config.speculate),
+      profileStartup_(config.profileStartup),
+      lowJitter_(config.lowJitter), idleTrimDelay_(config.idleTrimDelay),
+      startTime_(config.startTime ? config.startTime : monotonicTime()) {
+    ScopedSession scope(this);
+
+    auto imSocket = get_im_socket();
+    if (imSocket == -1) {
+        return;
+    }
+
+    imSocket_ = imSocket;
+    inputWatch_ = addWatch(MainLoop::IOCondition::Input,
+                           &FcitxFbterm::socketCallback);
+
+    static const ImCallbacks cbs = {
+        [](void *data) { self(data)->im_active(); },   // .active
+        [](void *data) { self(data)->im_deactive(); }, // .deactive
+        [](void *data, unsigned winid) { self(data)->im_show(winid); },
+        [](void *data) { self(data)->im_hide(); },
+        [](void *data, char *keys, unsigned len) {
+            self(data)->process_raw_key(keys, len);
+        }, // .send_key
+        [](void *data, unsigned x, unsigned y) {
+            self(data)->cursor_pos_changed(x, y);
+        }, // .cursor_position
+        [](void *data, ::Info *info) {
+            self(data)->update_fbterm_info(info);
+        }, // .fbterm_info
+        [](void *, char crlf, char appkey, char curo) {
+            update_term_mode(crlf, appkey, curo);
+        },                                                  // .term_mode
+        [](void *data) { self(data)->outputPending(); }, // .output_pending
+        [](void *data, uint64_t rtt) {
+            self(data)->pingAcked(rtt);
+        }, // .ping_ack
+    };
+
+    // Attached first, so the log starts with the Connect message.
+    if (!config.recordPath.empty()) {
+        recorder_ = ImRecorder::create(config.recordPath);
+        set_im_recorder(recorder_.get());
+    }
+
+    register_im_callbacks(&cbs, this);
+    connect_fbterm(useRawMode);
+    connectTime_ = monotonicTime();
+
+    // Creating the input context is asynchronous, fill the keymap caches
+    // while waiting for it.
+    warmupSource_ = addIdle(&FcitxFbterm::warmup);
+
+    backend_ = backend ? std::move(backend) : loop_.createBackend();
+    if (recorder_) {
+        backend_ = createRecordingBackend(std::move(backend_), recorder_.get());
+    }
+    backend_->setCallbacks({
+        [this]() {
+            ScopedSession scope(this);
+            fcitx_fbterm_connect_cb();
+        },
+        [this](const char *str) {
+            ScopedSession scope(this);
+            fcitx_fbterm_commit_string_cb(str);
+        },
+        [this](const char *name, const char *, const char *) {
+            ScopedSession scope(this);
+            fcitx_fbterm_current_im_cb(name);
+        },
+        [this](const ClientSideUI &ui) {
+            ScopedSession scope(this);
+            fcitx_fbterm_update_client_side_ui_cb(ui);
+        },
+    });
+}
+
+FcitxFbterm::~FcitxFbterm() {
+    if (recorder_) {
+        ScopedSession scope(this);
+        set_im_recorder(nullptr);
+    }
+}
+
+std::unique_ptr<LoopSource>
+FcitxFbterm::addWatch(MainLoop::IOCondition condition,
+                      bool (FcitxFbterm::*callback)()) {
+    return loop_.addWatch(imSocket_, condition, [this, callback]() {
+        ScopedSession scope(this);
+        return (this->*callback)();
+    });
+}
+
+std::unique_ptr<LoopSource>
+FcitxFbterm::addIdle(void (FcitxFbterm::*callback)()) {
+    return loop_.addIdle([this, callback]() {
+        ScopedSession scope(this);
+        (this->*callback)();
+    });
+}
+
+std::unique_ptr<LoopSource>
+FcitxFbterm::addTimer(uint64_t interval, void (FcitxFbterm::*callback)()) {
+    return loop_.addTimer(interval, [this, callback]() {
+        ScopedSession scope(this);
+        (this->*callback)();
+    });
+}
+
+void FcitxFbterm::scheduleRedraw() {
+    if (redrawSource_) {
+        return;
+    }
+    if (fbtermSlow_) {
+        // Don't pile more drawing onto a terminal that is behind, draw what
+        // has changed in the meantime once per round trip instead.
+        metricAdd(metrics.deferredRedraws);
+        redrawSource_ =
+            addTimer(max(get_im_ping_stats()->smoothed_rtt, SlowRedrawDelay),
+                     &FcitxFbterm::redrawCallback);
+        return;
+    }
+    // Every update of the input method redraws, reuse the idle source
+    // instead of allocating a new one each time.
+    if (redrawIdle_ && redrawIdle_->rearm()) {
+        redrawSource_ = std::move(redrawIdle_);
+        return;
+    }
+    redrawSource_ = addIdle(&FcitxFbterm::redrawIdleCallback);
+}
+
+void FcitxFbterm::redrawCallback() {
+    redrawSource_.reset();
+    updateWindows();
+}
+
+void FcitxFbterm::redrawIdleCallback() {
+    redrawIdle_ = std::move(redrawSource_);
+    updateWindows();
+}
+
+void FcitxFbterm::warmup() {
+    warmupSource_.reset();
+    if (useRawMode) {
+        warm_keycode_cache();
+    }
+    enterLowJitterMode(lowJitter_);
+}
+
+void FcitxFbterm::trimIdle() {
+    trimTimer_.reset();
+    auto before = residentMemory();
+    // Filled again by the keys and redraws after the next Active.
+    drop_keycode_cache();
+    trim_im_buffers();
+    for (auto *window : {&preeditWindow_, &candidateWindow_}) {
+        window->line.release();
+        window->display.release();
+    }
+    scratch_.release();
+    redrawIdle_.reset();
+    std::vector<PreeditItem>().swap(auxUp_);
+    std::vector<PreeditItem>().swap(preedit_);
+    std::vector<std::string>().swap(guesses_);
+    std::vector<RawKey>().swap(rawKeys_);
+    std::vector<RawKey>().swap(pendingKeys_);
+    std::string().swap(passThrough_);
+    if (recorder_) {
+        recorder_->trim();
+    }
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    auto after = residentMemory();
+    metricAdd(metrics.idleTrims);
+    metrics.idleTrimResidentBefore.store(before, std::memory_order_relaxed);
+    metrics.idleTrimResidentAfter.store(after, std::memory_order_relaxed);
+    FCITX_DEBUG() << "Idle trim: resident memory " << before << " to "
+                  << after << " bytes";
+}
+
+void FcitxFbterm::probeFbterm() {
+    const auto *stats = get_im_ping_stats();
+    if (!stats->outstanding) {
+        send_im_ping();
+        return;
+    }
+    auto waited = monotonicTime() - stats->oldest_sent;
+    if (!fbtermSlow_ && waited >= StallTimeout) {
+        FCITX_DEBUG() << "FbTerm has not answered a Ping for " << waited
+                      << "us";
+        metricAdd(metrics.fbtermStalls);
+        fbtermSlow_ = true;
+    }
+}
+
+void FcitxFbterm::pingAcked(uint64_t) {
+    const auto *stats = get_im_ping_stats();
+    fbtermSlow_ = stats->smoothed_rtt >= SlowRoundTrip ||
+                  (stats->outstanding &&
+                   monotonicTime() - stats->oldest_sent >= StallTimeout);
+}
+
+void FcitxFbterm::recordKeyLatency(uint64_t begin) {
+    if (!profileStartup_) {
+        return;
+    }
+    auto end = monotonicTime();
+    keyCount_++;
+    if (keyCount_ == 1) {
+        FCITX_INFO() << "Startup: first key took " << end - begin
+                     << "us, exec to first key " << end - startTime_
+                     << "us";
+    } else {
+        keyTime_ += end - begin;
+        if (keyCount_ == ProfiledKeys) {
+            FCITX_INFO() << "Startup: steady state key took "
+                         << keyTime_ / (ProfiledKeys - 1) << "us on average";
+        }
+    }
+}
+
+void FcitxFbterm::setFocus(bool focus) {
+    if (focused_ == focus || !backend_->isValid()) {
+        return;
+    }
+    focused_ = focus;
+    metricAdd(metrics.focusChanges);
+    if (focus) {
+        backend_->focusIn();
+    } else {
+        backend_->focusOut();
+    }
+}
+
+void FcitxFbterm::moveRectInScreen(Rectangle &rect) {
+    auto width = rect.w;
+    auto height = rect.h;
+    rect.x = cursorx_ + fontWidth_ + width > screenWidth_
+                 ? cursorx_ - width - fontWidth_
+                 : cursorx_ + fontWidth_;
+    rect.y = cursory_ + halfFontHeight_ + height > screenHeight_
+                 ? cursory_ - height - halfFontHeight_ * 3
+                 : cursory_ + halfFontHeight_;
+}
+
+void FcitxFbterm::im_active() {
+    if (useRawMode) {
+        init_keycode_state();
+    }
+    active_ = true;
+    trimTimer_.reset();
+    resetWindows();
+    probeTimer_ = addTimer(ProbeInterval, &FcitxFbterm::probeFbterm);
+    setFocus(true);
+}
+
+void FcitxFbterm::im_deactive() {
+    // FbTerm handles the keys from now on, the queued ones come first.
+    flushPendingKeys();
+    guesses_.clear();
+    redrawSource_.reset();
+    probeTimer_.reset();
+    clearWin(WINID_PREEDIT);
+    clearWin(WINID_CANDIDATES);
+    clearWin(WINID_ERROR);
+    active_ = false;
+    setFocus(false);
+    // Locked memory is meant to stay resident.
+    if (idleTrimDelay_ && lowJitter_.policy == LowJitterConfig::Policy::Off) {
+        trimTimer_ = addTimer(idleTrimDelay_, &FcitxFbterm::trimIdle);
+    }
+}
+
+void FcitxFbterm::im_show(unsigned winid) {
+    // Also sent when switching back from another sub-window.
+    setFocus(true);
+    bool layout = degraded_;
+    for (auto *window : {&preeditWindow_, &candidateWindow_}) {
+        if (winid != static_cast<unsigned>(-1) && winid != window->winid) {
+            continue;
+        }
+        // The last frame is still valid unless the text changed since.
+        if (!window->dirty && !window->display.empty() &&
+            windows_[window->winid].w) {
+            window->replay = true;
+        } else {
+            window->dirty = true;
+            layout = true;
+        }
+    }
+    if (layout || im_output_congested()) {
+        updateWindows();
+    } else {
+        sendWindows();
+    }
+}
+
+void FcitxFbterm::im_hide() { setFocus(false); }
+
+void FcitxFbterm::updateWindows() {
+    if (im_output_congested()) {
+        redrawPending_ = true;
+        return;
+    }
+    redrawPending_ = false;
+    if (degraded_) {
+        // Follow the cursor, the input method windows stay hidden.
+        enterDegradedMode();
+        return;
+    }
+    clearWin(WINID_ERROR);
+    layoutWindows();
+    for (auto *window : {&preeditWindow_, &candidateWindow_}) {
+        if (window->dirty) {
+            drawWindow(*window);
+        }
+    }
+    sendWindows();
+}
+
+bool FcitxFbterm::setWindow(int winid, const Rectangle &rect) {
+    auto &current = windows_[winid];
+    if (current.x == rect.x && current.y == rect.y && current.w == rect.w &&
+        current.h == rect.h) {
+        return false;
+    }
+    current = rect;
+    set_im_window(winid, rect);
+    return true;
+}
+
+void FcitxFbterm::resetWindows() {
+    for (auto &rect : windows_) {
+        rect = Rectangle{0, 0, 0, 0};
+    }
+    for (auto *window : {&preeditWindow_, &candidateWindow_}) {
+        window->columns = window->shrinkCount = 0;
+        window->dirty = true;
+    }
+}
+
+void FcitxFbterm::allocateWindowSize(TextWindow &window) {
+    if (window.line.empty()) {
+        window.columns = window.shrinkCount = 0;
+        return;
+    }
+    // Grow at once in whole steps, shrink only once the content has stayed
+    // smaller for a while, so most keys redraw in the same window without
+    // a SetWin round trip.
+    auto columns = window.line.width();
+    auto screenColumns = fontWidth_ ? screenWidth_ / fontWidth_ : 0;
+    auto wanted = (columns + WidthStep - 1) / WidthStep * WidthStep;
+    if (screenColumns > 2) {
+        wanted = max(columns, min(wanted, screenColumns - 2));
+    }
+    if (wanted >= window.columns) {
+        window.columns = wanted;
+        window.shrinkCount = 0;
+    } else if (++window.shrinkCount >= ShrinkDelay) {
+        window.columns = wanted;
+        window.shrinkCount = 0;
+    }
+}
+
+void FcitxFbterm::updateWindowText(TextWindow &window) {
+    if (!(scratch_ == window.line)) {
+        std::swap(scratch_, window.line);
+        window.dirty = true;
+    }
+}
+
+void FcitxFbterm::layoutWindows() {
+    // Both windows share one column, the candidates below the preedit, and
+    // are placed like a single window so they flip sides together.
+    auto windowHeight = fontHeight_ + halfFontHeight_ * 2;
+    Rectangle area = {0, 0, 0, 0};
+    for (auto *window : {&preeditWindow_, &candidateWindow_}) {
+        allocateWindowSize(*window);
+        if (window->columns) {
+            area.w = max(area.w, (window->columns + 2) * fontWidth_);
+            area.h += windowHeight;
+        }
+    }
+    if (area.h) {
+        moveRectInScreen(area);
+    }
+
+    auto y = area.y;
+    for (auto *window : {&preeditWindow_, &candidateWindow_}) {
+        if (!window->columns) {
+            clearWin(window->winid);
+            window->dirty = false;
+            continue;
+        }
+        Rectangle rect = {area.x, y, (window->columns + 2) * fontWidth_,
+                          windowHeight};
+        y += windowHeight;
+        auto old = windows_[window->winid];
+        if (setWindow(window->winid, rect)) {
+            // A window which only moved is drawn from its last frame.
+            if (old.w == rect.w && old.h == rect.h &&
+                !window->display.empty()) {
+                window->replay = true;
+            } else {
+                window->dirty = true;
+            }
+        }
+    }
+}
+
+void FcitxFbterm::drawWindow(TextWindow &window) {
+    const auto &rect = windows_[window.winid];
+    window.dirty = false;
+    window.replay = true;
+    metricAdd(metrics.redraws);
+    window.display.clear();
+    window.display.fillRect({0, 0, rect.w, rect.h}, background_);
+    window.line.draw(window.display, fontWidth_, halfFontHeight_, fontWidth_,
+                     background_);
+}
+
+void FcitxFbterm::sendWindows() {
+    iovec iov[2];
+    int count = 0;
+    for (auto *window : {&preeditWindow_, &candidateWindow_}) {
+        if (!window->replay) {
+            continue;
+        }
+        window->replay = false;
+        const auto &rect = windows_[window->winid];
+        if (window->display.empty() || !rect.w) {
+            continue;
+        }
+        window->display.moveTo(rect.x, rect.y);
+        auto data = window->display.data();
+        iov[count].iov_base = const_cast<char *>(data.data());
+        iov[count].iov_len = data.size();
+        count++;
+    }
+    send_im_messages(iov, count);
+}
+
+void FcitxFbterm::appendPreedit(StyledLine &line,
+                                const std::vector<PreeditItem> &items,
+                                int cursor) {
+    // The caret is drawn as an inverted cell, at the end of the text it takes
+    // an extra blank one.
+    size_t offset = 0;
+    for (const auto &item : items) {
+        bool highlight =
+            item.format & static_cast<int>(TextFormatFlag::HighLight);
+        auto foreground = highlight ? background_ : foreground_;
+        auto background = highlight ? foreground_ : background_;
+        std::string_view text = item.text;
+        if (cursor >= 0 && static_cast<size_t>(cursor) >= offset &&
+            static_cast<size_t>(cursor) < offset + text.size()) {
+            auto caret = cursor - offset;
+            auto caretLen = utf8::ncharByteLength(item.text.begin() + caret, 1);
+            line.append(text.substr(0, caret), foreground, background);
+            line.append(text.substr(caret, caretLen), background, foreground);
+            line.append(text.substr(caret + caretLen), foreground, background);
+        } else {
+            line.append(text, foreground, background);
+        }
+        offset += text.size();
+    }
+    if (cursor >= 0 && static_cast<size_t>(cursor) == offset) {
+        line.append(" ", background_, foreground_);
+    }
+}
+
+void FcitxFbterm::updatePreeditWindow() {
+    scratch_.clear();
+    appendPreedit(scratch_, auxUp_, -1);
+    appendPreedit(scratch_, preedit_, preeditCursor_);
+    updateWindowText(preeditWindow_);
+}
+
+bool FcitxFbterm::speculate(uint32_t keysym) {
+    constexpr auto modifiers = static_cast<uint32_t>(KeyState::Ctrl) |
+                               static_cast<uint32_t>(KeyState::Alt) |
+                               static_cast<uint32_t>(KeyState::Super);
+    // Only guess that a letter typed at the end of the preedit is appended
+    // to it.
+    if (!speculate_ || keysym < FcitxKey_a || keysym > FcitxKey_z ||
+        static_cast<uint32_t>(state_) & modifiers ||
+        speculationStats_[currentIM_].disabled) {
+        return false;
+    }
+    std::string text;
+    for (const auto &item : preedit_) {
+        text += item.text;
+    }
+    if (text.empty() || preeditCursor_ != static_cast<int>(text.size())) {
+        return false;
+    }
+    auto guess = guesses_.empty() ? text : guesses_.back();
+    guess.push_back(static_cast<char>(keysym));
+
+    // Styled as the last item of the preedit.
+    auto items = preedit_;
+    items.back().text += guess.substr(text.size());
+    scratch_.clear();
+    appendPreedit(scratch_, auxUp_, -1);
+    appendPreedit(scratch_, items, guess.size());
+    updateWindowText(preeditWindow_);
+    guesses_.push_back(std::move(guess));
+    // fcitx is waited for right after, draw before.
+    updateWindows();
+    return true;
+}
+
+void FcitxFbterm::cancelSpeculation() {
+    if (guesses_.empty()) {
+        return;
+    }
+    guesses_.clear();
+    updatePreeditWindow();
+    scheduleRedraw();
+}
+
+void FcitxFbterm::checkSpeculation() {
+    std::string text;
+    for (const auto &item : preedit_) {
+        text += item.text;
+    }
+    auto match = std::find(guesses_.begin(), guesses_.end(), text);
+    if (match == guesses_.end()) {
+        recordGuesses(0, guesses_.size());
+        guesses_.clear();
+        return;
+    }
+    // The updates of several keys may come as one, the guesses before the
+    // match were right as well.
+    recordGuesses(match - guesses_.begin() + 1, 0);
+    guesses_.erase(guesses_.begin(), match + 1);
+}
+
+void FcitxFbterm::recordGuesses(unsigned hits, unsigned misses) {
+    metricAdd(metrics.speculationHits, hits);
+    metricAdd(metrics.speculationMisses, misses);
+    auto &stats = speculationStats_[currentIM_];
+    stats.guesses += hits + misses;
+    stats.hits += hits;
+    if (!stats.disabled && stats.guesses >= SpeculationWarmup &&
+        stats.hits * 100 < stats.guesses * MinSpeculationHitRate) {
+        FCITX_INFO() << "Guessed the preedit of " << currentIM_ << " right "
+                     << stats.hits << " of " << stats.guesses
+                     << " times, not speculating for it anymore";
+        stats.disabled = true;
+    }
+    if (stats.guesses >= SpeculationWindow) {
+        stats.guesses /= 2;
+        stats.hits /= 2;
+    }
+}
+
+void FcitxFbterm::process_raw_key(char *buf, unsigned int len) {
+    auto begin = monotonicTime();
+    rawKeys_.clear();
+    for (unsigned int i = 0; i < len; i++) {
+        char down = !(buf[i] & 0x80);
+        short code = buf[i] & 0x7f;
+
+        if (!code) {
+            if (i + 2 >= len)
+                break;
+
+            code = (buf[++i] & 0x7f) << 7;
+            code |= buf[++i] & 0x7f;
+            if (!(buf[i] & 0x80) || !(buf[i - 1] & 0x80))
+                continue;
+        }
+        rawKeys_.push_back({static_cast<unsigned short>(code), down});
+    }
+
+    if (!backend_->isValid()) {
+        if (connectTimedOut_) {
+            show_cannot_connect_error();
+            passThroughKeys(rawKeys_);
+            flushPassThrough();
+            recordKeyLatency(begin);
+        } else {
+            queueKeys();
+        }
+        return;
+    }
+
+    // Focused already, unless FbTerm sent HideUI without ShowUI.
+    setFocus(true);
+    // Keys queued before the connected callback, which may not have run yet.
+    replayPendingKeys();
+    processKeys(rawKeys_);
+    // One PutText for the keys of the batch fcitx didn't handle, after the
+    // commits still queued if one of them timed out.
+    if (!queuedSignalsIdle_) {
+        flushPassThrough();
+    }
+    recordKeyLatency(begin);
+}
+
+bool FcitxFbterm::composing() const {
+    return !auxUp_.empty() || !preedit_.empty() ||
+           !candidateWindow_.line.empty();
+}
+
+void FcitxFbterm::processKeys(const std::vector<RawKey> &keys) {
+    for (size_t i = 0; i < keys.size(); i++) {
+        auto code = keys[i].code;
+        auto down = keys[i].down;
+
+        // Autorepeat queued up behind another repeat of the same key means
+        // the pipeline is behind the keyboard. While composing, fcitx only
+        // gets the last repeat of the run, the ones before would move the
+        // candidates or the preedit just to be overwritten. Keys for the
+        // terminal are all delivered.
+        bool queued = is_key_repeat(code, down) && i + 1 < keys.size() &&
+                      keys[i + 1].code == code && keys[i + 1].down;
+        if (queued && !degraded_ && composing()) {
+            metricAdd(metrics.coalescedRepeats);
+            continue;
+        }
+
+        ushort linux_keysym = keycode_to_keysym(code, down);
+        FcitxKeySym keysym = linux_keysym_to_fcitx_keysym(linux_keysym, code);
+
+        bool handled = false;
+        if (keysym != FcitxKey_None && !degraded_) {
+            bool guessed = false;
+            if (down && !queued) {
+                guessed = speculate(keysym);
+                if (!guessed) {
+                    // The next update can't be compared with the guesses.
+                    cancelSpeculation();
+                }
+            }
+            auto callBegin = monotonicTime();
+            auto result = backend_->processKeySync(
+                keysym, code, static_cast<uint32_t>(state_), !down, 0,
+                keyTimeout_);
+            metricLatency(metrics.dbusCalls,
+                          monotonicTime() - callBegin);
+            metricAdd(metrics.keysProcessed);
+            if (result == FcitxBackend::KeyTimedOut) {
+                metricAdd(metrics.keyDeadlineMisses);
+                enterDegradedMode();
+            }
+            handled = result > 0;
+            if (guessed && !handled && !guesses_.empty()) {
+                // No longer composing, the letter is not in the preedit.
+                recordGuesses(0, 1);
+                cancelSpeculation();
+            }
+        }
+        if (!handled) {
+            passThroughKey(linux_keysym, down);
+        }
+
+        state_ = calculate_modifiers(state_, keysym, down);
+    }
+}
+
+void FcitxFbterm::passThroughKeys(const std::vector<RawKey> &keys) {
+    for (const auto &key : keys) {
+        passThroughKey(keycode_to_keysym(key.code, key.down), key.down);
+    }
+}
+
+void FcitxFbterm::passThroughKey(unsigned short linuxKeysym, char down) {
+    if (char *str = keysym_to_term_string(linuxKeysym, down)) {
+        passThrough_ += str;
+    }
+    metricAdd(metrics.keysPassedThrough);
+}
+
+void FcitxFbterm::flushPassThrough() {
+    std::string_view text = passThrough_;
+    while (!text.empty()) {
+        auto len = min(text.size(), ImMaxPayload<PutText>);
+        put_im_text(text.data(), len);
+        text.remove_prefix(len);
+    }
+    passThrough_.clear();
+}
+
+void FcitxFbterm::queueKeys() {
+    if (pendingKeys_.size() + rawKeys_.size() > MaxPendingKeys) {
+        // Too much typed to hold back, give up waiting for fcitx.
+        pendingKeysExpired();
+        passThroughKeys(rawKeys_);
+        flushPassThrough();
+        return;
+    }
+    pendingKeys_.insert(pendingKeys_.end(), rawKeys_.begin(), rawKeys_.end());
+    if (!pendingTimer_) {
+        pendingTimer_ =
+            addTimer(PendingKeyTimeout, &FcitxFbterm::pendingKeysExpired);
+    }
+}
+
+void FcitxFbterm::replayPendingKeys() {
+    pendingTimer_.reset();
+    if (pendingKeys_.empty()) {
+        return;
+    }
+    std::vector<RawKey> keys;
+    keys.swap(pendingKeys_);
+    processKeys(keys);
+}
+
+void FcitxFbterm::flushPendingKeys() {
+    pendingTimer_.reset();
+    if (pendingKeys_.empty()) {
+        return;
+    }
+    show_cannot_connect_error();
+    passThroughKeys(pendingKeys_);
+    pendingKeys_.clear();
+    flushPassThrough();
+}
+
+void FcitxFbterm::pendingKeysExpired() {
+    // Until fcitx connects, don't make every key wait for it again.
+    connectTimedOut_ = true;
+    flushPendingKeys();
+}
+
+void FcitxFbterm::cursor_pos_changed(unsigned x, unsigned y) {
+    cursorx_ = x;
+    cursory_ = y;
+    scheduleRedraw();
+}
+
+void FcitxFbterm::update_fbterm_info(::Info *info) {
+    fontWidth_ = info->fontWidth;
+    fontHeight_ = info->fontHeight;
+    halfFontHeight_ = info->fontHeight * 0.5;
+    screenHeight_ = info->screenHeight;
+    screenWidth_ = info->screenWidth;
+    cursorx_ = 0;
+    cursory_ = 0;
+    resetWindows();
+}
+
+void FcitxFbterm::showError(std::string_view msg) {
+    Rectangle rect = {0, 0, 0, 0};
+    rect.w = (text_width(msg.data()) + 2) * fontWidth_;
+    rect.h = fontHeight_ * 2;
+    moveRectInScreen(rect);
+    setWindow(WINID_ERROR, rect);
+    fill_rect(rect, Red);
+    draw_text(rect.x + fontWidth_, rect.y + halfFontHeight_, White, Red,
+              msg.data(), msg.size());
+    clearWin(WINID_PREEDIT);
+    clearWin(WINID_CANDIDATES);
+}
+
+void FcitxFbterm::show_cannot_connect_error() {
+    showError("ERROR: Can't connect to fcitx5! Is daemon running?");
+}
+
+void FcitxFbterm::enterDegradedMode() {
+    if (!degraded_) {
+        FCITX_WARN() << "fcitx5 didn't answer a key in " << keyTimeout_
+                     << "us, passing keys through until it answers again";
+        degraded_ = true;
+        guesses_.clear();
+        auxUp_.clear();
+        preedit_.clear();
+        // Stale by the time fcitx answers again, it sends new ones.
+        for (auto *window : {&preeditWindow_, &candidateWindow_}) {
+            window->line.clear();
+            window->dirty = true;
+        }
+        fcitxProbeTimer_ =
+            addTimer(FcitxProbeInterval, &FcitxFbterm::probeFcitx);
+        // The commits of the keys fcitx answered before may not have been
+        // dispatched yet, the loop gets to them before an idle source.
+        queuedSignalsIdle_ = addIdle(&FcitxFbterm::queuedSignalsDispatched);
+    }
+    showError("ERROR: fcitx5 is not responding, keys are passed through");
+}
+
+void FcitxFbterm::queuedSignalsDispatched() {
+    queuedSignalsIdle_.reset();
+    flushPassThrough();
+}
+
+void FcitxFbterm::leaveDegradedMode() {
+    if (!degraded_) {
+        return;
+    }
+    FCITX_INFO() << "fcitx5 answers again";
+    degraded_ = false;
+    fcitxProbeTimer_.reset();
+    if (active_) {
+        updateWindows();
+    }
+}
+
+void FcitxFbterm::probeFcitx() {
+    backend_->ping(keyTimeout_, [this](bool answered) {
+        ScopedSession scope(this);
+        if (answered) {
+            leaveDegradedMode();
+        }
+    });
+}
+
+bool FcitxFbterm::socketCallback() {
+    if (!check_im_message()) {
+        inputWatch_.reset();
+        if (disconnected_) {
+            disconnected_();
+        }
+        return false;
+    }
+    return true;
+}
+
+void FcitxFbterm::outputPending() {
+    if (outputWatch_) {
+        return;
+    }
+    outputWatch_ = addWatch(MainLoop::IOCondition::Output,
+                            &FcitxFbterm::outputCallback);
+}
+
+bool FcitxFbterm::outputCallback() {
+    if (!flush_im_output()) {
+        return true;
+    }
+    outputWatch_.reset();
+    if (redrawPending_ && active_) {
+        updateWindows();
+    }
+    return false;
+}
+
+void FcitxFbterm::fcitx_fbterm_connect_cb() {
+    if (profileStartup_ && !icReadyTime_) {
+        icReadyTime_ = monotonicTime();
+        FCITX_INFO() << "Startup: exec to Connect "
+                     << connectTime_ - startTime_ << "us, Connect to "
+                     << "input context ready " << icReadyTime_ - connectTime_
+                     << "us";
+    }
+    // A new input context, e.g. after fcitx restarted, starts unfocused.
+    focused_ = false;
+    connectTimedOut_ = false;
+    guesses_.clear();
+    leaveDegradedMode();
+    backend_->setCapability(
+        static_cast<uint64_t>(fcitx::CapabilityFlag::ClientSideInputPanel));
+    if (active_) {
+        setFocus(true);
+        replayPendingKeys();
+        flushPassThrough();
+    }
+}
+
+void FcitxFbterm::fcitx_fbterm_commit_string_cb(const char *str) {
+    if (degraded_ && !queuedSignalsIdle_) {
+        // Late results of keys that have been passed through already.
+        return;
+    }
+    // Keys passed through before the commit come first, those after a key
+    // timed out wait for the commits of the keys before it.
+    if (!queuedSignalsIdle_) {
+        flushPassThrough();
+    }
+    put_im_text(str, strlen(str));
+}
+
+void FcitxFbterm::fcitx_fbterm_current_im_cb(const char *name) {
+    state_ = fcitx::KeyState::NoState;
+    std::string_view im = name ? name : "";
+    if (currentIM_ != im) {
+        // Guesses are judged for the input method that made them.
+        cancelSpeculation();
+        currentIM_ = im;
+    }
+}
+
+void FcitxFbterm::fcitx_fbterm_update_client_side_ui_cb(
+    const ClientSideUI &ui) {
+    auxUp_ = ui.auxUp;
+    preedit_ = ui.preedit;
+    preeditCursor_ = ui.cursorPos;
+    if (!guesses_.empty()) {
+        checkSpeculation();
+    }
+    // Keep showing the guesses for keys fcitx hasn't answered yet, the
+    // window is repainted if the preedit differs from the guess drawn.
+    if (guesses_.empty()) {
+        updatePreeditWindow();
+    }
+
+    scratch_.clear();
+    appendPreedit(scratch_, ui.auxDown, -1);
+    for (size_t i = 0; i < ui.candidates.size(); i++) {
+        const auto &item = ui.candidates[i];
+        bool highlight = static_cast<int>(i) == ui.highlight;
+        auto foreground = highlight ? background_ : foreground_;
+        auto background = highlight ? foreground_ : background_;
+        scratch_.append(" ", foreground_, background_);
+        scratch_.append(item.label, foreground, background);
+        scratch_.append(item.text, foreground, background);
+    }
+    updateWindowText(candidateWindow_);
+    // Several updates may be queued after a batch of keys, draw once after
+    // all of them have been handled.
+    scheduleRedraw();
+}
@@ -0,0 +1,407 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 duzhaokun123 <duzhaokun2@outlook.com>
+ * SPDX-FileCopyrightText: 2010~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_FCITXFBTERM_H_
+#define _FCITX5_FBTERM_FCITXFBTERM_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <fcitx-utils/key.h>
+#include <fcitx-utils/misc.h>
+#include "backend.h"
+#include "imapi.h"
+#include "imrecord.h"
+#include "keycode.h"
+#include "lowjitter.h"
+#include "mainloop.h"
+#include "render.h"
+
+struct FcitxFbtermConfig {
+    ColorType foreground = Black;
+    ColorType background = Gray;
+    /// log the startup latencies
+    bool profileStartup = false;
+    /// CLOCK_MONOTONIC usec the process was started, 0 for now
+    uint64_t startTime = 0;
+    /// record the session to this file, @see ImRecorder
+    std::string recordPath;
+    LowJitterConfig lowJitter;
+    /// selects the main loop of the threads serving sessions
+    BackendType backend = DefaultBackendType;
+    /// usec fcitx has to answer a key before it is passed through, 0 waits
+    /// as long as D-Bus does
+    uint64_t keyTimeout = 1000000;
+    /// draw typed letters into the preedit before fcitx answers
+    bool speculate = false;
+    /// usec deactivated before the memory of the session is released, 0 to
+    /// keep it
+    uint64_t idleTrimDelay = 300000000;
+};
+
+/**
+ * The input method server of one FbTerm.
+ *
+ * All sources are added to the loop passed in, so several instances can be
+ * served by different threads each running their own loop.
+ */
+class FcitxFbterm {
+
+    enum {
+        WINID_PREEDIT = 0,
+        WINID_ERROR = 1,
+        WINID_CANDIDATES = 2,
+    };
+
+    /// columns the width of a text window is rounded up to
+    static constexpr unsigned WidthStep = 8;
+    /// redraws with smaller content before a text window shrinks
+    static constexpr unsigned ShrinkDelay = 8;
+
+    /// usec between Pings probing FbTerm while active
+    static constexpr uint64_t ProbeInterval = 1000000;
+    /// FbTerm is stalled if it hasn't answered a Ping for this long
+    static constexpr uint64_t StallTimeout = 500000;
+    /// FbTerm is slow if Pings take this long on average
+    static constexpr uint64_t SlowRoundTrip = 50000;
+    /// shortest delay of redraws while FbTerm is slow or stalled
+    static constexpr uint64_t SlowRedrawDelay = 50000;
+
+    /// usec keys wait for the input context before they are passed through
+    static constexpr uint64_t PendingKeyTimeout = 1000000;
+    /// usec between pings asking a hung fcitx whether it answers again
+    static constexpr uint64_t FcitxProbeInterval = 1000000;
+    /// key events held while waiting for the input context
+    static constexpr size_t MaxPendingKeys = 256;
+
+    /// guesses of an input method judged before it may lose speculation
+    static constexpr unsigned SpeculationWarmup = 16;
+    /// the counts of guesses are halved past this, weighting recent ones
+    static constexpr unsigned SpeculationWindow = 64;
+    /// percentage of guesses that must be right to keep speculating
+    static constexpr unsigned MinSpeculationHitRate = 75;
+
+public:
+    /**
+     * @param loop loop of the calling thread, outlives the object
+     * @param session connection to FbTerm, nullptr for the default one
+     * @param keycodeState keyboard state, nullptr for the default one
+     * @param backend connection to fcitx, nullptr to create one for loop
+     */
+    FcitxFbterm(MainLoop &loop, ImSession *session, KeycodeState *keycodeState,
+                const FcitxFbtermConfig &config,
+                std::unique_ptr<FcitxBackend> backend = nullptr);
+    ~FcitxFbterm();
+
+    /// false if FbTerm's socket is not available
+    bool isValid() const { return imSocket_ != -1; }
+
+    /// called when FbTerm disconnects
+    void setDisconnectedCallback(std::function<void()> callback) {
+        disconnected_ = std::move(callback);
+    }
+
+private:
+    struct RawKey {
+        unsigned short code;
+        char down;
+    };
+
+    /// running hit rate of the preedit guessed for an input method
+    struct SpeculationStats {
+        unsigned guesses = 0;
+        unsigned hits = 0;
+        /// guessed wrong too often, not guessed anymore
+        bool disabled = false;
+    };
+
+    /// a FbTerm window showing one line of text
+    struct TextWindow {
+        explicit TextWindow(unsigned id) : winid(id) {}
+
+        unsigned winid;
+        StyledLine line;
+        /// width allocated for the text, @see WidthStep
+        unsigned columns = 0;
+        unsigned shrinkCount = 0;
+        /// the text or the size changed since the window was drawn
+        bool dirty = false;
+        /// the last frame, relative to the window
+        DisplayList display;
+        /// display needs to be sent, the window moved or FbTerm asked for it
+        bool replay = false;
+    };
+
+    /// makes this instance's session the current one of the thread
+    class ScopedSession {
+    public:
+        explicit ScopedSession(FcitxFbterm *fbterm)
+            : session_(set_current_im_session(fbterm->session_)),
+              keycodeState_(set_current_keycode_state(fbterm->keycodeState_)) {
+        }
+        ~ScopedSession() {
+            set_current_im_session(session_);
+            set_current_keycode_state(keycodeState_);
+        }
+
+    private:
+        ImSession *session_;
+        KeycodeState *keycodeState_;
+    };
+
+    /// the instance of ImCallbacks' data
+    static FcitxFbterm *self(void *data) {
+        return static_cast<FcitxFbterm *>(data);
+    }
+
+    void clearWin(int winid) {
+        constexpr Rectangle rect0{0, 0, 0, 0};
+        setWindow(winid, rect0);
+    }
+
+    /**
+     * @brief send SetWin unless the window already has this geometry
+     * @return true if the geometry changed
+     */
+    bool setWindow(int winid, const Rectangle &rect);
+
+    /// forget the geometry of the windows, FbTerm has none shown
+    void resetWindows();
+
+    /// update the width allocated for the text, @see WidthStep
+    void allocateWindowSize(TextWindow &window);
+
+    /// take the text in scratch_ if it differs from the window's
+    void updateWindowText(TextWindow &window);
+
+    /// place the text windows below the cursor and send their geometry
+    void layoutWindows();
+
+    /// encode the frame of a window into its display list
+    void drawWindow(TextWindow &window);
+
+    /// send the display lists to replay at the windows' position in one write
+    void sendWindows();
+
+    /// lay out the windows and draw those which are dirty
+    void updateWindows();
+
+    std::unique_ptr<LoopSource> addWatch(MainLoop::IOCondition condition,
+                                         bool (FcitxFbterm::*callback)());
+
+    std::unique_ptr<LoopSource> addIdle(void (FcitxFbterm::*callback)());
+
+    std::unique_ptr<LoopSource> addTimer(uint64_t interval,
+                                         void (FcitxFbterm::*callback)());
+
+    void scheduleRedraw();
+
+    void redrawCallback();
+
+    void redrawIdleCallback();
+
+    void warmup();
+
+    /// release the state rebuilt on the next Active, @see idleTrimDelay
+    void trimIdle();
+
+    /// send a Ping unless one is unanswered, which may mean a stall
+    void probeFbterm();
+
+    void pingAcked(uint64_t rtt);
+
+    void recordKeyLatency(uint64_t begin);
+
+    /// tell fcitx if the focus changes, ignored without an input context
+    void setFocus(bool focus);
+
+    void moveRectInScreen(Rectangle &rect);
+
+    void im_active();
+
+    void im_deactive();
+
+    /// @param winid window FbTerm asks to redraw, -1 for all
+    void im_show(unsigned winid);
+
+    void im_hide();
+
+    /// @param cursor byte offset of the caret in items, -1 for none
+    void appendPreedit(StyledLine &line, const std::vector<PreeditItem> &items,
+                       int cursor);
+
+    /// take the preedit fcitx sent last for the preedit window
+    void updatePreeditWindow();
+
+    /**
+     * @brief draw the preedit fcitx is expected to show after keysym, before
+     * asking it, @see FcitxFbtermConfig::speculate
+     * @return true if a guess was drawn
+     */
+    bool speculate(uint32_t keysym);
+
+    /// forget the guesses and go back to the preedit fcitx sent
+    void cancelSpeculation();
+
+    /// compare the guesses with the preedit fcitx sent
+    void checkSpeculation();
+
+    /// update the hit rate of the current input method
+    void recordGuesses(unsigned hits, unsigned misses);
+
+    /// fcitx shows a preedit or candidates
+    bool composing() const;
+
+    void process_raw_key(char *buf, unsigned int len);
+
+    /// send keys to fcitx, those it doesn't handle are written to the terminal
+    void processKeys(const std::vector<RawKey> &keys);
+
+    /// write keys to the terminal without fcitx
+    void passThroughKeys(const std::vector<RawKey> &keys);
+
+    /// add the terminal string of a key to passThrough_
+    void passThroughKey(unsigned short linuxKeysym, char down);
+
+    /// write passThrough_ to the terminal in one PutText
+    void flushPassThrough();
+
+    /// hold rawKeys_ until the input context is ready, @see PendingKeyTimeout
+    void queueKeys();
+
+    /// send the held keys to fcitx
+    void replayPendingKeys();
+
+    /// pass the held keys through
+    void flushPendingKeys();
+
+    void pendingKeysExpired();
+
+    void cursor_pos_changed(unsigned x, unsigned y);
+
+    void update_fbterm_info(::Info *info);
+
+    /// show msg in the error window in place of the input method windows
+    void showError(std::string_view msg);
+
+    void show_cannot_connect_error();
+
+    /// fcitx missed a key deadline, pass keys through until it answers
+    void enterDegradedMode();
+
+    /// write the keys passed through since the timeout, commits are dropped
+    /// from now on until fcitx answers again
+    void queuedSignalsDispatched();
+
+    void leaveDegradedMode();
+
+    /// ping fcitx, leave the degraded mode if it answers in time
+    void probeFcitx();
+
+    bool socketCallback();
+
+    void outputPending();
+
+    bool outputCallback();
+
+    void fcitx_fbterm_connect_cb();
+
+    void fcitx_fbterm_commit_string_cb(const char *str);
+
+    void fcitx_fbterm_current_im_cb(const char *name);
+
+    void fcitx_fbterm_update_client_side_ui_cb(const ClientSideUI &ui);
+
+    MainLoop &loop_;
+    ImSession *session_;
+    KeycodeState *keycodeState_;
+    std::function<void()> disconnected_;
+
+    std::unique_ptr<ImRecorder> recorder_;
+    std::unique_ptr<FcitxBackend> backend_;
+    int imSocket_ = -1;
+    std::unique_ptr<LoopSource> inputWatch_;
+    std::unique_ptr<LoopSource> outputWatch_;
+    std::unique_ptr<LoopSource> warmupSource_;
+    std::unique_ptr<LoopSource> redrawSource_;
+    /// the redraw idle source that has fired, rearmed by scheduleRedraw()
+    std::unique_ptr<LoopSource> redrawIdle_;
+    std::unique_ptr<LoopSource> probeTimer_;
+    std::unique_ptr<LoopSource> pendingTimer_;
+    std::unique_ptr<LoopSource> trimTimer_;
+
+    unsigned fontWidth_;
+    unsigned fontHeight_;
+    unsigned halfFontHeight_;
+    unsigned screenWidth_;
+    unsigned screenHeight_;
+    unsigned cursorx_, cursory_;
+
+    static constexpr char useRawMode = 1;
+    bool active_ = false;
+    // what fcitx was told about the focus of the input context
+    bool focused_ = false;
+    fcitx::KeyState state_;
+    // aux up and preedit
+    TextWindow preeditWindow_{WINID_PREEDIT};
+    // aux down and candidates
+    TextWindow candidateWindow_{WINID_CANDIDATES};
+    // the next text of a window, swapped in when it differs
+    StyledLine scratch_;
+    // geometry last sent with SetWin
+    Rectangle windows_[NR_IM_WINS] = {};
+    ColorType foreground_;
+    ColorType background_;
+    // redraw skipped because fbterm is not reading the socket
+    bool redrawPending_ = false;
+    // fbterm answers Pings late, redraws are deferred
+    bool fbtermSlow_ = false;
+    // keys of the SendKey message being processed
+    std::vector<RawKey> rawKeys_;
+    // terminal strings of the keys passed through in the current batch
+    std::string passThrough_;
+    // keys typed before the input context was ready, in order
+    std::vector<RawKey> pendingKeys_;
+    // the input context didn't come in time, keys are passed through
+    bool connectTimedOut_ = false;
+    // usec, @see FcitxFbtermConfig::keyTimeout
+    uint64_t keyTimeout_;
+    // fcitx didn't answer a key in time, keys are passed through
+    bool degraded_ = false;
+    // set until the signals received before the key timed out have been
+    // dispatched, their commits are still written
+    std::unique_ptr<LoopSource> queuedSignalsIdle_;
+    std::unique_ptr<LoopSource> fcitxProbeTimer_;
+    // the last preedit fcitx sent, the window may show a guess instead
+    std::vector<PreeditItem> auxUp_;
+    std::vector<PreeditItem> preedit_;
+    int preeditCursor_ = -1;
+    // @see FcitxFbtermConfig::speculate
+    bool speculate_;
+    // preedit texts guessed for the keys sent since the last update, oldest
+    // first
+    std::vector<std::string> guesses_;
+    std::string currentIM_;
+    std::unordered_map<std::string, SpeculationStats> speculationStats_;
+
+    // startup profiling, CLOCK_MONOTONIC usec
+    static constexpr uint64_t ProfiledKeys = 32;
+    bool profileStartup_;
+    LowJitterConfig lowJitter_;
+    uint64_t idleTrimDelay_;
+    uint64_t startTime_;
+    uint64_t connectTime_ = 0;
+    uint64_t icReadyTime_ = 0;
+    uint64_t keyCount_ = 0;
+    uint64_t keyTime_ = 0;
+};
+
+#endif // _FCITX5_FBTERM_FCITXFBTERM_H_
@@ -0,0 +1,220 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 duzhaokun123 <duzhaokun2@outlook.com>
+ * SPDX-FileCopyrightText: 2010~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include <algorithm>
+#include <fcitx-gclient/fcitxgclient.h>
+#include <fcitx-utils/misc.h>
+#include <gio/gio.h>
+#include "backend.h"
+
+namespace {
+
+constexpr char FcitxService[] = "org.fcitx.Fcitx5";
+constexpr char PortalService[] = "org.freedesktop.portal.Fcitx";
+
+void fillPreeditItems(std::vector<PreeditItem> &items,
+                      const GPtrArray *array) {
+    items.resize(array->len);
+    for (guint i = 0; i < array->len; i++) {
+        const auto *item =
+            static_cast<FcitxGPreeditItem *>(g_ptr_array_index(array, i));
+        items[i].text = item->string;
+        items[i].format = item->type;
+    }
+}
+
+class GClientBackend : public FcitxBackend {
+public:
+    GClientBackend() : client_(fcitx_g_client_new()) {
+        fcitx_g_client_set_program(client_.get(), "fbterm");
+        fcitx_g_client_set_display(client_.get(), "fbterm");
+
+        g_signal_connect(
+            client_.get(), "connected",
+            G_CALLBACK(+[](FcitxGClient *, void *user_data) {
+                auto *that = static_cast<GClientBackend *>(user_data);
+                if (that->callbacks_.connected) {
+                    that->callbacks_.connected();
+                }
+            }),
+            this);
+        g_signal_connect(
+            client_.get(), "commit-string",
+            G_CALLBACK(+[](FcitxGClient *, char *str, void *user_data) {
+                auto *that = static_cast<GClientBackend *>(user_data);
+                if (that->callbacks_.commitString) {
+                    that->callbacks_.commitString(str);
+                }
+            }),
+            this);
+        g_signal_connect(
+            client_.get(), "current-im",
+            G_CALLBACK(+[](FcitxGClient *, char *name, char *uniqueName,
+                           char *langCode, void *user_data) {
+                auto *that = static_cast<GClientBackend *>(user_data);
+                if (that->callbacks_.currentIM) {
+                    that->callbacks_.currentIM(name, uniqueName, langCode);
+                }
+            }),
+            this);
+        g_signal_connect(
+            client_.get(), "update-client-side-ui",
+            G_CALLBACK(+[](FcitxGClient *, GPtrArray *preedit, int cursorPos,
+                           GPtrArray *auxUp, GPtrArray *auxDown,
+                           GPtrArray *candidates, int highlight,
+                           int layoutHint, gboolean hasPrev, gboolean hasNext,
+                           void *user_data) {
+                auto *that = static_cast<GClientBackend *>(user_data);
+                auto &ui = that->ui_;
+                fillPreeditItems(ui.preedit, preedit);
+                ui.cursorPos = cursorPos;
+                fillPreeditItems(ui.auxUp, auxUp);
+                fillPreeditItems(ui.auxDown, auxDown);
+                ui.candidates.resize(candidates->len);
+                for (guint i = 0; i < candidates->len; i++) {
+                    const auto *item = static_cast<FcitxGCandidateItem *>(
+                        g_ptr_array_index(candidates, i));
+                    ui.candidates[i].label = item->label;
+                    ui.candidates[i].text = item->candidate;
+                }
+                ui.highlight = highlight;
+                ui.layoutHint = layoutHint;
+                ui.hasPrev = hasPrev;
+                ui.hasNext = hasNext;
+                if (that->callbacks_.updateClientSideUI) {
+                    that->callbacks_.updateClientSideUI(ui);
+                }
+            }),
+            this);
+    }
+
+    ~GClientBackend() {
+        g_signal_handlers_disconnect_by_data(client_.get(), this);
+        g_cancellable_cancel(cancellable_.get());
+    }
+
+    bool isValid() const override {
+        return fcitx_g_client_is_valid(client_.get());
+    }
+
+    void focusIn() override { fcitx_g_client_focus_in(client_.get()); }
+
+    void focusOut() override { fcitx_g_client_focus_out(client_.get()); }
+
+    void setCapability(uint64_t capability) override {
+        fcitx_g_client_set_capability(client_.get(), capability);
+    }
+
+    int processKeySync(uint32_t keysym, uint32_t keycode, uint32_t state,
+                       bool isRelease, uint32_t time,
+                       uint64_t timeout) override {
+        if (!timeout) {
+            return fcitx_g_client_process_key_sync(
+                client_.get(), keysym, keycode, state, isRelease, time);
+        }
+        // What fcitx_g_client_process_key_sync() does, with a timeout: the
+        // reply is dispatched on a context of our own so that nothing else
+        // runs while waiting.
+        struct Call {
+            FcitxGClient *client;
+            int result = -1;
+            bool done = false;
+        } call{client_.get()};
+        auto *context = g_main_context_new();
+        g_main_context_push_thread_default(context);
+        auto begin = g_get_monotonic_time();
+        fcitx_g_client_process_key(
+            client_.get(), keysym, keycode, state, isRelease, time,
+            std::max<gint>(timeout / 1000, 1), nullptr,
+            [](GObject *, GAsyncResult *result, gpointer user_data) {
+                auto *call = static_cast<Call *>(user_data);
+                call->result =
+                    fcitx_g_client_process_key_finish(call->client, result);
+                call->done = true;
+            },
+            &call);
+        while (!call.done) {
+            g_main_context_iteration(context, TRUE);
+        }
+        g_main_context_pop_thread_default(context);
+        g_main_context_unref(context);
+        // The finish function doesn't tell errors from unhandled keys.
+        if (!call.result &&
+            static_cast<uint64_t>(g_get_monotonic_time() - begin) >= timeout) {
+            return KeyTimedOut;
+        }
+        return call.result;
+    }
+
+    void ping(uint64_t timeout, std::function<void(bool)> callback) override {
+        if (!connection_) {
+            connection_.reset(g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr,
+                                             nullptr));
+            if (!connection_) {
+                return;
+            }
+        }
+        // FcitxGClient doesn't tell which name it uses, ask both, the one
+        // without owner fails at once.
+        auto *call = new PingCall{std::move(callback), cancellable_.get()};
+        g_object_ref(call->cancellable);
+        for (const char *name : {FcitxService, PortalService}) {
+            call->pending++;
+            g_dbus_connection_call(
+                connection_.get(), name, "/", "org.freedesktop.DBus.Peer",
+                "Ping", nullptr, nullptr, G_DBUS_CALL_FLAGS_NONE,
+                std::max<int>(timeout / 1000, 1), call->cancellable,
+                &GClientBackend::pingReplied, call);
+        }
+    }
+
+private:
+    struct PingCall {
+        std::function<void(bool)> callback;
+        GCancellable *cancellable;
+        int pending = 0;
+        bool answered = false;
+    };
+
+    static void pingReplied(GObject *source, GAsyncResult *result,
+                            gpointer user_data) {
+        auto *call = static_cast<PingCall *>(user_data);
+        GError *error = nullptr;
+        if (auto *reply = g_dbus_connection_call_finish(
+                G_DBUS_CONNECTION(source), result, &error)) {
+            g_variant_unref(reply);
+            call->answered = true;
+        } else {
+            g_error_free(error);
+        }
+        // The backend is gone once the call is cancelled.
+        if (--call->pending && !call->answered) {
+            return;
+        }
+        if (call->callback && !g_cancellable_is_cancelled(call->cancellable)) {
+            auto callback = std::move(call->callback);
+            callback(call->answered);
+        }
+        if (!call->pending) {
+            g_object_unref(call->cancellable);
+            delete call;
+        }
+    }
+
+    fcitx::UniqueCPtr<FcitxGClient, &g_object_unref> client_;
+    fcitx::UniqueCPtr<GDBusConnection, &g_object_unref> connection_;
+    fcitx::UniqueCPtr<GCancellable, &g_object_unref> cancellable_{
+        g_cancellable_new()};
+    ClientSideUI ui_;
+};
+
+} // namespace
+
+std::unique_ptr<FcitxBackend> createGClientBackend() {
+    return std::make_unique<GClientBackend>();
+}
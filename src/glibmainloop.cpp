@@ -0,0 +1,125 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include <fcitx-utils/misc.h>
+#include <glib.h>
+#include "mainloop.h"
+
+namespace {
+
+class GLibLoopSource : public LoopSource {
+public:
+    explicit GLibLoopSource(GSource *source) : source_(source) {}
+
+    ~GLibLoopSource() {
+        g_source_destroy(source_);
+        g_source_unref(source_);
+    }
+
+private:
+    GSource *source_;
+};
+
+/// runs a GMainContext, made the thread default one while running
+class GLibMainLoop : public MainLoop {
+public:
+    explicit GLibMainLoop(bool ownContext)
+        : context_(ownContext ? g_main_context_new()
+                              : g_main_context_ref(g_main_context_default())),
+          loop_(g_main_loop_new(context_.get(), false)) {}
+
+    std::unique_ptr<LoopSource>
+    addWatch(int fd, IOCondition condition,
+             std::function<bool()> callback) override {
+        fcitx::UniqueCPtr<GIOChannel, &g_io_channel_unref> channel(
+            g_io_channel_unix_new(fd));
+        GSource *source = g_io_create_watch(
+            channel.get(),
+            static_cast<GIOCondition>(
+                (condition == IOCondition::Input ? G_IO_IN : G_IO_OUT) |
+                G_IO_HUP | G_IO_ERR));
+        g_source_set_callback(
+            source,
+            G_SOURCE_FUNC(
+                +[](GIOChannel *, GIOCondition, gpointer data) -> gboolean {
+                    return (*static_cast<std::function<bool()> *>(data))();
+                }),
+            new std::function<bool()>(std::move(callback)),
+            [](gpointer data) {
+                delete static_cast<std::function<bool()> *>(data);
+            });
+        g_source_attach(source, context_.get());
+        return std::make_unique<GLibLoopSource>(source);
+    }
+
+    std::unique_ptr<LoopSource>
+    addIdle(std::function<void()> callback) override {
+        return std::make_unique<GLibLoopSource>(
+            attachIdle(std::move(callback)));
+    }
+
+    std::unique_ptr<LoopSource>
+    addTimer(uint64_t interval, std::function<void()> callback) override {
+        GSource *source = g_timeout_source_new(interval / 1000);
+        g_source_set_callback(
+            source,
+            [](gpointer data) -> gboolean {
+                (*static_cast<std::function<void()> *>(data))();
+                return true;
+            },
+            new std::function<void()>(std::move(callback)),
+            [](gpointer data) {
+                delete static_cast<std::function<void()> *>(data);
+            });
+        g_source_attach(source, context_.get());
+        return std::make_unique<GLibLoopSource>(source);
+    }
+
+    void invoke(std::function<void()> callback) override {
+        g_source_unref(attachIdle(std::move(callback)));
+    }
+
+    void run() override {
+        g_main_context_push_thread_default(context_.get());
+        g_main_loop_run(loop_.get());
+        g_main_context_pop_thread_default(context_.get());
+    }
+
+    void quit() override { g_main_loop_quit(loop_.get()); }
+
+    std::unique_ptr<FcitxBackend> createBackend() override {
+        // FcitxGClient uses the thread default context, which is ours when
+        // called from the loop or when it is the default one.
+        return createGClientBackend();
+    }
+
+private:
+    GSource *attachIdle(std::function<void()> callback) {
+        GSource *source = g_idle_source_new();
+        g_source_set_callback(
+            source,
+            [](gpointer data) -> gboolean {
+                (*static_cast<std::function<void()> *>(data))();
+                return false;
+            },
+            new std::function<void()>(std::move(callback)),
+            [](gpointer data) {
+                delete static_cast<std::function<void()> *>(data);
+            });
+        g_source_attach(source, context_.get());
+        return source;
+    }
+
+    fcitx::UniqueCPtr<GMainContext, &g_main_context_unref> context_;
+    fcitx::UniqueCPtr<GMainLoop, &g_main_loop_unref> loop_;
+};
+
+} // namespace
+
+std::unique_ptr<MainLoop> createGLibMainLoop(bool ownContext) {
+    return std::make_unique<GLibMainLoop>(ownContext);
+}
@@ -8,28 +8,97 @@
 
 #include "imapi.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
-#include <fcitx-utils/fs.h>
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <string>
+#include "imcodec.h"
+#include "imrecord.h"
+#include "metrics.h"
+#include "utils.h"
+
+static const ImCallbacks no_callbacks = {};
+
+struct ImSession {
+    int imfd = -1;
+    const ImCallbacks *cbs = &no_callbacks;
+    void *cb_data = nullptr;
+    char pending_msg_buf[10240];
+    unsigned pending_msg_buf_len = 0;
+    int im_active = 0;
+
+    /// messages that could not be written because FbTerm is not reading
+    std::string outbound;
+    ImOutputStats output_stats = {};
+
+    /// send times of the unanswered Pings, answered in order
+    std::deque<uint64_t> ping_sent;
+    ImPingStats ping_stats = {};
+
+    ImRecorder *recorder = nullptr;
+};
+
+/// the session of the process started by FbTerm, @see get_im_socket()
+static ImSession default_session;
+static thread_local ImSession *session = &default_session;
+
+/// queue depth above which im_output_congested() reports congestion
+#define OUTPUT_HIGH_WATER 16384
+
+/// weight of a new round trip in ImPingStats::smoothed_rtt, 1/8 as in TCP
+#define PING_RTT_SHIFT 3
 
-#define OFFSET(TYPE, MEMBER) ((size_t)(&(((TYPE *)0)->MEMBER)))
-#define MSG(a) ((Message *)(a))
+static void wait_message(MessageType type);
+static void send_message(const ImOutMessage &msg);
+static void send_ping();
 
-static int imfd = -1;
-static ImCallbacks cbs;
-static char pending_msg_buf[10240];
-static unsigned pending_msg_buf_len = 0;
-static int im_active = 0;
+static void set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-static void wait_message(MessageType type);
+ImSession *im_session_new(int fd) {
+    ImSession *s = new ImSession;
+    s->imfd = fd;
+    if (fd != -1)
+        set_nonblock(fd);
+    return s;
+}
 
-void register_im_callbacks(ImCallbacks callbacks) { cbs = callbacks; }
+void im_session_free(ImSession *s) {
+    if (!s || s == &default_session)
+        return;
+    if (session == s)
+        session = &default_session;
+    if (s->imfd != -1)
+        close(s->imfd);
+    delete s;
+}
+
+ImSession *set_current_im_session(ImSession *s) {
+    ImSession *old = session;
+    session = s ? s : &default_session;
+    return old;
+}
+
+void set_im_recorder(ImRecorder *recorder) { session->recorder = recorder; }
+
+void register_im_callbacks(const ImCallbacks *callbacks, void *data) {
+    session->cbs = callbacks ? callbacks : &no_callbacks;
+    session->cb_data = data;
+}
 
 int get_im_socket() {
     static char init = 0;
-    if (!init) {
+    if (session == &default_session && !init) {
         init = 1;
 
         char *val = getenv("FBTERM_IM_SOCKET");
@@ -37,163 +106,388 @@ int get_im_socket() {
             char *tail;
             int fd = strtol(val, &tail, 0);
             if (!*tail)
-                imfd = fd;
+                session->imfd = fd;
         }
+
+        if (session->imfd != -1)
+            set_nonblock(session->imfd);
     }
 
-    return imfd;
+    return session->imfd;
 }
 
 void connect_fbterm(char raw) {
     get_im_socket();
-    if (imfd == -1)
+    if (session->imfd == -1)
         return;
 
-    Message msg;
-    msg.type = Connect;
-    msg.len = sizeof(msg);
-    msg.raw = (raw ? 1 : 0);
-    fcitx::fs::safeWrite(imfd, (char *)&msg, sizeof(msg));
+    auto msg = imEncode<Connect>();
+    msg.header.raw = (raw ? 1 : 0);
+    send_message(msg);
 }
 
 void put_im_text(const char *text, unsigned len) {
-    if (imfd == -1 || !im_active || !text || !len ||
-        (OFFSET(Message, texts) + len > UINT16_MAX))
+    if (session->imfd == -1 || !session->im_active || !text || !len ||
+        len > ImMaxPayload<PutText>)
         return;
 
-    char buf[OFFSET(Message, texts) + len];
-
-    MSG(buf)->type = PutText;
-    MSG(buf)->len = sizeof(buf);
-    memcpy(MSG(buf)->texts, text, len);
-
-    fcitx::fs::safeWrite(imfd, buf, MSG(buf)->len);
+    send_message(imEncode<PutText>(std::string_view(text, len)));
 }
 
 void set_im_window(unsigned id, Rectangle rect) {
-    if (imfd == -1 || !im_active || id >= NR_IM_WINS)
+    if (session->imfd == -1 || !session->im_active || id >= NR_IM_WINS)
         return;
 
-    Message msg;
-    msg.type = SetWin;
-    msg.len = sizeof(msg);
-    msg.win.winid = id;
-    msg.win.rect = rect;
+    auto msg = imEncode<SetWin>();
+    msg.header.win.winid = id;
+    msg.header.win.rect = rect;
 
-    fcitx::fs::safeWrite(imfd, (char *)&msg, sizeof(msg));
+    uint64_t begin = monotonicTime();
+    send_message(msg);
     wait_message(AckWin);
+    metricAdd(metrics.setWinRoundTrips);
+    metricAdd(metrics.setWinLatencySum, monotonicTime() - begin);
 }
 
 void fill_rect(Rectangle rect, unsigned char color) {
-    Message msg;
-    msg.type = FillRect;
-    msg.len = sizeof(msg);
-
-    msg.fillRect.rect = rect;
-    msg.fillRect.color = color;
+    auto msg = imEncode<FillRect>();
+    msg.header.fillRect.rect = rect;
+    msg.header.fillRect.color = color;
 
-    fcitx::fs::safeWrite(imfd, (char *)&msg, sizeof(msg));
+    send_message(msg);
 }
 
 void draw_text(unsigned x, unsigned y, unsigned char fc, unsigned char bc,
                const char *text, unsigned len) {
-    if (!text || !len)
+    if (!text || !len || len > ImMaxPayload<DrawText>)
         return;
 
-    char buf[OFFSET(Message, drawText.texts) + len];
+    auto msg = imEncode<DrawText>(std::string_view(text, len));
+    msg.header.drawText.x = x;
+    msg.header.drawText.y = y;
+    msg.header.drawText.fc = fc;
+    msg.header.drawText.bc = bc;
 
-    MSG(buf)->type = DrawText;
-    MSG(buf)->len = sizeof(buf);
+    send_message(msg);
+}
 
-    MSG(buf)->drawText.x = x;
-    MSG(buf)->drawText.y = y;
-    MSG(buf)->drawText.fc = fc;
-    MSG(buf)->drawText.bc = bc;
-    memcpy(MSG(buf)->drawText.texts, text, len);
+/// drop the first len bytes of iov
+static void consume_iovecs(iovec *iov, int count, size_t len) {
+    for (int i = 0; i < count && len; i++) {
+        size_t n = std::min(len, iov[i].iov_len);
+        iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + n;
+        iov[i].iov_len -= n;
+        len -= n;
+    }
+}
 
-    fcitx::fs::safeWrite(imfd, buf, MSG(buf)->len);
+/**
+ * write as much of iov as the socket accepts without blocking, what was
+ * written is consumed from iov
+ * @return bytes written, or -1 if the socket is broken
+ */
+static ssize_t write_nonblock(iovec *iov, int count) {
+    size_t written = 0;
+    while (count) {
+        if (!iov->iov_len) {
+            iov++;
+            count--;
+            continue;
+        }
+        struct msghdr hdr = {};
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = count;
+        ssize_t ret = sendmsg(session->imfd, &hdr, MSG_NOSIGNAL);
+        if (ret > 0) {
+            written += ret;
+            consume_iovecs(iov, count, ret);
+        } else if (ret == -1 && errno == EINTR) {
+            continue;
+        } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            session->output_stats.blocked_writes++;
+            break;
+        } else {
+            return -1;
+        }
+    }
+    session->output_stats.written_bytes += written;
+    return written;
 }
 
-static int process_message(Message *msg) {
-    int exit = 0;
+static void update_queue_stats() {
+    ImOutputStats &stats = session->output_stats;
+    stats.queued_bytes = session->outbound.size();
+    if (stats.queued_bytes > stats.queue_high_water)
+        stats.queue_high_water = stats.queued_bytes;
+    metricMax(metrics.outputQueueHighWater, stats.queued_bytes);
+}
 
-    switch (msg->type) {
-    case Disconnect:
-        close(imfd);
-        imfd = -1;
-        exit = 1;
-        break;
+static void count_message(unsigned short type, size_t size) {
+    if (type < MetricsMessageTypes) {
+        metricAdd(metrics.messagesWritten[type]);
+        metricAdd(metrics.bytesWritten[type], size);
+    }
+}
 
-    case FbTermInfo:
-        if (cbs.fbterm_info) {
-            cbs.fbterm_info(&msg->info);
-        }
-        break;
+/// write iov, or queue what FbTerm doesn't take right away
+static void send_iovecs(iovec *iov, int count) {
+    bool was_empty = session->outbound.empty();
+    if (was_empty && write_nonblock(iov, count) == -1)
+        return;
+    for (int i = 0; i < count; i++)
+        session->outbound.append(static_cast<char *>(iov[i].iov_base),
+                                 iov[i].iov_len);
+    if (session->outbound.empty())
+        return;
+    update_queue_stats();
 
-    case Active:
-        im_active = 1;
-        if (cbs.active) {
-            cbs.active();
-        }
-        break;
+    if (was_empty && session->cbs->output_pending) {
+        session->cbs->output_pending(session->cb_data);
+    }
+}
 
-    case Deactive:
-        if (cbs.deactive) {
-            cbs.deactive();
-        }
-        im_active = 0;
-        break;
+static void send_message(const ImOutMessage &msg) {
+    if (session->imfd == -1)
+        return;
 
-    case ShowUI:
-        if (im_active && cbs.show_ui) {
-            cbs.show_ui(msg->winid);
-        }
-        break;
+    iovec iov[2];
+    int count = msg.toIovec(iov);
 
-    case HideUI: {
-        if (im_active && cbs.hide_ui) {
-            cbs.hide_ui();
+    if (session->recorder)
+        session->recorder->append(RecordFbtermOut, iov, count);
+    count_message(msg.type(), msg.size());
+
+    // The payload is only copied when FbTerm doesn't take it right away.
+    send_iovecs(iov, count);
+}
+
+void send_im_messages(iovec *iov, int count) {
+    if (session->imfd == -1 || count <= 0)
+        return;
+
+    // Recorded and counted one message at a time, as if sent one by one.
+    for (int i = 0; i < count; i++) {
+        std::string_view data(static_cast<const char *>(iov[i].iov_base),
+                              iov[i].iov_len);
+        ImInMessage msg;
+        ssize_t len;
+        while ((len = imDecode(data, msg)) > 0) {
+            if (session->recorder)
+                session->recorder->append(RecordFbtermOut, data.data(), len);
+            count_message(msg.type(), len);
+            data.remove_prefix(len);
         }
+    }
 
-        Message msg;
-        msg.type = AckHideUI;
-        msg.len = sizeof(msg);
-        fcitx::fs::safeWrite(imfd, (char *)&msg, sizeof(msg));
-        break;
+    send_iovecs(iov, count);
+}
+
+int flush_im_output() {
+    if (session->imfd == -1) {
+        session->outbound.clear();
+        update_queue_stats();
+        return 1;
     }
 
-    case SendKey:
-        if (im_active && cbs.send_key) {
-            cbs.send_key(msg->keys, msg->len - OFFSET(Message, keys));
-        }
-        break;
+    iovec iov;
+    iov.iov_base = session->outbound.data();
+    iov.iov_len = session->outbound.size();
+    ssize_t written = write_nonblock(&iov, 1);
+    if (written == -1)
+        session->outbound.clear();
+    else
+        session->outbound.erase(0, written);
+    update_queue_stats();
+
+    return session->outbound.empty();
+}
 
-    case CursorPosition:
-        if (im_active && cbs.cursor_position) {
-            cbs.cursor_position(msg->cursor.x, msg->cursor.y);
-        }
-        break;
+int im_output_congested() {
+    return session->outbound.size() >= OUTPUT_HIGH_WATER;
+}
 
-    case TermMode:
-        if (im_active && cbs.term_mode) {
-            cbs.term_mode(msg->term.crWithLf, msg->term.applicKeypad,
-                          msg->term.cursorEscO);
-        }
-        break;
+const ImOutputStats *get_im_output_stats() { return &session->output_stats; }
 
-    default:
-        break;
+static void send_ping() {
+    send_message(imEncode<Ping>());
+
+    uint64_t now = monotonicTime();
+    if (session->ping_sent.empty())
+        session->ping_stats.oldest_sent = now;
+    session->ping_sent.push_back(now);
+    session->ping_stats.outstanding = session->ping_sent.size();
+}
+
+void send_im_ping() {
+    if (session->imfd == -1)
+        return;
+    send_ping();
+}
+
+const ImPingStats *get_im_ping_stats() { return &session->ping_stats; }
+
+static void process_ping_ack() {
+    if (session->ping_sent.empty())
+        return;
+
+    ImPingStats &stats = session->ping_stats;
+    uint64_t rtt = monotonicTime() - session->ping_sent.front();
+    session->ping_sent.pop_front();
+    stats.outstanding = session->ping_sent.size();
+    stats.oldest_sent =
+        session->ping_sent.empty() ? 0 : session->ping_sent.front();
+    stats.last_rtt = rtt;
+    if (!stats.smoothed_rtt)
+        stats.smoothed_rtt = rtt;
+    else
+        stats.smoothed_rtt += ((int64_t)rtt - (int64_t)stats.smoothed_rtt) /
+                              (1 << PING_RTT_SHIFT);
+    metricLatency(metrics.pingRoundTrips, rtt);
+
+    if (session->cbs->ping_ack) {
+        session->cbs->ping_ack(session->cb_data, rtt);
     }
+}
 
-    return exit;
+void prefault_im_buffers() {
+    memset(session->pending_msg_buf + session->pending_msg_buf_len, 0,
+           sizeof(session->pending_msg_buf) - session->pending_msg_buf_len);
+    session->outbound.reserve(OUTPUT_HIGH_WATER * 2);
 }
 
-static int process_messages(char *buf, int len) {
-    char *cur = buf, *end = cur + len;
+void trim_im_buffers() {
+    if (session->outbound.empty())
+        std::string().swap(session->outbound);
+    if (session->ping_sent.empty())
+        std::deque<uint64_t>().swap(session->ping_sent);
+}
+
+const char *message_type_name(unsigned type) {
+    static const char *names[] = {
+        "Connect",  "Disconnect", "Active",         "Deactive",
+        "SendKey",  "PutText",    "SetWin",         "AckWin",
+        "CursorPosition",         "FbTermInfo",     "TermMode",
+        "ShowUI",   "HideUI",     "AckHideUI",      "FillRect",
+        "DrawText", "Ping",       "AckPing"};
+    if (type >= sizeof(names) / sizeof(names[0]))
+        return "Unknown";
+    return names[type];
+}
+
+/// @return non-zero if FbTerm has disconnected
+using MessageHandler = int (*)(const ImInMessage &msg);
+
+static int on_disconnect(const ImInMessage &) {
+    close(session->imfd);
+    session->imfd = -1;
+    return 1;
+}
+
+static int on_active(const ImInMessage &) {
+    session->im_active = 1;
+    if (session->cbs->active)
+        session->cbs->active(session->cb_data);
+    return 0;
+}
+
+static int on_deactive(const ImInMessage &) {
+    if (session->cbs->deactive)
+        session->cbs->deactive(session->cb_data);
+    session->im_active = 0;
+    return 0;
+}
+
+static int on_send_key(const ImInMessage &msg) {
+    if (session->im_active && session->cbs->send_key)
+        session->cbs->send_key(session->cb_data,
+                               const_cast<char *>(msg.payload.data()),
+                               msg.payload.size());
+    return 0;
+}
+
+static int on_cursor_position(const ImInMessage &msg) {
+    if (session->im_active && session->cbs->cursor_position)
+        session->cbs->cursor_position(session->cb_data, msg.header.cursor.x,
+                                      msg.header.cursor.y);
+    return 0;
+}
+
+static int on_fbterm_info(const ImInMessage &msg) {
+    if (session->cbs->fbterm_info) {
+        Info info = msg.header.info;
+        session->cbs->fbterm_info(session->cb_data, &info);
+    }
+    return 0;
+}
+
+static int on_term_mode(const ImInMessage &msg) {
+    if (session->im_active && session->cbs->term_mode)
+        session->cbs->term_mode(session->cb_data, msg.header.term.crWithLf,
+                                msg.header.term.applicKeypad,
+                                msg.header.term.cursorEscO);
+    return 0;
+}
+
+static int on_show_ui(const ImInMessage &msg) {
+    if (session->im_active && session->cbs->show_ui)
+        session->cbs->show_ui(session->cb_data, msg.header.winid);
+    return 0;
+}
+
+static int on_hide_ui(const ImInMessage &) {
+    if (session->im_active && session->cbs->hide_ui)
+        session->cbs->hide_ui(session->cb_data);
+    send_message(imEncode<AckHideUI>());
+    return 0;
+}
+
+static int on_ack_ping(const ImInMessage &) {
+    process_ping_ack();
+    return 0;
+}
+
+/// handlers of the messages FbTerm sends, indexed by MessageType
+static constexpr MessageHandler message_handlers[] = {
+    nullptr,            // Connect
+    on_disconnect,      // Disconnect
+    on_active,          // Active
+    on_deactive,        // Deactive
+    on_send_key,        // SendKey
+    nullptr,            // PutText
+    nullptr,            // SetWin
+    nullptr,            // AckWin
+    on_cursor_position, // CursorPosition
+    on_fbterm_info,     // FbTermInfo
+    on_term_mode,       // TermMode
+    on_show_ui,         // ShowUI
+    on_hide_ui,         // HideUI
+    nullptr,            // AckHideUI
+    nullptr,            // FillRect
+    nullptr,            // DrawText
+    nullptr,            // Ping
+    on_ack_ping,        // AckPing
+};
+static_assert(std::size(message_handlers) == AckPing + 1);
+
+static int process_message(const ImInMessage &msg, std::string_view raw) {
+    if (session->recorder)
+        session->recorder->append(RecordFbtermIn, raw.data(), raw.size());
+
+    unsigned type = msg.header.type;
+    if (type < std::size(message_handlers) && message_handlers[type])
+        return message_handlers[type](msg);
+    return 0;
+}
+
+static int process_messages(const char *buf, int len) {
+    std::string_view data(buf, len);
+    ImInMessage msg;
+    ssize_t msg_len;
     int exit = 0;
 
-    for (; cur < end && MSG(cur)->len <= (end - cur); cur += MSG(cur)->len) {
-        exit |= process_message(MSG(cur));
+    while ((msg_len = imDecode(data, msg)) > 0) {
+        exit |= process_message(msg, data.substr(0, msg_len));
+        data.remove_prefix(msg_len);
     }
 
     return exit;
@@ -202,63 +496,91 @@ static int process_messages(char *buf, int len) {
 static void wait_message(MessageType type) {
     int ack = 0;
     while (!ack) {
-        char *cur = pending_msg_buf + pending_msg_buf_len;
-        int len =
-            read(imfd, cur, sizeof(pending_msg_buf) - pending_msg_buf_len);
+        // the socket is non-blocking, so wait here and keep draining queued
+        // output, FbTerm won't answer a message it hasn't received yet.
+        struct pollfd pfd;
+        pfd.fd = session->imfd;
+        pfd.events = POLLIN | (session->outbound.empty() ? 0 : POLLOUT);
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            close(session->imfd);
+            session->imfd = -1;
+            return;
+        }
+
+        if (pfd.revents & POLLOUT)
+            flush_im_output();
+
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        char *cur = session->pending_msg_buf + session->pending_msg_buf_len;
+        int len = read(session->imfd, cur,
+                       sizeof(session->pending_msg_buf) -
+                           session->pending_msg_buf_len);
 
         if (len == -1 && (errno == EAGAIN || errno == EINTR))
             continue;
         else if (len <= 0) {
-            close(imfd);
-            imfd = -1;
+            close(session->imfd);
+            session->imfd = -1;
             return;
         }
 
-        pending_msg_buf_len += len;
-
-        char *end = cur + len;
-        for (; cur < end && MSG(cur)->len <= (end - cur);
-             cur += MSG(cur)->len) {
-            if (MSG(cur)->type == type) {
-                memcpy(cur, cur + MSG(cur)->len, end - cur - MSG(cur)->len);
-                pending_msg_buf_len -= MSG(cur)->len;
+        session->pending_msg_buf_len += len;
+        metricMax(metrics.pendingInputHighWater,
+                  session->pending_msg_buf_len);
+
+        std::string_view data(cur, len);
+        ImInMessage msg;
+        ssize_t msg_len;
+        while ((msg_len = imDecode(data, msg)) > 0) {
+            if (msg.header.type == type) {
+                char *found = const_cast<char *>(data.data());
+                if (session->recorder)
+                    session->recorder->append(RecordFbtermIn, found,
+                                              msg_len);
+                memmove(found, found + msg_len, data.size() - msg_len);
+                session->pending_msg_buf_len -= msg_len;
 
                 ack = 1;
                 break;
             }
+            data.remove_prefix(msg_len);
         }
     }
 
-    if (pending_msg_buf_len) {
-        Message msg;
-        msg.type = Ping;
-        msg.len = sizeof(msg);
-        fcitx::fs::safeWrite(imfd, (char *)&msg, sizeof(msg));
-    }
+    // Messages read while waiting are left in the buffer, make sure the
+    // socket becomes readable again so that they are processed.
+    if (session->pending_msg_buf_len)
+        send_ping();
 }
 
 int check_im_message() {
-    if (imfd == -1)
+    if (session->imfd == -1)
         return 0;
 
-    char buf[sizeof(pending_msg_buf)];
+    char buf[sizeof(session->pending_msg_buf)];
     int len, exit = 0;
 
-    if (pending_msg_buf_len) {
-        len = pending_msg_buf_len;
-        pending_msg_buf_len = 0;
+    if (session->pending_msg_buf_len) {
+        len = session->pending_msg_buf_len;
+        session->pending_msg_buf_len = 0;
 
-        memcpy(buf, pending_msg_buf, len);
+        memcpy(buf, session->pending_msg_buf, len);
         exit |= process_messages(buf, len);
     }
 
-    len = read(imfd, buf, sizeof(buf));
+    len = read(session->imfd, buf, sizeof(buf));
 
     if (len == -1 && (errno == EAGAIN || errno == EINTR))
         return 1;
     else if (len <= 0) {
-        close(imfd);
-        imfd = -1;
+        close(session->imfd);
+        session->imfd = -1;
         return 0;
     }
 
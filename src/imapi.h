@@ -14,44 +14,88 @@
 #ifndef IM_API_H
 #define IM_API_H
 
-#include <functional>
+#include <stdint.h>
+#include <sys/uio.h>
 #include "immessage.h"
 
-using ActiveFun = void();
-using DeactiveFun = void();
+/*
+ * Call-backs get the data passed to register_im_callbacks() first, they are
+ * plain functions so that dispatching a message is an indirect call.
+ */
+using ActiveFun = void(void *data);
+using DeactiveFun = void(void *data);
 
 /// @param winid indicates which window should be redrawn, -1 means redraw all
 /// UI window. @see set_im_window()
-using ShowUIFun = void(unsigned winid);
-using HideUIFun = void();
-using SendKeyFun = void(char *keys, unsigned len);
-using CursorPositionFun = void(unsigned x, unsigned y);
-using FbTermInfoFun = void(Info *info);
-using TermModeFun = void(char crlf, char appkey, char curo);
+using ShowUIFun = void(void *data, unsigned winid);
+using HideUIFun = void(void *data);
+using SendKeyFun = void(void *data, char *keys, unsigned len);
+using CursorPositionFun = void(void *data, unsigned x, unsigned y);
+using FbTermInfoFun = void(void *data, Info *info);
+using TermModeFun = void(void *data, char crlf, char appkey, char curo);
+using OutputPendingFun = void(void *data);
+using PingAckFun = void(void *data, uint64_t rtt);
 
 typedef struct {
-    std::function<ActiveFun> active; ///< called when receiving a Active message
-    std::function<DeactiveFun>
-        deactive; ///< called when receiving a Deactive message
-    std::function<ShowUIFun>
-        show_ui; ///< called when receiving a ShowUI message
-    std::function<HideUIFun>
-        hide_ui; ///< called when receiving a HideUI message
-    std::function<SendKeyFun>
-        send_key; ///< called when receiving a SendKey message
-    std::function<CursorPositionFun>
-        cursor_position; ///< called when receiving a CursorPosition message
-    std::function<FbTermInfoFun>
-        fbterm_info; ///< called when receiving a FbTermInfo message
-    std::function<TermModeFun>
-        term_mode; ///< called when receiving a TermMode message
+    ActiveFun *active;     ///< called when receiving a Active message
+    DeactiveFun *deactive; ///< called when receiving a Deactive message
+    ShowUIFun *show_ui;    ///< called when receiving a ShowUI message
+    HideUIFun *hide_ui;    ///< called when receiving a HideUI message
+    SendKeyFun *send_key;  ///< called when receiving a SendKey message
+    CursorPositionFun
+        *cursor_position; ///< called when receiving a CursorPosition message
+    FbTermInfoFun *fbterm_info; ///< called when receiving a FbTermInfo message
+    TermModeFun *term_mode;     ///< called when receiving a TermMode message
+    OutputPendingFun
+        *output_pending; ///< called when FbTerm stops accepting writes and
+                         ///< messages start to queue, @see flush_im_output()
+    PingAckFun *ping_ack; ///< called when receiving a AckPing message, with the
+                          ///< round trip of its Ping in usec, @see
+                          ///< send_im_ping()
 } ImCallbacks;
 
+/**
+ * State of one connection to FbTerm.
+ *
+ * All functions in this file operate on the current session of the calling
+ * thread. By default it is the session of the socket passed by FbTerm in
+ * FBTERM_IM_SOCKET, a process serving several FbTerm instances creates one
+ * session per socket and switches between them with set_current_im_session().
+ */
+typedef struct ImSession ImSession;
+
+/**
+ * @brief create a session for a socket connected to FbTerm
+ * @param fd the socket, owned by the session from now on
+ */
+extern ImSession *im_session_new(int fd);
+
+/**
+ * @brief close the socket of a session and free it
+ */
+extern void im_session_free(ImSession *session);
+
+/**
+ * @brief make session the current session of the calling thread
+ * @param session the session, NULL selects the default session
+ * @return the previous current session
+ */
+extern ImSession *set_current_im_session(ImSession *session);
+
+class ImRecorder;
+
+/**
+ * @brief record every message sent to and received from FbTerm
+ * @param recorder the log, NULL stops recording
+ */
+extern void set_im_recorder(ImRecorder *recorder);
+
 /**
  * @brief register message call-back functions:
- * @param callbacks
+ * @param callbacks the table, used until replaced, NULL for none
+ * @param data passed to every call-back
  */
-extern void register_im_callbacks(ImCallbacks callbacks);
+extern void register_im_callbacks(const ImCallbacks *callbacks, void *data);
 
 /**
  * @brief send message Connect to FbTerm
@@ -123,6 +167,87 @@ extern void put_im_text(const char *text, unsigned len);
  */
 extern void set_im_window(unsigned winid, Rectangle rect);
 
+/**
+ * Counters of the outbound message queue.
+ *
+ * The socket to FbTerm is non-blocking, messages which can not be written
+ * immediately are queued until FbTerm reads again.
+ */
+typedef struct {
+    unsigned long queued_bytes;     ///< bytes currently waiting in the queue
+    unsigned long queue_high_water; ///< the largest queue depth seen
+    unsigned long written_bytes;    ///< bytes written to FbTerm in total
+    unsigned long blocked_writes;   ///< writes that found the socket full
+} ImOutputStats;
+
+/**
+ * @brief write queued messages to FbTerm without blocking
+ * @return non-zero if the queue has been drained
+ *
+ * Should be called when the socket becomes writable after
+ * ImCallbacks::output_pending has been called.
+ */
+extern int flush_im_output();
+
+/**
+ * @brief check whether the outbound queue has grown over its high-water mark
+ * @return non-zero if FbTerm is not keeping up with the messages sent to it
+ *
+ * IM server should skip drawing which can be done later when congested,
+ * messages like PutText are always queued and never dropped.
+ */
+extern int im_output_congested();
+
+/**
+ * @brief get the counters of the outbound message queue
+ */
+extern const ImOutputStats *get_im_output_stats();
+
+/**
+ * Round trips of Ping messages.
+ *
+ * FbTerm answers a Ping with AckPing once it has read every message sent
+ * before it, so the round trip tells how far behind FbTerm is.
+ */
+typedef struct {
+    unsigned outstanding; ///< Pings not answered yet
+    uint64_t oldest_sent; ///< CLOCK_MONOTONIC usec the oldest unanswered
+                          ///< Ping was sent, zero if none
+    uint64_t last_rtt;    ///< usec of the last round trip
+    uint64_t smoothed_rtt; ///< moving average of the round trips in usec
+} ImPingStats;
+
+/**
+ * @brief send message Ping to FbTerm without waiting for the answer
+ *
+ * ImCallbacks::ping_ack is called when AckPing arrives.
+ */
+extern void send_im_ping();
+
+/**
+ * @brief get the round trips of Ping messages
+ */
+extern const ImPingStats *get_im_ping_stats();
+
+/**
+ * @brief touch the message buffers of the session so that processing
+ * messages doesn't fault pages in
+ */
+extern void prefault_im_buffers();
+
+/**
+ * @brief free the memory the message queues of the session have grown to
+ *
+ * They grow again when needed, e.g. after the session has been idle.
+ */
+extern void trim_im_buffers();
+
+/**
+ * @brief get the name of a message type, @see MessageType
+ * @return "Unknown" for an invalid type
+ */
+extern const char *message_type_name(unsigned type);
+
 /**
  * The colors of xterm's 256 color mode supported by FbTerm can be used in
  * fill_rect() and draw_text(). ColorType defines the first 16 colors with
@@ -166,4 +291,12 @@ extern void fill_rect(Rectangle rect, unsigned char color);
 extern void draw_text(unsigned x, unsigned y, unsigned char fc,
                       unsigned char bc, const char *text, unsigned len);
 
+/**
+ * @brief send messages encoded by the caller in one write
+ * @param iov whole messages, e.g. the data of display lists, the iovecs are
+ * modified
+ * @param count number of iovecs
+ */
+extern void send_im_messages(struct iovec *iov, int count);
+
 #endif
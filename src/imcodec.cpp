@@ -0,0 +1,40 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "imcodec.h"
+#include <string.h>
+#include <algorithm>
+
+ssize_t imDecode(std::string_view data, ImInMessage &msg) {
+    constexpr size_t prefix = offsetof(Message, raw);
+    if (data.size() < prefix) {
+        return 0;
+    }
+    unsigned short type, len;
+    memcpy(&type, data.data() + offsetof(Message, type), sizeof(type));
+    memcpy(&len, data.data() + offsetof(Message, len), sizeof(len));
+    // A message shorter than its length field would be read again forever,
+    // FbTerm never sends one.
+    if (len < prefix) {
+        return -1;
+    }
+    if (data.size() < len) {
+        return 0;
+    }
+
+    // FbTerm sends the whole Message for fixed messages, shorter ones are
+    // accepted with the missing fields zero.
+    memset(&msg.header, 0, sizeof(msg.header));
+    memcpy(&msg.header, data.data(), std::min<size_t>(len, sizeof(Message)));
+    size_t headerSize = imHeaderSize(type);
+    if (headerSize && headerSize < sizeof(Message) && len > headerSize) {
+        msg.payload = data.substr(headerSize, len - headerSize);
+    } else {
+        msg.payload = {};
+    }
+    return len;
+}
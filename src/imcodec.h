@@ -0,0 +1,135 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_IMCODEC_H_
+#define _FCITX5_FBTERM_IMCODEC_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include "immessage.h"
+
+// FbTerm was built from the same immessage.h, make sure the layout it
+// expects didn't change.
+static_assert(offsetof(Message, raw) == 4);
+static_assert(offsetof(Message, keys) == 4);
+static_assert(offsetof(Message, texts) == 4);
+static_assert(offsetof(Message, win.winid) == 20);
+static_assert(offsetof(Message, fillRect.color) == 20);
+static_assert(offsetof(Message, drawText.texts) == 14);
+static_assert(sizeof(Info) == 16);
+static_assert(sizeof(Rectangle) == 16);
+static_assert(sizeof(Message) == 24);
+
+/// messages followed by a variable length body
+template <MessageType Type>
+constexpr bool ImHasPayload = Type == SendKey || Type == PutText ||
+                              Type == DrawText;
+
+/**
+ * Bytes of a message before its payload. Messages without one are always
+ * sent as a whole Message, as FbTerm does.
+ */
+template <MessageType Type>
+constexpr size_t ImHeaderSize = sizeof(Message);
+template <>
+constexpr size_t ImHeaderSize<SendKey> = offsetof(Message, keys);
+template <>
+constexpr size_t ImHeaderSize<PutText> = offsetof(Message, texts);
+template <>
+constexpr size_t ImHeaderSize<DrawText> = offsetof(Message, drawText.texts);
+
+/// longest payload of a message, the length field is 16 bit
+template <MessageType Type>
+constexpr size_t ImMaxPayload = UINT16_MAX - ImHeaderSize<Type>;
+
+/// @see ImHeaderSize, 0 for an unknown type
+constexpr size_t imHeaderSize(unsigned type) {
+    switch (type) {
+    case SendKey:
+        return ImHeaderSize<SendKey>;
+    case PutText:
+        return ImHeaderSize<PutText>;
+    case DrawText:
+        return ImHeaderSize<DrawText>;
+    default:
+        return type <= AckPing ? sizeof(Message) : 0;
+    }
+}
+
+/**
+ * A message to FbTerm. The header is built in place and the payload stays in
+ * the caller's memory, both are handed to writev() as they are, so the
+ * payload must outlive the send.
+ */
+struct ImOutMessage {
+    Message header{};
+    size_t headerSize = 0;
+    std::string_view payload;
+
+    MessageType type() const { return static_cast<MessageType>(header.type); }
+
+    size_t size() const { return header.len; }
+
+    /// @return the number of iovecs filled, without an empty payload
+    int toIovec(iovec (&iov)[2]) const {
+        iov[0].iov_base = const_cast<Message *>(&header);
+        iov[0].iov_len = headerSize;
+        if (payload.empty()) {
+            return 1;
+        }
+        iov[1].iov_base = const_cast<char *>(payload.data());
+        iov[1].iov_len = payload.size();
+        return 2;
+    }
+};
+
+/// start a message without payload, the caller fills in the body
+template <MessageType Type>
+ImOutMessage imEncode() {
+    static_assert(!ImHasPayload<Type>, "the message takes a payload");
+    ImOutMessage msg;
+    msg.header.type = Type;
+    msg.header.len = ImHeaderSize<Type>;
+    msg.headerSize = ImHeaderSize<Type>;
+    return msg;
+}
+
+/**
+ * @brief start a message carrying payload, the caller fills in the header
+ * @param payload at most ImMaxPayload bytes, not copied
+ */
+template <MessageType Type>
+ImOutMessage imEncode(std::string_view payload) {
+    static_assert(ImHasPayload<Type>, "the message has no payload");
+    ImOutMessage msg;
+    msg.header.type = Type;
+    msg.header.len = ImHeaderSize<Type> + payload.size();
+    msg.headerSize = ImHeaderSize<Type>;
+    msg.payload = payload;
+    return msg;
+}
+
+/// a message from FbTerm
+struct ImInMessage {
+    /// the fixed part, copied so that it is aligned, zero past the message
+    Message header;
+    /// bytes after ImHeaderSize, they point into the buffer decoded
+    std::string_view payload;
+
+    MessageType type() const { return static_cast<MessageType>(header.type); }
+};
+
+/**
+ * @brief decode the first message of data
+ * @return its length, 0 if data doesn't hold all of it, -1 if it is malformed
+ * and the rest of data can't be trusted
+ */
+ssize_t imDecode(std::string_view data, ImInMessage &msg);
+
+#endif // _FCITX5_FBTERM_IMCODEC_H_
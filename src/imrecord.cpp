@@ -0,0 +1,376 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "imrecord.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/log.h>
+
+namespace {
+
+constexpr size_t RecordChunkSize = 1 << 20;
+
+constexpr size_t padded(size_t len) { return (len + 7) & ~size_t(7); }
+
+void appendU32(std::string &out, uint32_t value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void appendString(std::string &out, const std::string &str) {
+    appendU32(out, str.size());
+    out.append(str);
+}
+
+void appendPreedit(std::string &out, const std::vector<PreeditItem> &items) {
+    appendU32(out, items.size());
+    for (const auto &item : items) {
+        appendString(out, item.text);
+        appendU32(out, item.format);
+    }
+}
+
+bool readU32(std::string_view &data, uint32_t &value) {
+    if (data.size() < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, data.data(), sizeof(value));
+    data.remove_prefix(sizeof(value));
+    return true;
+}
+
+bool readInt(std::string_view &data, int &value) {
+    uint32_t raw;
+    if (!readU32(data, raw)) {
+        return false;
+    }
+    value = static_cast<int32_t>(raw);
+    return true;
+}
+
+bool readString(std::string_view &data, std::string &str) {
+    uint32_t len;
+    if (!readU32(data, len) || data.size() < len) {
+        return false;
+    }
+    str.assign(data.data(), len);
+    data.remove_prefix(len);
+    return true;
+}
+
+bool readPreedit(std::string_view &data, std::vector<PreeditItem> &items) {
+    uint32_t count;
+    if (!readU32(data, count) || count > data.size()) {
+        return false;
+    }
+    items.resize(count);
+    for (auto &item : items) {
+        if (!readString(data, item.text) || !readInt(data, item.format)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class RecordingBackend : public FcitxBackend {
+public:
+    RecordingBackend(std::unique_ptr<FcitxBackend> backend,
+                     ImRecorder *recorder)
+        : backend_(std::move(backend)), recorder_(recorder) {}
+
+    void setCallbacks(Callbacks callbacks) override {
+        callbacks_ = std::move(callbacks);
+        backend_->setCallbacks({
+            [this]() {
+                recorder_->append(RecordConnected, nullptr, 0);
+                if (callbacks_.connected) {
+                    callbacks_.connected();
+                }
+            },
+            [this](const char *str) {
+                recorder_->append(RecordCommitString, str, strlen(str));
+                if (callbacks_.commitString) {
+                    callbacks_.commitString(str);
+                }
+            },
+            [this](const char *name, const char *uniqueName,
+                   const char *langCode) {
+                buffer_.clear();
+                for (const char *str : {name, uniqueName, langCode}) {
+                    buffer_.append(str);
+                    buffer_.push_back('\0');
+                }
+                recorder_->append(RecordCurrentIM, buffer_.data(),
+                                  buffer_.size());
+                if (callbacks_.currentIM) {
+                    callbacks_.currentIM(name, uniqueName, langCode);
+                }
+            },
+            [this](const ClientSideUI &ui) {
+                buffer_.clear();
+                serializeClientSideUI(ui, buffer_);
+                recorder_->append(RecordClientSideUI, buffer_.data(),
+                                  buffer_.size());
+                if (callbacks_.updateClientSideUI) {
+                    callbacks_.updateClientSideUI(ui);
+                }
+            },
+        });
+    }
+
+    bool isValid() const override { return backend_->isValid(); }
+
+    void focusIn() override { backend_->focusIn(); }
+
+    void focusOut() override { backend_->focusOut(); }
+
+    void setCapability(uint64_t capability) override {
+        backend_->setCapability(capability);
+    }
+
+    int processKeySync(uint32_t keysym, uint32_t keycode, uint32_t state,
+                       bool isRelease, uint32_t time,
+                       uint64_t timeout) override {
+        RecordKey key = {keysym, keycode, state, isRelease, 0, 0};
+        key.result = backend_->processKeySync(keysym, keycode, state,
+                                              isRelease, time, timeout);
+        recorder_->append(RecordKeyResult, &key, sizeof(key));
+        return key.result;
+    }
+
+    void ping(uint64_t timeout, std::function<void(bool)> callback) override {
+        backend_->ping(timeout, std::move(callback));
+    }
+
+private:
+    std::unique_ptr<FcitxBackend> backend_;
+    ImRecorder *recorder_;
+    std::string buffer_;
+};
+
+} // namespace
+
+std::unique_ptr<ImRecorder> ImRecorder::create(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || ftruncate(fd, RecordChunkSize) == -1) {
+        FCITX_ERROR() << "Failed to create session log " << path << ": "
+                      << strerror(errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    void *map = mmap(nullptr, RecordChunkSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<ImRecorder> recorder(
+        new ImRecorder(fd, static_cast<char *>(map), RecordChunkSize));
+    RecordFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IM_RECORD_MAGIC, sizeof(IM_RECORD_MAGIC));
+    header.version = IM_RECORD_VERSION;
+    header.startTime = fcitx::now(CLOCK_MONOTONIC);
+    memcpy(recorder->map_, &header, sizeof(header));
+    recorder->size_ = sizeof(header);
+    return recorder;
+}
+
+ImRecorder::ImRecorder(int fd, char *map, size_t capacity)
+    : fd_(fd), map_(map), capacity_(capacity) {}
+
+ImRecorder::~ImRecorder() {
+    if (map_) {
+        munmap(map_, capacity_);
+    }
+    if (ftruncate(fd_, size_) == -1) {
+        // The log stays readable, the trailing zeros read as RecordEnd.
+        FCITX_WARN() << "Failed to truncate session log: " << strerror(errno);
+    }
+    close(fd_);
+}
+
+bool ImRecorder::reserve(size_t len) {
+    if (size_ + len <= capacity_) {
+        return true;
+    }
+    if (!map_) {
+        return false;
+    }
+    auto capacity = capacity_;
+    while (size_ + len > capacity) {
+        capacity *= 2;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd_, capacity) != -1) {
+        map = mremap(map_, capacity_, capacity, MREMAP_MAYMOVE);
+    }
+    if (map == MAP_FAILED) {
+        // Stop recording rather than failing the session.
+        FCITX_ERROR() << "Failed to grow session log: " << strerror(errno);
+        munmap(map_, capacity_);
+        map_ = nullptr;
+        capacity_ = 0;
+        return false;
+    }
+    map_ = static_cast<char *>(map);
+    capacity_ = capacity;
+    return true;
+}
+
+void ImRecorder::trim() {
+    if (!map_) {
+        return;
+    }
+    // The page being written to is kept.
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t written = size_ / pageSize * pageSize;
+    if (written) {
+        madvise(map_, written, MADV_DONTNEED);
+    }
+}
+
+void ImRecorder::append(RecordType type, const void *data, size_t len) {
+    iovec iov;
+    iov.iov_base = const_cast<void *>(data);
+    iov.iov_len = len;
+    append(type, &iov, 1);
+}
+
+void ImRecorder::append(RecordType type, const iovec *iov, int count) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += iov[i].iov_len;
+    }
+    if (!reserve(sizeof(RecordHeader) + padded(len))) {
+        return;
+    }
+    RecordHeader header;
+    header.time = fcitx::now(CLOCK_MONOTONIC);
+    header.len = len;
+    header.type = type;
+    header.reserved = 0;
+    memcpy(map_ + size_, &header, sizeof(header));
+    char *cur = map_ + size_ + sizeof(header);
+    for (int i = 0; i < count; i++) {
+        if (iov[i].iov_len) {
+            memcpy(cur, iov[i].iov_base, iov[i].iov_len);
+            cur += iov[i].iov_len;
+        }
+    }
+    size_ += sizeof(header) + padded(len);
+}
+
+std::unique_ptr<ImRecordReader>
+ImRecordReader::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return nullptr;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(RecordFileHeader)) {
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+
+    std::unique_ptr<ImRecordReader> reader(
+        new ImRecordReader(static_cast<const char *>(map), st.st_size));
+    RecordFileHeader header;
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, IM_RECORD_MAGIC, sizeof(IM_RECORD_MAGIC)) != 0 ||
+        header.version != IM_RECORD_VERSION) {
+        return nullptr;
+    }
+    return reader;
+}
+
+ImRecordReader::ImRecordReader(const char *map, size_t size)
+    : map_(map), size_(size), offset_(sizeof(RecordFileHeader)) {}
+
+ImRecordReader::~ImRecordReader() {
+    munmap(const_cast<char *>(map_), size_);
+}
+
+uint64_t ImRecordReader::startTime() const {
+    RecordFileHeader header;
+    memcpy(&header, map_, sizeof(header));
+    return header.startTime;
+}
+
+bool ImRecordReader::next(Record &record) {
+    RecordHeader header;
+    if (offset_ + sizeof(header) > size_) {
+        return false;
+    }
+    memcpy(&header, map_ + offset_, sizeof(header));
+    if (header.type == RecordEnd ||
+        offset_ + sizeof(header) + header.len > size_) {
+        return false;
+    }
+    record.type = static_cast<RecordType>(header.type);
+    record.time = header.time;
+    record.payload =
+        std::string_view(map_ + offset_ + sizeof(header), header.len);
+    offset_ += sizeof(header) + padded(header.len);
+    return true;
+}
+
+void serializeClientSideUI(const ClientSideUI &ui, std::string &out) {
+    appendPreedit(out, ui.preedit);
+    appendU32(out, ui.cursorPos);
+    appendPreedit(out, ui.auxUp);
+    appendPreedit(out, ui.auxDown);
+    appendU32(out, ui.candidates.size());
+    for (const auto &item : ui.candidates) {
+        appendString(out, item.label);
+        appendString(out, item.text);
+    }
+    appendU32(out, ui.highlight);
+    appendU32(out, ui.layoutHint);
+    appendU32(out, ui.hasPrev);
+    appendU32(out, ui.hasNext);
+}
+
+bool deserializeClientSideUI(std::string_view data, ClientSideUI &ui) {
+    uint32_t count, hasPrev, hasNext;
+    if (!readPreedit(data, ui.preedit) || !readInt(data, ui.cursorPos) ||
+        !readPreedit(data, ui.auxUp) || !readPreedit(data, ui.auxDown) ||
+        !readU32(data, count) || count > data.size()) {
+        return false;
+    }
+    ui.candidates.resize(count);
+    for (auto &item : ui.candidates) {
+        if (!readString(data, item.label) || !readString(data, item.text)) {
+            return false;
+        }
+    }
+    if (!readInt(data, ui.highlight) || !readInt(data, ui.layoutHint) ||
+        !readU32(data, hasPrev) || !readU32(data, hasNext)) {
+        return false;
+    }
+    ui.hasPrev = hasPrev;
+    ui.hasNext = hasNext;
+    return true;
+}
+
+std::unique_ptr<FcitxBackend>
+createRecordingBackend(std::unique_ptr<FcitxBackend> backend,
+                       ImRecorder *recorder) {
+    return std::make_unique<RecordingBackend>(std::move(backend), recorder);
+}
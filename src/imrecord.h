@@ -0,0 +1,137 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_IMRECORD_H_
+#define _FCITX5_FBTERM_IMRECORD_H_
+
+#include <sys/uio.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "backend.h"
+
+/**
+ * Session log of an IM server.
+ *
+ * The file starts with a RecordFileHeader, followed by records. Every record
+ * is a RecordHeader and its payload, padded to 8 bytes. A record with type
+ * RecordEnd, or the end of the file, terminates the log. Integers are stored
+ * in host byte order, a log is meant to be replayed on the same architecture.
+ */
+
+#define IM_RECORD_MAGIC "FBTMREC"
+#define IM_RECORD_VERSION 1
+
+typedef enum : uint16_t {
+    RecordEnd = 0,
+    RecordFbtermIn,      ///< message received from FbTerm
+    RecordFbtermOut,     ///< message sent to FbTerm
+    RecordConnected,     ///< input context is ready, no payload
+    RecordCommitString,  ///< committed UTF-8 string
+    RecordCurrentIM,     ///< name, unique name and language, NUL separated
+    RecordClientSideUI,  ///< ClientSideUI, @see serializeClientSideUI()
+    RecordKeyResult,     ///< RecordKey
+} RecordType;
+
+struct RecordFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t startTime; ///< CLOCK_MONOTONIC usec when the log was created
+};
+
+struct RecordHeader {
+    uint64_t time; ///< CLOCK_MONOTONIC usec
+    uint32_t len;  ///< payload length, excluding padding
+    uint16_t type; ///< @see RecordType
+    uint16_t reserved;
+};
+
+/// a key sent to fcitx and the result
+struct RecordKey {
+    uint32_t keysym;
+    uint32_t keycode;
+    uint32_t state;
+    uint32_t isRelease;
+    int32_t result;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(RecordFileHeader) % 8 == 0);
+static_assert(sizeof(RecordHeader) == 16);
+static_assert(sizeof(RecordKey) % 8 == 0);
+
+/**
+ * Appends records to a log through a shared memory mapping of the file, so
+ * recording costs a memcpy in the common case. The file is grown in chunks
+ * and truncated to its content when the recorder is destroyed.
+ */
+class ImRecorder {
+public:
+    /// @return nullptr if the file can't be created
+    static std::unique_ptr<ImRecorder> create(const std::string &path);
+    ~ImRecorder();
+
+    void append(RecordType type, const void *data, size_t len);
+
+    /// append one record of the concatenated iovecs
+    void append(RecordType type, const iovec *iov, int count);
+
+    /// drop the pages of the log written so far from the resident memory,
+    /// they stay in the file
+    void trim();
+
+    /// bytes of the log written so far
+    size_t size() const { return size_; }
+
+private:
+    ImRecorder(int fd, char *map, size_t capacity);
+    bool reserve(size_t len);
+
+    int fd_;
+    char *map_;
+    size_t capacity_;
+    size_t size_ = 0;
+};
+
+/// reads a log written by ImRecorder
+class ImRecordReader {
+public:
+    struct Record {
+        RecordType type;
+        uint64_t time;
+        std::string_view payload;
+    };
+
+    /// @return nullptr if the file is not a log
+    static std::unique_ptr<ImRecordReader> open(const std::string &path);
+    ~ImRecordReader();
+
+    uint64_t startTime() const;
+
+    /// @return false at the end of the log
+    bool next(Record &record);
+
+private:
+    ImRecordReader(const char *map, size_t size);
+
+    const char *map_;
+    size_t size_;
+    size_t offset_;
+};
+
+void serializeClientSideUI(const ClientSideUI &ui, std::string &out);
+
+bool deserializeClientSideUI(std::string_view data, ClientSideUI &ui);
+
+/// wraps backend so every signal and key result is recorded
+std::unique_ptr<FcitxBackend>
+createRecordingBackend(std::unique_ptr<FcitxBackend> backend,
+                       ImRecorder *recorder);
+
+#endif // _FCITX5_FBTERM_IMRECORD_H_
@@ -9,51 +9,242 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <string>
+#include <vector>
 #include <fcitx-utils/utf8.h>
 #include <linux/input.h>
 #include <linux/kd.h>
 #include <linux/keyboard.h>
 #include <sys/ioctl.h>
 #include "input_key.h"
+#include "keycode.h"
+
+/// keymaps covered by the cache, all combinations of shift, altgr, ctrl and alt
+#define NR_CACHED_KEYMAPS 16
+
+struct KeycodeState {
+    int ttyfd = STDIN_FILENO;
+    char key_down[NR_KEYS];
+    unsigned char shift_down[NR_SHIFT];
+    short shift_state;
+    char lock_state;
+    char cr_with_lf, applic_keypad, cursor_esco;
+    int npadch;
+    struct kbsentry kse;
+
+    /// filled by warm_keycode_cache() or entry by entry on first use,
+    /// dropped by init_keycode_state()
+    unsigned short keymap_cache[NR_CACHED_KEYMAPS][NR_KEYS];
+    bool keymap_cached[NR_CACHED_KEYMAPS][NR_KEYS];
+    std::string func_cache[MAX_NR_FUNC];
+    bool func_cached[MAX_NR_FUNC];
+    std::vector<struct kbdiacruc> diacr_cache;
+    bool diacr_cached;
+    /// warm_keycode_cache() ran since the last init_keycode_state()
+    bool cache_warm;
+    /// accent of a dead key waiting for the next character, 0 for none
+    unsigned dead_diacr;
+    /// the cache holds a keymap set by set_static_keymap()
+    bool static_keymap;
+};
+
+static KeycodeState default_state;
+static thread_local KeycodeState *ks = &default_state;
+
+KeycodeState *keycode_state_new(int ttyfd) {
+    KeycodeState *state = new KeycodeState();
+    state->ttyfd = ttyfd;
+    return state;
+}
+
+void keycode_state_free(KeycodeState *state) {
+    if (!state || state == &default_state)
+        return;
+    if (ks == state)
+        ks = &default_state;
+    if (state->ttyfd != STDIN_FILENO)
+        close(state->ttyfd);
+    delete state;
+}
+
+KeycodeState *set_current_keycode_state(KeycodeState *state) {
+    KeycodeState *old = ks;
+    ks = state ? state : &default_state;
+    return old;
+}
+
+static int lookup_keymap(unsigned char table, unsigned char keycode,
+                         unsigned short *value) {
+    bool cacheable = table < NR_CACHED_KEYMAPS;
+    if (cacheable && ks->keymap_cached[table][keycode]) {
+        *value = ks->keymap_cache[table][keycode];
+        return 0;
+    }
+    if (ks->static_keymap)
+        return -1;
 
-static char key_down[NR_KEYS];
-static unsigned char shift_down[NR_SHIFT];
-static short shift_state;
-static char lock_state;
-static char cr_with_lf, applic_keypad, cursor_esco;
-static int npadch;
+    struct kbentry ke;
+    ke.kb_table = table;
+    ke.kb_index = keycode;
+    if (ioctl(ks->ttyfd, KDGKBENT, &ke) == -1)
+        return -1;
+    *value = ke.kb_value;
+    if (cacheable) {
+        ks->keymap_cache[table][keycode] = ke.kb_value;
+        ks->keymap_cached[table][keycode] = true;
+    }
+    return 0;
+}
+
+static const char *lookup_func_string(unsigned char func) {
+    if (ks->func_cached[func])
+        return ks->func_cache[func].c_str();
+    if (ks->static_keymap)
+        return "";
+
+    ks->kse.kb_func = func;
+    ks->kse.kb_string[0] = 0;
+    if (ioctl(ks->ttyfd, KDGKBSENT, &ks->kse) == -1)
+        return (const char *)ks->kse.kb_string;
+    ks->func_cache[func] = (const char *)ks->kse.kb_string;
+    ks->func_cached[func] = true;
+    return ks->func_cache[func].c_str();
+}
+
+static const std::vector<struct kbdiacruc> &lookup_diacriticals() {
+    if (ks->diacr_cached || ks->static_keymap)
+        return ks->diacr_cache;
+
+    struct kbdiacrsuc diacrs;
+    ks->diacr_cache.clear();
+    if (ioctl(ks->ttyfd, KDGKBDIACRUC, &diacrs) != -1)
+        ks->diacr_cache.assign(diacrs.kbdiacruc,
+                               diacrs.kbdiacruc + diacrs.kb_cnt);
+    ks->diacr_cached = true;
+    return ks->diacr_cache;
+}
+
+/**
+ * combine ch with the pending dead key in the order of the kernel's
+ * handle_diacr(): the table first, then a space or the accent itself give the
+ * accent, else both characters, the accent is then appended to buf
+ */
+static unsigned compose_dead_key(unsigned ch, char *buf, unsigned *index) {
+    unsigned diacr = ks->dead_diacr;
+    ks->dead_diacr = 0;
+    for (const auto &entry : lookup_diacriticals()) {
+        if (entry.diacr == diacr && entry.base == ch)
+            return entry.result;
+    }
+    if (ch == ' ' || ch == diacr)
+        return diacr;
+    *index += fcitx_ucs4_to_utf8(diacr, buf + *index);
+    return ch;
+}
+
+void warm_keycode_cache() {
+    if (ks->static_keymap)
+        return;
+
+    lookup_diacriticals();
+
+    unsigned short value;
+    for (unsigned table = 0; table < NR_CACHED_KEYMAPS; table++) {
+        for (unsigned keycode = 0; keycode < NR_KEYS; keycode++) {
+            if (lookup_keymap(table, keycode, &value) == -1)
+                break;
+        }
+    }
+
+    for (unsigned func = 0; func < MAX_NR_FUNC; func++)
+        lookup_func_string(func);
+    ks->cache_warm = true;
+}
+
+void drop_keycode_cache() {
+    if (ks->static_keymap)
+        return;
+
+    memset(ks->keymap_cached, 0, sizeof(ks->keymap_cached));
+    memset(ks->func_cached, 0, sizeof(ks->func_cached));
+    for (auto &str : ks->func_cache)
+        std::string().swap(str);
+    std::vector<struct kbdiacruc>().swap(ks->diacr_cache);
+    ks->diacr_cached = false;
+    ks->cache_warm = false;
+}
+
+void set_static_keymap(const unsigned short *const *keymaps,
+                       unsigned nr_keymaps, const char *const *func_strings,
+                       unsigned nr_funcs) {
+    ks->static_keymap = true;
+    for (unsigned table = 0; table < NR_CACHED_KEYMAPS; table++) {
+        bool cached = table < nr_keymaps && keymaps[table];
+        memset(ks->keymap_cached[table], cached,
+               sizeof(ks->keymap_cached[table]));
+        if (cached)
+            memcpy(ks->keymap_cache[table], keymaps[table],
+                   sizeof(ks->keymap_cache[table]));
+    }
+    for (unsigned func = 0; func < MAX_NR_FUNC; func++) {
+        ks->func_cached[func] = func < nr_funcs && func_strings[func];
+        ks->func_cache[func] = ks->func_cached[func] ? func_strings[func] : "";
+    }
+    ks->diacr_cache.clear();
+    ks->diacr_cached = true;
+}
+
+void set_static_diacriticals(const struct kbdiacruc *diacrs, unsigned nr) {
+    ks->diacr_cache.assign(diacrs, diacrs + nr);
+    ks->diacr_cached = true;
+}
 
 void init_keycode_state() {
-    npadch = -1;
-    shift_state = 0;
-    memset(key_down, 0, sizeof(char) * NR_KEYS);
-    memset(shift_down, 0, sizeof(char) * NR_SHIFT);
-    ioctl(STDIN_FILENO, KDGKBLED, &lock_state);
+    // The keymap may have been changed with loadkeys since the last time,
+    // entries are read again one by one when first used. A cache warmed
+    // right before is kept.
+    if (!ks->static_keymap && !ks->cache_warm) {
+        memset(ks->keymap_cached, 0, sizeof(ks->keymap_cached));
+        memset(ks->func_cached, 0, sizeof(ks->func_cached));
+        ks->diacr_cached = false;
+    }
+    ks->cache_warm = false;
+
+    ks->npadch = -1;
+    ks->dead_diacr = 0;
+    ks->shift_state = 0;
+    memset(ks->key_down, 0, sizeof(char) * NR_KEYS);
+    memset(ks->shift_down, 0, sizeof(char) * NR_SHIFT);
+    ioctl(ks->ttyfd, KDGKBLED, &ks->lock_state);
 }
 
 void update_term_mode(char crlf, char appkey, char curo) {
-    cr_with_lf = crlf;
-    applic_keypad = appkey;
-    cursor_esco = curo;
+    ks->cr_with_lf = crlf;
+    ks->applic_keypad = appkey;
+    ks->cursor_esco = curo;
+}
+
+char is_key_repeat(unsigned short keycode, char down) {
+    return keycode < NR_KEYS && down && ks->key_down[keycode];
 }
 
 unsigned short keycode_to_keysym(unsigned short keycode, char down) {
     if (keycode >= NR_KEYS)
         return K_HOLE;
 
-    char rep = (down && key_down[keycode]);
-    key_down[keycode] = down;
+    char rep = (down && ks->key_down[keycode]);
+    ks->key_down[keycode] = down;
 
     struct kbentry ke;
-    ke.kb_table = shift_state;
+    ke.kb_table = ks->shift_state;
     ke.kb_index = keycode;
 
-    if (ioctl(STDIN_FILENO, KDGKBENT, &ke) == -1)
+    if (lookup_keymap(ke.kb_table, ke.kb_index, &ke.kb_value) == -1)
         return K_HOLE;
 
-    if (KTYP(ke.kb_value) == KT_LETTER && (lock_state & K_CAPSLOCK)) {
-        ke.kb_table = shift_state ^ (1 << KG_SHIFT);
-        if (ioctl(STDIN_FILENO, KDGKBENT, &ke) == -1)
+    if (KTYP(ke.kb_value) == KT_LETTER && (ks->lock_state & K_CAPSLOCK)) {
+        ke.kb_table = ks->shift_state ^ (1 << KG_SHIFT);
+        if (lookup_keymap(ke.kb_table, ke.kb_index, &ke.kb_value) == -1)
             return K_HOLE;
     }
 
@@ -66,20 +257,20 @@ unsigned short keycode_to_keysym(unsigned short keycode, char down) {
     case KT_SPEC:
         switch (ke.kb_value) {
         case K_NUM:
-            if (applic_keypad)
+            if (ks->applic_keypad)
                 break;
         case K_BARENUMLOCK:
         case K_CAPS:
         case K_CAPSON:
             if (down && !rep) {
                 if (value == KVAL(K_NUM) || value == KVAL(K_BARENUMLOCK))
-                    lock_state ^= K_NUMLOCK;
+                    ks->lock_state ^= K_NUMLOCK;
                 else if (value == KVAL(K_CAPS))
-                    lock_state ^= K_CAPSLOCK;
+                    ks->lock_state ^= K_CAPSLOCK;
                 else if (value == KVAL(K_CAPSON))
-                    lock_state |= K_CAPSLOCK;
+                    ks->lock_state |= K_CAPSLOCK;
 
-                ioctl(STDIN_FILENO, KDSKBLED, lock_state);
+                ioctl(ks->ttyfd, KDSKBLED, ks->lock_state);
             }
             break;
 
@@ -95,21 +286,21 @@ unsigned short keycode_to_keysym(unsigned short keycode, char down) {
         if (value == KVAL(K_CAPSSHIFT)) {
             value = KVAL(K_SHIFT);
 
-            if (down && (lock_state & K_CAPSLOCK)) {
-                lock_state &= ~K_CAPSLOCK;
-                ioctl(STDIN_FILENO, KDSKBLED, lock_state);
+            if (down && (ks->lock_state & K_CAPSLOCK)) {
+                ks->lock_state &= ~K_CAPSLOCK;
+                ioctl(ks->ttyfd, KDSKBLED, ks->lock_state);
             }
         }
 
         if (down)
-            shift_down[value]++;
-        else if (shift_down[value])
-            shift_down[value]--;
+            ks->shift_down[value]++;
+        else if (ks->shift_down[value])
+            ks->shift_down[value]--;
 
-        if (shift_down[value])
-            shift_state |= (1 << value);
+        if (ks->shift_down[value])
+            ks->shift_state |= (1 << value);
         else
-            shift_state &= ~(1 << value);
+            ks->shift_state &= ~(1 << value);
 
         break;
 
@@ -117,6 +308,7 @@ unsigned short keycode_to_keysym(unsigned short keycode, char down) {
     case KT_LETTER:
     case KT_FN:
     case KT_PAD:
+    case KT_DEAD:
     case KT_CONS:
     case KT_CUR:
     case KT_META:
@@ -132,7 +324,7 @@ unsigned short keycode_to_keysym(unsigned short keycode, char down) {
 }
 
 unsigned short keypad_keysym_redirect(unsigned short keysym) {
-    if (applic_keypad || KTYP(keysym) != KT_PAD || KVAL(keysym) >= NR_PAD)
+    if (ks->applic_keypad || KTYP(keysym) != KT_PAD || KVAL(keysym) >= NR_PAD)
         return keysym;
 
 #define KL(val) K(KT_LATIN, val)
@@ -146,13 +338,13 @@ unsigned short keypad_keysym_redirect(unsigned short keysym) {
         K_FIND,   K_UP,     K_PGUP,   KL('+'), KL('-'), KL('*'), KL('/'),
         K_ENTER,  K_REMOVE, K_REMOVE, KL('?'), KL('('), KL(')'), KL('#')};
 
-    if (lock_state & K_NUMLOCK)
+    if (ks->lock_state & K_NUMLOCK)
         return num_map[keysym - K_P0];
     return fn_map[keysym - K_P0];
 }
 
 char *keysym_to_term_string(unsigned short keysym, char down) {
-    static struct kbsentry kse;
+    struct kbsentry &kse = ks->kse;
     char *buf = (char *)kse.kb_string;
     *buf = 0;
 
@@ -165,22 +357,40 @@ char *keysym_to_term_string(unsigned short keysym, char down) {
     switch (KTYP(keysym)) {
     case KT_LATIN:
     case KT_LETTER:
-        if (value < KVAL(AC_START) || value > KVAL(AC_END))
-            index = fcitx_ucs4_to_utf8(value, buf);
+        if (value < KVAL(AC_START) || value > KVAL(AC_END)) {
+            if (ks->dead_diacr)
+                value = compose_dead_key(value, buf, &index);
+            index += fcitx_ucs4_to_utf8(value, buf + index);
+        }
         break;
 
-    case KT_FN:
-        kse.kb_func = value;
-        ioctl(STDIN_FILENO, KDGKBSENT, &kse);
-        index = strlen(buf);
+    case KT_DEAD: {
+        // Composed with the next character, as the console does. A pending
+        // dead key is composed with this one first, like a character.
+        static const char dead_chars[] = "`'^~\",";
+        if (value < sizeof(dead_chars) - 1) {
+            unsigned diacr = dead_chars[value];
+            if (ks->dead_diacr)
+                diacr = compose_dead_key(diacr, buf, &index);
+            ks->dead_diacr = diacr;
+        }
         break;
+    }
+
+    case KT_FN: {
+        const char *str = lookup_func_string(value);
+        index = strlen(str);
+        if (str != buf)
+            memcpy(buf, str, index);
+        break;
+    }
 
     case KT_SPEC:
         if (keysym == K_ENTER) {
             buf[index++] = '\r';
-            if (cr_with_lf)
+            if (ks->cr_with_lf)
                 buf[index++] = '\n';
-        } else if (keysym == K_NUM && applic_keypad) {
+        } else if (keysym == K_NUM && ks->applic_keypad) {
             buf[index++] = '\e';
             buf[index++] = 'O';
             buf[index++] = 'P';
@@ -188,7 +398,7 @@ char *keysym_to_term_string(unsigned short keysym, char down) {
         break;
 
     case KT_PAD:
-        if (applic_keypad && !shift_down[KG_SHIFT]) {
+        if (ks->applic_keypad && !ks->shift_down[KG_SHIFT]) {
             if (value < NR_PAD) {
                 static const char app_map[] = "pqrstuvwxylSRQMnnmPQS";
 
@@ -196,9 +406,9 @@ char *keysym_to_term_string(unsigned short keysym, char down) {
                 buf[index++] = 'O';
                 buf[index++] = app_map[value];
             }
-        } else if (keysym == K_P5 && !(lock_state & K_NUMLOCK)) {
+        } else if (keysym == K_P5 && !(ks->lock_state & K_NUMLOCK)) {
             buf[index++] = '\e';
-            buf[index++] = (applic_keypad ? 'O' : '[');
+            buf[index++] = (ks->applic_keypad ? 'O' : '[');
             buf[index++] = 'G';
         }
         break;
@@ -208,14 +418,14 @@ char *keysym_to_term_string(unsigned short keysym, char down) {
             static const char cur_chars[] = "BDCA";
 
             buf[index++] = '\e';
-            buf[index++] = (cursor_esco ? 'O' : '[');
+            buf[index++] = (ks->cursor_esco ? 'O' : '[');
             buf[index++] = cur_chars[value];
         }
         break;
 
     case KT_META: {
-        long flag;
-        ioctl(STDIN_FILENO, KDGKBMETA, &flag);
+        long flag = 0;
+        ioctl(ks->ttyfd, KDGKBMETA, &flag);
 
         if (flag == K_METABIT) {
             buf[index++] = 0x80 | value;
@@ -227,9 +437,9 @@ char *keysym_to_term_string(unsigned short keysym, char down) {
     }
 
     case KT_SHIFT:
-        if (!down && npadch != -1) {
-            index = fcitx_ucs4_to_utf8(npadch, buf);
-            npadch = -1;
+        if (!down && ks->npadch != -1) {
+            index = fcitx_ucs4_to_utf8(ks->npadch, buf);
+            ks->npadch = -1;
         }
         break;
 
@@ -242,10 +452,10 @@ char *keysym_to_term_string(unsigned short keysym, char down) {
                 value -= KVAL(K_HEX0);
             }
 
-            if (npadch == -1)
-                npadch = value;
+            if (ks->npadch == -1)
+                ks->npadch = value;
             else
-                npadch = npadch * base + value;
+                ks->npadch = ks->npadch * base + value;
         }
         break;
 
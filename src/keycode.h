@@ -8,10 +8,77 @@
 #ifndef _FCITX5_FBTERM_KEYCODE_H_
 #define _FCITX5_FBTERM_KEYCODE_H_
 
+/**
+ * Keyboard state of one console: pressed keys, modifiers, lock leds and the
+ * terminal mode used to translate keysyms.
+ *
+ * The functions below operate on the current state of the calling thread,
+ * the default one is bound to the console on standard input.
+ */
+struct KeycodeState;
+
+/**
+ * @brief create the keyboard state of the console ttyfd, owned by the state
+ */
+KeycodeState *keycode_state_new(int ttyfd);
+
+void keycode_state_free(KeycodeState *state);
+
+/**
+ * @brief select the keyboard state used by the calling thread
+ * @param state the state, nullptr selects the default state
+ * @return the previous state
+ */
+KeycodeState *set_current_keycode_state(KeycodeState *state);
+
 void init_keycode_state();
 
+/**
+ * @brief read the keymaps and function key strings of the console ahead of
+ * time, so translating the following keys doesn't need to ask the kernel
+ *
+ * Without it, entries are read and kept one by one when first used. The
+ * following init_keycode_state() keeps the warm cache, later ones drop it,
+ * since the keymap may have changed, and it is filled again by use.
+ */
+void warm_keycode_cache();
+
+/**
+ * @brief free the cache filled by warm_keycode_cache(), it is read from the
+ * console again when needed
+ */
+void drop_keycode_cache();
+
+/**
+ * @brief translate keys with the given keymap instead of the console's
+ * @param keymaps nr_keymaps tables of NR_KEYS entries, indexed by shift state,
+ * NULL for a missing table
+ * @param func_strings nr_funcs strings of the function keys, may contain NULL
+ *
+ * The tables are copied. The keymap is kept until the state is freed, for
+ * translating keys without a console, e.g. when benchmarking or replaying.
+ */
+void set_static_keymap(const unsigned short *const *keymaps,
+                       unsigned nr_keymaps, const char *const *func_strings,
+                       unsigned nr_funcs);
+
+/**
+ * @brief compose dead keys with the given table instead of the console's
+ * @param diacrs nr entries, copied
+ *
+ * Must follow set_static_keymap(), which clears the table.
+ */
+void set_static_diacriticals(const struct kbdiacruc *diacrs, unsigned nr);
+
 void update_term_mode(char crlf, char appkey, char curo);
 
+/**
+ * @brief check whether a key event is generated by autorepeat
+ *
+ * Must be called before passing the event to keycode_to_keysym().
+ */
+char is_key_repeat(unsigned short keycode, char down);
+
 unsigned short keycode_to_keysym(unsigned short keycode, char down);
 
 unsigned short keypad_keysym_redirect(unsigned short keysym);
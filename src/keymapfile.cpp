@@ -0,0 +1,658 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "keymapfile.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <fcitx-utils/log.h>
+#include <fcitx-utils/utf8.h>
+#include "keycode.h"
+
+namespace {
+
+/// names of the keymap modifiers in the order of their bits
+const char *const modifierNames[] = {
+    "shift",  "altgr",  "control", "alt",      "shiftl",
+    "shiftr", "ctrll",  "ctrlr",   "capsshift",
+};
+
+const char *const controlNames[] = {
+    "nul",
+    "Control_a",
+    "Control_b",
+    "Control_c",
+    "Control_d",
+    "Control_e",
+    "Control_f",
+    "Control_g",
+    "BackSpace",
+    "Tab",
+    "Linefeed",
+    "Control_k",
+    "Control_l",
+    "Control_m",
+    "Control_n",
+    "Control_o",
+    "Control_p",
+    "Control_q",
+    "Control_r",
+    "Control_s",
+    "Control_t",
+    "Control_u",
+    "Control_v",
+    "Control_w",
+    "Control_x",
+    "Control_y",
+    "Control_z",
+    "Escape",
+    "Control_backslash",
+    "Control_bracketright",
+    "Control_asciicircum",
+    "Control_underscore",
+};
+
+/// names of ASCII from 0x20, nullptr for the letters
+const char *const latinNames[] = {
+    "space",        "exclam",        "quotedbl",       "numbersign",
+    "dollar",       "percent",       "ampersand",      "apostrophe",
+    "parenleft",    "parenright",    "asterisk",       "plus",
+    "comma",        "minus",         "period",         "slash",
+    "zero",         "one",           "two",            "three",
+    "four",         "five",          "six",            "seven",
+    "eight",        "nine",          "colon",          "semicolon",
+    "less",         "equal",         "greater",        "question",
+    "at",           nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          "bracketleft",
+    "backslash",    "bracketright",  "asciicircum",    "underscore",
+    "grave",        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          nullptr,
+    nullptr,        nullptr,         nullptr,          "braceleft",
+    "bar",          "braceright",    "asciitilde",     "Delete",
+};
+
+/// names of Latin-1 from 0xa0
+const char *const latin1Names[] = {
+    "nobreakspace", "exclamdown",    "cent",           "sterling",
+    "currency",     "yen",           "brokenbar",      "section",
+    "diaeresis",    "copyright",     "ordfeminine",    "guillemotleft",
+    "notsign",      "hyphen",        "registered",     "macron",
+    "degree",       "plusminus",     "twosuperior",    "threesuperior",
+    "acute",        "mu",            "paragraph",      "periodcentered",
+    "cedilla",      "onesuperior",   "masculine",      "guillemotright",
+    "onequarter",   "onehalf",       "threequarters",  "questiondown",
+    "Agrave",       "Aacute",        "Acircumflex",    "Atilde",
+    "Adiaeresis",   "Aring",         "AE",             "Ccedilla",
+    "Egrave",       "Eacute",        "Ecircumflex",    "Ediaeresis",
+    "Igrave",       "Iacute",        "Icircumflex",    "Idiaeresis",
+    "ETH",          "Ntilde",        "Ograve",         "Oacute",
+    "Ocircumflex",  "Otilde",        "Odiaeresis",     "multiply",
+    "Ooblique",     "Ugrave",        "Uacute",         "Ucircumflex",
+    "Udiaeresis",   "Yacute",        "THORN",          "ssharp",
+    "agrave",       "aacute",        "acircumflex",    "atilde",
+    "adiaeresis",   "aring",         "ae",             "ccedilla",
+    "egrave",       "eacute",        "ecircumflex",    "ediaeresis",
+    "igrave",       "iacute",        "icircumflex",    "idiaeresis",
+    "eth",          "ntilde",        "ograve",         "oacute",
+    "ocircumflex",  "otilde",        "odiaeresis",     "division",
+    "oslash",       "ugrave",        "uacute",         "ucircumflex",
+    "udiaeresis",   "yacute",        "thorn",          "ydiaeresis",
+};
+
+struct NamedKeysym {
+    const char *name;
+    unsigned short keysym;
+};
+
+/// keysyms without a simple pattern in their names
+const NamedKeysym namedKeysyms[] = {
+    {"Control_h", K(KT_LATIN, 8)},
+    {"Control_i", K(KT_LATIN, 9)},
+    {"Control_j", K(KT_LATIN, 10)},
+    {"Control_bracketleft", K(KT_LATIN, 27)},
+    {"Find", K_FIND},
+    {"Insert", K_INSERT},
+    {"Remove", K_REMOVE},
+    {"Select", K_SELECT},
+    {"Prior", K_PGUP},
+    {"PageUp", K_PGUP},
+    {"Next", K_PGDN},
+    {"PageDown", K_PGDN},
+    {"Macro", K_MACRO},
+    {"Help", K_HELP},
+    {"Do", K_DO},
+    {"Pause", K_PAUSE},
+    {"VoidSymbol", K_HOLE},
+    {"Return", K_ENTER},
+    {"Show_Registers", K_SH_REGS},
+    {"Show_Memory", K_SH_MEM},
+    {"Show_State", K_SH_STAT},
+    {"Break", K_BREAK},
+    {"Last_Console", K_CONS},
+    {"Caps_Lock", K_CAPS},
+    {"Num_Lock", K_NUM},
+    {"Scroll_Lock", K_HOLD},
+    {"Scroll_Forward", K_SCROLLFORW},
+    {"Scroll_Backward", K_SCROLLBACK},
+    {"Boot", K_BOOT},
+    {"Caps_On", K_CAPSON},
+    {"Compose", K_COMPOSE},
+    {"SAK", K_SAK},
+    {"Decr_Console", K_DECRCONSOLE},
+    {"Incr_Console", K_INCRCONSOLE},
+    {"KeyboardSignal", K_SPAWNCONSOLE},
+    {"Spawn_Console", K_SPAWNCONSOLE},
+    {"Bare_Num_Lock", K_BARENUMLOCK},
+    {"KP_Add", K_PPLUS},
+    {"KP_Subtract", K_PMINUS},
+    {"KP_Multiply", K_PSTAR},
+    {"KP_Divide", K_PSLASH},
+    {"KP_Enter", K_PENTER},
+    {"KP_Comma", K_PCOMMA},
+    {"KP_Period", K_PDOT},
+    {"KP_MinPlus", K_PPLUSMINUS},
+    {"dead_grave", K_DGRAVE},
+    {"dead_acute", K_DACUTE},
+    {"dead_apostrophe", K_DACUTE},
+    {"dead_circumflex", K_DCIRCM},
+    {"dead_tilde", K_DTILDE},
+    {"dead_diaeresis", K_DDIERE},
+    {"dead_cedilla", K_DCEDIL},
+    {"Down", K_DOWN},
+    {"Left", K_LEFT},
+    {"Right", K_RIGHT},
+    {"Up", K_UP},
+};
+
+/// names of the shift keys, their locks end with _Lock, sticky ones start
+/// with S
+const char *const shiftNames[] = {
+    "Shift",  "AltGr", "Control", "Alt",       "ShiftL",
+    "ShiftR", "CtrlL", "CtrlR",   "CapsShift",
+};
+
+/// the strings of the kernel's default keymap
+const NamedKeysym defaultStrings[] = {
+    {"\e[[A", K_F1},   {"\e[[B", K_F2},   {"\e[[C", K_F3},
+    {"\e[[D", K_F4},   {"\e[[E", K_F5},   {"\e[17~", K_F6},
+    {"\e[18~", K_F7},  {"\e[19~", K_F8},  {"\e[20~", K_F9},
+    {"\e[21~", K_F10}, {"\e[23~", K_F11}, {"\e[24~", K_F12},
+    {"\e[25~", K_F13}, {"\e[26~", K_F14}, {"\e[28~", K_F15},
+    {"\e[29~", K_F16}, {"\e[31~", K_F17}, {"\e[32~", K_F18},
+    {"\e[33~", K_F19}, {"\e[34~", K_F20}, {"\e[1~", K_FIND},
+    {"\e[2~", K_INSERT}, {"\e[3~", K_REMOVE}, {"\e[4~", K_SELECT},
+    {"\e[5~", K_PGUP}, {"\e[6~", K_PGDN}, {"\e[M", K_MACRO},
+    {"\e[P", K_PAUSE},
+};
+
+bool parseNumber(const std::string &str, unsigned long &value) {
+    if (str.empty() || !isdigit(static_cast<unsigned char>(str[0]))) {
+        return false;
+    }
+    char *end;
+    value = strtoul(str.c_str(), &end, 0);
+    return *end == '\0';
+}
+
+/// @return -1 if the name is not a Latin-1 character
+int latinValue(const std::string &name) {
+    if (name.size() == 1 && isalpha(static_cast<unsigned char>(name[0]))) {
+        return static_cast<unsigned char>(name[0]);
+    }
+    for (size_t i = 0; i < std::size(controlNames); i++) {
+        if (name == controlNames[i]) {
+            return i;
+        }
+    }
+    for (size_t i = 0; i < std::size(latinNames); i++) {
+        if (latinNames[i] && name == latinNames[i]) {
+            return 0x20 + i;
+        }
+    }
+    for (size_t i = 0; i < std::size(latin1Names); i++) {
+        if (name == latin1Names[i]) {
+            return 0xa0 + i;
+        }
+    }
+    for (const auto &item : namedKeysyms) {
+        if (KTYP(item.keysym) == KT_LATIN && name == item.name) {
+            return KVAL(item.keysym);
+        }
+    }
+    return -1;
+}
+
+/// @return false if name is not "<prefix><number>"
+bool parseIndexed(const std::string &name, std::string_view prefix,
+                  unsigned long &index) {
+    return name.size() > prefix.size() &&
+           std::string_view(name).substr(0, prefix.size()) == prefix &&
+           parseNumber(name.substr(prefix.size()), index);
+}
+
+bool parseKeysym(const std::string &token, unsigned short &keysym) {
+    unsigned long number;
+    if (parseNumber(token, number)) {
+        keysym = number;
+        return number <= 0xffff;
+    }
+    if (token.size() > 2 && token[0] == 'U' && token[1] == '+') {
+        char *end;
+        number = strtoul(token.c_str() + 2, &end, 16);
+        if (*end) {
+            return false;
+        }
+        // Translating keys handles 8-bit values only.
+        keysym = number <= 0xff ? K(KT_LATIN, number) : K_HOLE;
+        return true;
+    }
+    if (token[0] == '+') {
+        int value = latinValue(token.substr(1));
+        keysym = K(KT_LETTER, value);
+        return value >= 0;
+    }
+    if (int value = latinValue(token); value >= 0) {
+        keysym = K(KT_LATIN, value);
+        return true;
+    }
+    if (token.compare(0, 5, "Meta_") == 0) {
+        int value = latinValue(token.substr(5));
+        keysym = K(KT_META, value);
+        return value >= 0;
+    }
+
+    unsigned long index;
+    if (parseIndexed(token, "F", index) && index >= 1 && index <= 245) {
+        // F21 and up follow the editing keys.
+        keysym = K(KT_FN, index <= 20 ? index - 1 : index + 9);
+        return true;
+    }
+    if (parseIndexed(token, "Console_", index) && index >= 1 &&
+        index <= 256) {
+        keysym = K(KT_CONS, index - 1);
+        return true;
+    }
+    if (parseIndexed(token, "KP_", index) && index <= 9) {
+        keysym = K(KT_PAD, index);
+        return true;
+    }
+    if (parseIndexed(token, "Ascii_", index) && index <= 9) {
+        keysym = K(KT_ASCII, index);
+        return true;
+    }
+    if (token.size() == 5 && token.compare(0, 4, "Hex_") == 0 &&
+        isxdigit(static_cast<unsigned char>(token[4]))) {
+        keysym = K(KT_ASCII, 10 + strtoul(token.c_str() + 4, nullptr, 16));
+        return true;
+    }
+    for (const auto &item : namedKeysyms) {
+        if (token == item.name) {
+            keysym = item.keysym;
+            return true;
+        }
+    }
+    for (size_t i = 0; i < std::size(shiftNames); i++) {
+        std::string name = shiftNames[i];
+        if (token == name) {
+            keysym = K(KT_SHIFT, i);
+            return true;
+        }
+        if (token == name + "_Lock") {
+            keysym = K(KT_LOCK, i);
+            return true;
+        }
+        if (token == "S" + name) {
+            keysym = K(KT_SLOCK, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/// a character of a compose line, 'c', a number or U+XXXX
+bool parseCharacter(const std::string &token, unsigned &value) {
+    if (token[0] == '\'') {
+        auto text = token.substr(1);
+        auto range = fcitx::utf8::MakeUTF8CharRange(text);
+        auto iter = range.begin();
+        if (!(iter != range.end())) {
+            return false;
+        }
+        value = *iter;
+        return !(++iter != range.end());
+    }
+    unsigned long number;
+    if (parseNumber(token, number)) {
+        value = number;
+        return true;
+    }
+    if (token.size() > 2 && token[0] == 'U' && token[1] == '+') {
+        char *end;
+        value = strtoul(token.c_str() + 2, &end, 16);
+        return !*end;
+    }
+    unsigned short keysym;
+    if (parseKeysym(token, keysym) && KTYP(keysym) == KT_LATIN) {
+        value = KVAL(keysym);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * split a line into words, '=' and literals, which start with their quote
+ * followed by the unescaped text
+ * @return false if a literal is not terminated
+ */
+bool tokenize(std::string_view line, std::vector<std::string> &tokens) {
+    tokens.clear();
+    size_t i = 0;
+    while (i < line.size()) {
+        char c = line[i];
+        if (isspace(static_cast<unsigned char>(c))) {
+            i++;
+        } else if (c == '#' || c == '!') {
+            break;
+        } else if (c == '=') {
+            tokens.emplace_back("=");
+            i++;
+        } else if (c == '"' || c == '\'') {
+            std::string token(1, c);
+            for (i++; i < line.size() && line[i] != c; i++) {
+                if (line[i] != '\\' || i + 1 == line.size()) {
+                    token += line[i];
+                    continue;
+                }
+                char escaped = line[++i];
+                if (escaped >= '0' && escaped <= '7') {
+                    unsigned value = 0;
+                    for (int n = 0; n < 3 && i < line.size() &&
+                                    line[i] >= '0' && line[i] <= '7';
+                         n++, i++) {
+                        value = value * 8 + line[i] - '0';
+                    }
+                    i--;
+                    token += static_cast<char>(value);
+                } else {
+                    token += escaped == 'n' ? '\n' : escaped;
+                }
+            }
+            if (i == line.size()) {
+                return false;
+            }
+            tokens.push_back(std::move(token));
+            i++;
+        } else {
+            size_t end = i;
+            while (end < line.size() &&
+                   !isspace(static_cast<unsigned char>(line[end])) &&
+                   line[end] != '=' && line[end] != '#' &&
+                   line[end] != '!') {
+                end++;
+            }
+            tokens.emplace_back(line.substr(i, end - i));
+            i = end;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+KeymapFile::KeymapFile() {
+    for (auto &table : tables_) {
+        std::fill(std::begin(table), std::end(table), K_HOLE);
+    }
+    std::fill(std::begin(defined_), std::end(defined_), false);
+    std::fill(std::begin(funcDefined_), std::end(funcDefined_), false);
+}
+
+std::unique_ptr<KeymapFile> KeymapFile::load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        FCITX_ERROR() << "Failed to open keymap " << path;
+        return nullptr;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return parse(text.str(), path);
+}
+
+std::unique_ptr<KeymapFile> KeymapFile::parse(std::string_view text,
+                                              const std::string &name) {
+    std::unique_ptr<KeymapFile> keymap(new KeymapFile);
+    std::vector<std::string> tokens;
+    std::string line, error;
+    unsigned lineNumber = 0, lineStart = 0, unknownLine = 0;
+    while (!text.empty()) {
+        auto end = text.find('\n');
+        auto physical = text.substr(0, end);
+        text.remove_prefix(end == std::string_view::npos ? text.size()
+                                                         : end + 1);
+        if (line.empty()) {
+            lineStart = lineNumber + 1;
+        }
+        lineNumber++;
+        if (!physical.empty() && physical.back() == '\\') {
+            line.append(physical.substr(0, physical.size() - 1));
+            continue;
+        }
+        line.append(physical);
+        if (!tokenize(line, tokens)) {
+            error = "unterminated literal";
+        }
+        if (!error.empty() ||
+            (!tokens.empty() && !keymap->parseLine(tokens, error))) {
+            FCITX_ERROR() << name << ":" << lineStart << ": " << error;
+            return nullptr;
+        }
+        if (!unknownLine && keymap->unknownKeysyms_) {
+            unknownLine = lineStart;
+        }
+        line.clear();
+    }
+    if (keymap->unknownKeysyms_) {
+        FCITX_WARN() << name << ":" << unknownLine << ": unknown keysym "
+                     << keymap->firstUnknownKeysym_ << " ignored, "
+                     << keymap->unknownKeysyms_ << " in total";
+    }
+    return keymap;
+}
+
+bool KeymapFile::parseLine(const std::vector<std::string> &tokens,
+                           std::string &error) {
+    const auto &keyword = tokens[0];
+    if (keyword == "keymaps") {
+        std::string list;
+        for (size_t i = 1; i < tokens.size(); i++) {
+            list += tokens[i];
+        }
+        std::stringstream ranges(list);
+        std::string range;
+        columns_.clear();
+        while (std::getline(ranges, range, ',')) {
+            auto dash = range.find('-');
+            unsigned long first, last;
+            if (!parseNumber(range.substr(0, dash), first) ||
+                !parseNumber(dash == std::string::npos
+                                 ? range
+                                 : range.substr(dash + 1),
+                             last) ||
+                first > last || last > 255) {
+                error = "invalid keymaps " + list;
+                return false;
+            }
+            for (auto table = first; table <= last; table++) {
+                columns_.push_back(table < NrTables ? table : -1);
+            }
+        }
+        return true;
+    }
+    if (keyword == "keycode") {
+        return parseKeycode(tokens, 0, -1, error);
+    }
+    if (keyword == "string") {
+        unsigned short keysym;
+        if (tokens.size() != 4 || tokens[2] != "=" || tokens[3][0] != '"' ||
+            !parseKeysym(tokens[1], keysym) || KTYP(keysym) != KT_FN) {
+            error = "invalid string definition";
+            return false;
+        }
+        funcStrings_[KVAL(keysym)] = tokens[3].substr(1);
+        funcDefined_[KVAL(keysym)] = true;
+        return true;
+    }
+    if (keyword == "strings" || keyword == "compose") {
+        if (tokens.size() == 3 && tokens[1] == "as" && tokens[2] == "usual") {
+            if (keyword == "strings") {
+                for (const auto &item : defaultStrings) {
+                    funcStrings_[KVAL(item.keysym)] = item.name;
+                    funcDefined_[KVAL(item.keysym)] = true;
+                }
+            }
+            // The kernel's default compose table is Latin-1 only and
+            // mostly shadowed by dead keys, it is not reproduced.
+            return true;
+        }
+        struct kbdiacruc diacr;
+        if (keyword != "compose" || tokens.size() != 5 ||
+            tokens[3] != "to" || !parseCharacter(tokens[1], diacr.diacr) ||
+            !parseCharacter(tokens[2], diacr.base) ||
+            !parseCharacter(tokens[4], diacr.result)) {
+            error = "invalid compose definition";
+            return false;
+        }
+        diacriticals_.push_back(diacr);
+        return true;
+    }
+    if (keyword == "charset" || keyword == "alt_is_meta") {
+        return true;
+    }
+    if (keyword == "include") {
+        error = "include is not supported";
+        return false;
+    }
+
+    // plain, shift, ... keycode N = keysym
+    unsigned table = 0;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens[i] == "keycode") {
+            return parseKeycode(tokens, i, table, error);
+        }
+        if (tokens[i] == "plain") {
+            continue;
+        }
+        auto iter = std::find(std::begin(modifierNames),
+                              std::end(modifierNames), tokens[i]);
+        if (iter == std::end(modifierNames)) {
+            break;
+        }
+        table |= 1 << (iter - std::begin(modifierNames));
+    }
+    error = "unknown keyword " + keyword;
+    return false;
+}
+
+bool KeymapFile::parseKeycode(const std::vector<std::string> &tokens,
+                              size_t pos, int table, std::string &error) {
+    unsigned long keycode;
+    if (tokens.size() < pos + 4 || !parseNumber(tokens[pos + 1], keycode) ||
+        keycode >= NR_KEYS || tokens[pos + 2] != "=") {
+        error = "invalid keycode definition";
+        return false;
+    }
+    std::vector<unsigned short> keysyms;
+    for (size_t i = pos + 3; i < tokens.size(); i++) {
+        unsigned short keysym;
+        if (!parseKeysym(tokens[i], keysym)) {
+            // Named in a newer kernel, or a keysym this parser lacks.
+            if (!unknownKeysyms_++) {
+                firstUnknownKeysym_ = tokens[i];
+            }
+            keysym = K_HOLE;
+        }
+        keysyms.push_back(keysym);
+    }
+
+    auto set = [this](int table, unsigned short keycode,
+                      unsigned short keysym) {
+        if (table >= 0 && static_cast<unsigned>(table) < NrTables) {
+            tables_[table][keycode] = keysym;
+            defined_[table] = true;
+        }
+    };
+    if (table >= 0) {
+        if (keysyms.size() != 1) {
+            error = "one keysym expected";
+            return false;
+        }
+        set(table, keycode, keysyms[0]);
+        return true;
+    }
+
+    if (columns_.empty()) {
+        for (size_t i = 0; i < keysyms.size(); i++) {
+            columns_.push_back(i < NrTables ? i : -1);
+        }
+    }
+    if (keysyms.size() == 1) {
+        // A single keysym applies to every keymap.
+        for (auto column : columns_) {
+            set(column, keycode, keysyms[0]);
+        }
+        return true;
+    }
+    if (keysyms.size() > columns_.size()) {
+        error = "more keysyms than keymaps";
+        return false;
+    }
+    for (size_t i = 0; i < keysyms.size(); i++) {
+        set(columns_[i], keycode, keysyms[i]);
+    }
+    return true;
+}
+
+void KeymapFile::install() const {
+    const unsigned short *keymaps[NrTables];
+    const char *funcStrings[MAX_NR_FUNC];
+    for (size_t i = 0; i < NrTables; i++) {
+        keymaps[i] = defined_[i] ? tables_[i] : nullptr;
+    }
+    for (size_t i = 0; i < MAX_NR_FUNC; i++) {
+        funcStrings[i] = funcDefined_[i] ? funcStrings_[i].c_str() : nullptr;
+    }
+    set_static_keymap(keymaps, NrTables, funcStrings, MAX_NR_FUNC);
+    set_static_diacriticals(diacriticals_.data(), diacriticals_.size());
+}
+
+bool KeymapFile::find(char c, unsigned short &keycode, bool &shift) const {
+    for (unsigned table : {0, 1 << KG_SHIFT}) {
+        for (unsigned short code = 0; code < NR_KEYS; code++) {
+            auto keysym = tables_[table][code];
+            if (KVAL(keysym) == static_cast<unsigned char>(c) &&
+                (KTYP(keysym) == KT_LATIN || KTYP(keysym) == KT_LETTER)) {
+                keycode = code;
+                shift = table;
+                return true;
+            }
+        }
+    }
+    return false;
+}
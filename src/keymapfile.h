@@ -0,0 +1,65 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_KEYMAPFILE_H_
+#define _FCITX5_FBTERM_KEYMAPFILE_H_
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <linux/kd.h>
+#include <linux/keyboard.h>
+#include "statickeymap.h"
+
+/**
+ * A console keymap in the text format of dumpkeys and loadkeys.
+ *
+ * Supported are the keymaps, keycode, string and compose lines, with the
+ * keysyms written by dumpkeys. Only the first 16 keymaps, combinations of
+ * shift, altgr, control and alt, are kept, as they are all the keycode
+ * state caches. Keysyms outside Latin-1 given as U+XXXX are dropped, as are
+ * unknown keysyms, with a warning, and include lines are not followed.
+ */
+class KeymapFile : public StaticKeymap {
+public:
+    static constexpr unsigned NrTables = 16;
+
+    /// @return nullptr if the file can't be read or parsed, the error is logged
+    static std::unique_ptr<KeymapFile> load(const std::string &path);
+
+    /**
+     * @brief parse the text of a keymap
+     * @param name used in error messages
+     */
+    static std::unique_ptr<KeymapFile> parse(std::string_view text,
+                                             const std::string &name);
+
+    void install() const override;
+
+    bool find(char c, unsigned short &keycode, bool &shift) const override;
+
+private:
+    KeymapFile();
+
+    bool parseLine(const std::vector<std::string> &tokens,
+                   std::string &error);
+    bool parseKeycode(const std::vector<std::string> &tokens, size_t pos,
+                      int table, std::string &error);
+
+    unsigned short tables_[NrTables][NR_KEYS];
+    bool defined_[NrTables];
+    /// keymap of each column of a keycode line, -1 for one not kept
+    std::vector<int> columns_;
+    std::string funcStrings_[MAX_NR_FUNC];
+    bool funcDefined_[MAX_NR_FUNC];
+    std::vector<struct kbdiacruc> diacriticals_;
+    /// keysyms left undefined since they are not known, warned about once
+    unsigned unknownKeysyms_ = 0;
+    std::string firstUnknownKeysym_;
+};
+
+#endif // _FCITX5_FBTERM_KEYMAPFILE_H_
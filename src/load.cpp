@@ -0,0 +1,881 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+/**
+ * Load generator for many FbTerm sessions sharing one fcitx5.
+ *
+ * The sessions are FcitxFbterm instances spread over worker threads as in
+ * the broker, each connected with a socketpair to a simulated FbTerm. Driver
+ * threads play FbTerm for all of them: they type following a profile and
+ * answer SetWin and Ping. The time every key event spends in ProcessKeyEvent
+ * is reported per session and in total, with the CPU used by the daemon.
+ *
+ * With --mock, fcitx5 is replaced by a service thread which handles the keys
+ * of all sessions one at a time, as the main loop of the daemon does, each
+ * taking a fixed CPU time.
+ */
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcitx-utils/event.h>
+#include <getopt.h>
+#include "fcitxfbterm.h"
+#include "imcodec.h"
+#include "keymapfile.h"
+#include "mainloop.h"
+#include "uskeymap.h"
+
+using namespace fcitx;
+
+namespace {
+
+/// how a simulated user types
+struct TypingProfile {
+    const char *name;
+    /// keys typed back to back, then a pause keeping the average rate
+    unsigned burst;
+    /// letters before a space commits them, 0 for never
+    unsigned commitEvery;
+};
+
+constexpr TypingProfile profiles[] = {
+    {"steady", 1, 0},
+    {"burst", 8, 0},
+    {"pinyin", 1, 5},
+};
+
+/// usec between the keys of a burst
+constexpr uint64_t BurstGap = 5000;
+
+/// usec the sessions get to handle their last keys
+constexpr uint64_t SettleTime = 500000;
+
+/// usec typing waits for the input context before it starts anyway
+constexpr uint64_t ConnectTimeout = 5000000;
+
+/// the mock commits the preedit once it is this long
+constexpr size_t MaxPreedit = 16;
+
+/// letters typed, cycled
+constexpr std::string_view Letters = "nihaoshijiezhongwen";
+
+struct LoadConfig {
+    unsigned sessions = 8;
+    unsigned workers = 2;
+    unsigned drivers = 1;
+    const TypingProfile *profile = &profiles[0];
+    /// keys per second typed in each session
+    double rate = 10;
+    /// keys typed in each session
+    unsigned keys = 200;
+    BackendType backend = DefaultBackendType;
+    bool mock = false;
+    /// usec of CPU the mock spends on a key event
+    uint64_t serviceTime = 100;
+    /// fcitx5 to report the CPU of, 0 to look it up
+    pid_t daemonPid = 0;
+    /// keymap written by dumpkeys to type with, the US keymap if empty
+    std::string keymap;
+};
+
+/// what a session measured, written by its worker, read once it stopped
+struct SessionStats {
+    /// usec of each ProcessKeyEvent call
+    std::vector<uint64_t> latencies;
+    uint64_t timedOut = 0;
+    /// the input context is ready, typing starts
+    std::atomic<bool> ready{false};
+};
+
+uint64_t threadCpuTime() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Stands in for fcitx5: one thread answers the key events of all sessions
+ * in turn, spending a fixed CPU time on each.
+ */
+class MockService {
+public:
+    explicit MockService(uint64_t serviceTime)
+        : serviceTime_(serviceTime), thread_(&MockService::run, this) {}
+
+    ~MockService() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+
+    /**
+     * @brief handle a key event and wait for it
+     * @param timeout usec, 0 to wait as long as it takes
+     * @return false if it wasn't handled in time, it still will be
+     */
+    bool call(uint64_t timeout) {
+        auto request = std::make_shared<Request>();
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_.push_back(request);
+        wake_.notify_one();
+        auto answered = [&request]() { return request->done; };
+        if (!timeout) {
+            request->cv.wait(lock, answered);
+            return true;
+        }
+        return request->cv.wait_for(lock, std::chrono::microseconds(timeout),
+                                    answered);
+    }
+
+    /// whether a call made now would be answered within timeout
+    bool answersWithin(uint64_t timeout) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return (queue_.size() + 1) * serviceTime_ <= timeout;
+    }
+
+    /// usec of CPU used
+    uint64_t cpuTime() const { return cpuTime_.load(); }
+
+private:
+    struct Request {
+        std::condition_variable cv;
+        bool done = false;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [this]() { return quit_ || !queue_.empty(); });
+            if (quit_) {
+                return;
+            }
+            auto request = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+            auto begin = threadCpuTime();
+            while (threadCpuTime() - begin < serviceTime_) {
+            }
+            cpuTime_ += threadCpuTime() - begin;
+            lock.lock();
+            request->done = true;
+            request->cv.notify_one();
+        }
+    }
+
+    uint64_t serviceTime_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::shared_ptr<Request>> queue_;
+    bool quit_ = false;
+    std::atomic<uint64_t> cpuTime_{0};
+    std::thread thread_;
+};
+
+/// a pinyin-like input method served by MockService
+class MockBackend : public FcitxBackend {
+public:
+    MockBackend(MainLoop &loop, MockService &service)
+        : loop_(loop), service_(service) {
+        // The input context is created asynchronously, as with fcitx5.
+        idle_ = loop_.addIdle([this]() {
+            idle_.reset();
+            valid_ = true;
+            if (callbacks_.connected) {
+                callbacks_.connected();
+            }
+        });
+    }
+
+    bool isValid() const override { return valid_; }
+
+    void focusIn() override {}
+
+    void focusOut() override {}
+
+    void setCapability(uint64_t) override {}
+
+    int processKeySync(uint32_t keysym, uint32_t, uint32_t, bool isRelease,
+                       uint32_t, uint64_t timeout) override {
+        if (!service_.call(timeout)) {
+            return KeyTimedOut;
+        }
+        if (isRelease) {
+            return 0;
+        }
+        // Letters make up the preedit, space commits it.
+        if (keysym >= 'a' && keysym <= 'z') {
+            preedit_.push_back(keysym);
+            if (preedit_.size() >= MaxPreedit) {
+                commit_ += preedit_;
+                preedit_.clear();
+            }
+        } else if (keysym == ' ' && !preedit_.empty()) {
+            commit_ += preedit_;
+            preedit_.clear();
+        } else {
+            return 0;
+        }
+        // Signals arrive after the reply.
+        if (!idle_) {
+            idle_ = loop_.addIdle([this]() {
+                idle_.reset();
+                emitSignals();
+            });
+        }
+        return 1;
+    }
+
+    void ping(uint64_t timeout, std::function<void(bool)> callback) override {
+        pingCallback_ = std::move(callback);
+        pingAnswered_ = service_.answersWithin(timeout);
+        pingIdle_ = loop_.addIdle([this]() {
+            pingIdle_.reset();
+            auto callback = std::move(pingCallback_);
+            callback(pingAnswered_);
+        });
+    }
+
+private:
+    void emitSignals() {
+        if (!commit_.empty() && callbacks_.commitString) {
+            callbacks_.commitString(commit_.c_str());
+        }
+        commit_.clear();
+        ui_ = ClientSideUI();
+        if (!preedit_.empty()) {
+            ui_.preedit.push_back({preedit_, 0});
+            ui_.cursorPos = preedit_.size();
+            for (const char *candidate : {"你好", "拟好", "你", "泥", "尼"}) {
+                ui_.candidates.push_back(
+                    {std::to_string(ui_.candidates.size() + 1) + ".",
+                     std::string(candidate) + " "});
+            }
+            ui_.highlight = 0;
+            ui_.hasNext = true;
+        }
+        if (callbacks_.updateClientSideUI) {
+            callbacks_.updateClientSideUI(ui_);
+        }
+    }
+
+    MainLoop &loop_;
+    MockService &service_;
+    std::unique_ptr<LoopSource> idle_;
+    std::unique_ptr<LoopSource> pingIdle_;
+    std::function<void(bool)> pingCallback_;
+    bool pingAnswered_ = false;
+    bool valid_ = false;
+    std::string preedit_;
+    std::string commit_;
+    ClientSideUI ui_;
+};
+
+/// measures the key events of another backend
+class TimedBackend : public FcitxBackend {
+public:
+    TimedBackend(std::unique_ptr<FcitxBackend> backend, SessionStats &stats)
+        : backend_(std::move(backend)), stats_(stats) {}
+
+    void setCallbacks(Callbacks callbacks) override {
+        auto connected = std::move(callbacks.connected);
+        callbacks.connected = [this, connected = std::move(connected)]() {
+            stats_.ready = true;
+            if (connected) {
+                connected();
+            }
+        };
+        backend_->setCallbacks(std::move(callbacks));
+    }
+
+    bool isValid() const override { return backend_->isValid(); }
+
+    void focusIn() override { backend_->focusIn(); }
+
+    void focusOut() override { backend_->focusOut(); }
+
+    void setCapability(uint64_t capability) override {
+        backend_->setCapability(capability);
+    }
+
+    int processKeySync(uint32_t keysym, uint32_t keycode, uint32_t state,
+                       bool isRelease, uint32_t time,
+                       uint64_t timeout) override {
+        auto begin = now(CLOCK_MONOTONIC);
+        auto result = backend_->processKeySync(keysym, keycode, state,
+                                               isRelease, time, timeout);
+        stats_.latencies.push_back(now(CLOCK_MONOTONIC) - begin);
+        if (result == KeyTimedOut) {
+            stats_.timedOut++;
+        }
+        return result;
+    }
+
+    void ping(uint64_t timeout, std::function<void(bool)> callback) override {
+        backend_->ping(timeout, std::move(callback));
+    }
+
+private:
+    std::unique_ptr<FcitxBackend> backend_;
+    SessionStats &stats_;
+};
+
+/// serves sessions on a loop of its own, as BrokerWorker
+class Worker {
+public:
+    Worker(const LoadConfig &config, const StaticKeymap &keymap,
+           MockService *service)
+        : config_(config), keymap_(keymap), service_(service),
+          loop_(createMainLoop(config.backend, true)),
+          thread_(&Worker::run, this) {}
+
+    ~Worker() {
+        loop_->quit();
+        thread_.join();
+    }
+
+    /// takes ownership of fd, may be called from any thread
+    void addSession(int fd, SessionStats &stats) {
+        loop_->invoke([this, fd, &stats]() { startSession(fd, stats); });
+    }
+
+private:
+    struct Session {
+        ~Session() {
+            fbterm.reset();
+            im_session_free(imSession);
+            keycode_state_free(keycodeState);
+        }
+
+        ImSession *imSession;
+        KeycodeState *keycodeState;
+        std::unique_ptr<FcitxFbterm> fbterm;
+    };
+
+    void run() {
+        loop_->run();
+        sessions_.clear();
+    }
+
+    void startSession(int fd, SessionStats &stats) {
+        auto session = std::make_unique<Session>();
+        session->imSession = im_session_new(fd);
+        session->keycodeState = keycode_state_new(-1);
+        KeycodeState *oldState =
+            set_current_keycode_state(session->keycodeState);
+        keymap_.install();
+        set_current_keycode_state(oldState);
+
+        std::unique_ptr<FcitxBackend> backend;
+        if (service_) {
+            backend = std::make_unique<MockBackend>(*loop_, *service_);
+        } else {
+            backend = loop_->createBackend();
+        }
+        backend = std::make_unique<TimedBackend>(std::move(backend), stats);
+        FcitxFbtermConfig config;
+        config.backend = config_.backend;
+        session->fbterm = std::make_unique<FcitxFbterm>(
+            *loop_, session->imSession, session->keycodeState, config,
+            std::move(backend));
+        sessions_.push_back(std::move(session));
+    }
+
+    const LoadConfig &config_;
+    const StaticKeymap &keymap_;
+    MockService *service_;
+    std::unique_ptr<MainLoop> loop_;
+    std::list<std::unique_ptr<Session>> sessions_;
+    std::thread thread_;
+};
+
+bool sendMessage(int fd, const ImOutMessage &msg) {
+    iovec iov[2];
+    msghdr hdr = {};
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = msg.toIovec(iov);
+    return sendmsg(fd, &hdr, MSG_NOSIGNAL) == static_cast<ssize_t>(msg.size());
+}
+
+/// FbTerm's side of a session
+struct Peer {
+    int fd;
+    SessionStats *stats;
+    /// usec after the input context is ready the first key is typed
+    uint64_t offset;
+    /// bytes read that don't make up a whole message yet
+    std::string input;
+    unsigned typed = 0;
+    /// CLOCK_MONOTONIC usec the next key is due, 0 before typing started
+    uint64_t nextKey = 0;
+    uint64_t texts = 0;
+};
+
+/// plays FbTerm for a share of the sessions on a thread of its own
+class Driver {
+public:
+    Driver(const LoadConfig &config, const StaticKeymap &keymap)
+        : config_(config), keymap_(keymap) {}
+
+    ~Driver() { stop(); }
+
+    void addPeer(Peer peer) { peers_.push_back(std::move(peer)); }
+
+    void start() { thread_ = std::thread(&Driver::run, this); }
+
+    /// all keys have been typed
+    bool done() const { return done_; }
+
+    /// stop answering FbTerm's messages
+    void stop() {
+        stop_ = true;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    const std::vector<Peer> &peers() const { return peers_; }
+
+private:
+    void run() {
+        constexpr unsigned FontWidth = 8, FontHeight = 16;
+        for (auto &peer : peers_) {
+            auto info = imEncode<FbTermInfo>();
+            info.header.info = {FontHeight, FontWidth, 30 * FontHeight,
+                                80 * FontWidth};
+            auto cursor = imEncode<CursorPosition>();
+            cursor.header.cursor = {10 * FontWidth, 5 * FontHeight};
+            sendMessage(peer.fd, info);
+            sendMessage(peer.fd, imEncode<Active>());
+            sendMessage(peer.fd, cursor);
+        }
+
+        auto start = now(CLOCK_MONOTONIC);
+        std::vector<pollfd> fds(peers_.size());
+        while (!stop_) {
+            auto current = now(CLOCK_MONOTONIC);
+            uint64_t wait = 10000;
+            bool done = true;
+            for (auto &peer : peers_) {
+                if (peer.typed >= config_.keys || peer.fd == -1) {
+                    continue;
+                }
+                done = false;
+                if (!peer.nextKey) {
+                    if (!peer.stats->ready &&
+                        current - start < ConnectTimeout) {
+                        continue;
+                    }
+                    peer.nextKey = current + peer.offset;
+                }
+                if (peer.nextKey <= current) {
+                    typeKey(peer);
+                    peer.nextKey += keyInterval(peer);
+                }
+                if (peer.nextKey > current) {
+                    wait = std::min(wait, peer.nextKey - current);
+                }
+            }
+            done_ = done;
+
+            for (size_t i = 0; i < peers_.size(); i++) {
+                fds[i].fd = peers_[i].fd;
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+            }
+            timespec timeout = {0, static_cast<long>(wait * 1000)};
+            if (ppoll(fds.data(), fds.size(), &timeout, nullptr) <= 0) {
+                continue;
+            }
+            for (size_t i = 0; i < peers_.size(); i++) {
+                if (fds[i].revents) {
+                    readMessages(peers_[i]);
+                }
+            }
+        }
+    }
+
+    /// usec from the key just typed to the next one
+    uint64_t keyInterval(const Peer &peer) const {
+        auto interval = static_cast<uint64_t>(1000000 / config_.rate);
+        auto burst = config_.profile->burst;
+        if (burst <= 1) {
+            return interval;
+        }
+        if (peer.typed % burst) {
+            return BurstGap;
+        }
+        auto gaps = (burst - 1) * BurstGap;
+        return burst * interval > gaps ? burst * interval - gaps : 0;
+    }
+
+    void typeKey(Peer &peer) {
+        auto commitEvery = config_.profile->commitEvery;
+        char c = commitEvery && peer.typed % (commitEvery + 1) == commitEvery
+                     ? ' '
+                     : Letters[peer.typed % Letters.size()];
+        peer.typed++;
+        unsigned short keycode = 0;
+        bool shift = false;
+        keymap_.find(c, keycode, shift);
+        for (bool down : {true, false}) {
+            char key = down ? keycode : keycode | 0x80;
+            sendMessage(peer.fd, imEncode<SendKey>(std::string_view(&key, 1)));
+        }
+    }
+
+    void readMessages(Peer &peer) {
+        char buf[4096];
+        auto len = read(peer.fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+                peer.fd = -1;
+            }
+            return;
+        }
+        peer.input.append(buf, len);
+        std::string_view data = peer.input;
+        ImInMessage msg;
+        ssize_t msgLen;
+        while ((msgLen = imDecode(data, msg)) > 0) {
+            switch (msg.type()) {
+            case SetWin:
+                sendMessage(peer.fd, imEncode<AckWin>());
+                break;
+            case Ping:
+                sendMessage(peer.fd, imEncode<AckPing>());
+                break;
+            case PutText:
+                peer.texts++;
+                break;
+            default:
+                break;
+            }
+            data.remove_prefix(msgLen);
+        }
+        if (msgLen < 0) {
+            data = {};
+        }
+        peer.input.erase(0, peer.input.size() - data.size());
+    }
+
+    const LoadConfig &config_;
+    const StaticKeymap &keymap_;
+    std::vector<Peer> peers_;
+    std::atomic<bool> done_{false};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+/// @return usec of CPU used by pid, 0 if it can't be read
+uint64_t processCpuTime(pid_t pid) {
+    std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    if (!pid || !std::getline(file, stat)) {
+        return 0;
+    }
+    // The name in parentheses may contain spaces, fields follow it.
+    auto pos = stat.rfind(')');
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    std::istringstream fields(stat.substr(pos + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    // state is field 3, utime and stime are 14 and 15
+    for (int i = 3; i < 14 && fields >> field; i++) {
+    }
+    fields >> utime >> stime;
+    return (utime + stime) * 1000000ULL / sysconf(_SC_CLK_TCK);
+}
+
+/// @return the fcitx5 of the user, 0 if none is running
+pid_t findDaemon() {
+    DIR *dir = opendir("/proc");
+    if (!dir) {
+        return 0;
+    }
+    pid_t pid = 0;
+    while (auto *entry = readdir(dir)) {
+        char *end;
+        long candidate = strtol(entry->d_name, &end, 10);
+        if (*end || candidate <= 0) {
+            continue;
+        }
+        std::string path = std::string("/proc/") + entry->d_name;
+        struct stat st;
+        std::ifstream comm(path + "/comm");
+        std::string name;
+        if (stat(path.c_str(), &st) == 0 && st.st_uid == getuid() &&
+            std::getline(comm, name) && name == "fcitx5") {
+            pid = candidate;
+            break;
+        }
+    }
+    closedir(dir);
+    return pid;
+}
+
+void printLatencies(const char *name, std::vector<uint64_t> latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double q) -> unsigned long long {
+        if (latencies.empty()) {
+            return 0;
+        }
+        return latencies[std::min(latencies.size() - 1,
+                                  static_cast<size_t>(q * latencies.size()))];
+    };
+    printf("%-12s %8zu %8llu %8llu %8llu %8llu\n", name, latencies.size(),
+           percentile(0.5), percentile(0.9), percentile(0.99),
+           latencies.empty() ? 0ULL
+                             : static_cast<unsigned long long>(
+                                   latencies.back()));
+}
+
+int runLoad(const LoadConfig &config) {
+    static const UsKeymap usKeymap;
+    const StaticKeymap *keymap = &usKeymap;
+    std::unique_ptr<KeymapFile> keymapFile;
+    if (!config.keymap.empty()) {
+        keymapFile = KeymapFile::load(config.keymap);
+        if (!keymapFile) {
+            return 1;
+        }
+        keymap = keymapFile.get();
+    }
+    std::unique_ptr<MockService> service;
+    if (config.mock) {
+        service = std::make_unique<MockService>(config.serviceTime);
+    }
+    pid_t daemonPid = config.daemonPid;
+    if (!config.mock && !daemonPid) {
+        daemonPid = findDaemon();
+    }
+
+    std::vector<std::unique_ptr<SessionStats>> stats;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::unique_ptr<Driver>> drivers;
+    for (unsigned i = 0; i < config.workers; i++) {
+        workers.push_back(
+            std::make_unique<Worker>(config, *keymap, service.get()));
+    }
+    for (unsigned i = 0; i < config.drivers; i++) {
+        drivers.push_back(std::make_unique<Driver>(config, *keymap));
+    }
+    // Sessions start spread over one key interval rather than in lockstep.
+    auto interval = static_cast<uint64_t>(1000000 / config.rate);
+    for (unsigned i = 0; i < config.sessions; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+            perror("socketpair");
+            return 1;
+        }
+        stats.push_back(std::make_unique<SessionStats>());
+        workers[i % workers.size()]->addSession(fds[0], *stats.back());
+        Peer peer;
+        peer.fd = fds[1];
+        peer.stats = stats.back().get();
+        peer.offset = interval * i / config.sessions;
+        drivers[i % drivers.size()]->addPeer(std::move(peer));
+    }
+
+    auto begin = now(CLOCK_MONOTONIC);
+    auto daemonBegin =
+        service ? service->cpuTime() : processCpuTime(daemonPid);
+    for (auto &driver : drivers) {
+        driver->start();
+    }
+    while (!std::all_of(drivers.begin(), drivers.end(),
+                        [](const auto &driver) { return driver->done(); })) {
+        usleep(10000);
+    }
+    usleep(SettleTime);
+    auto elapsed = now(CLOCK_MONOTONIC) - begin;
+    auto daemonCpu =
+        (service ? service->cpuTime() : processCpuTime(daemonPid)) -
+        daemonBegin;
+
+    // Sessions may wait for AckWin, keep the drivers answering until the
+    // workers are gone.
+    workers.clear();
+    uint64_t texts = 0;
+    for (auto &driver : drivers) {
+        driver->stop();
+        for (const auto &peer : driver->peers()) {
+            texts += peer.texts;
+            if (peer.fd != -1) {
+                close(peer.fd);
+            }
+        }
+    }
+    service.reset();
+
+    printf("%u sessions, %s profile, %.1f keys/s, %u keys each, ",
+           config.sessions, config.profile->name, config.rate, config.keys);
+    if (config.mock) {
+        printf("mock fcitx5 taking %lluus per key event\n",
+               static_cast<unsigned long long>(config.serviceTime));
+    } else {
+        printf("fcitx5 pid %d\n", daemonPid);
+    }
+    printf("%-12s %8s %8s %8s %8s %8s\n", "usec", "events", "p50", "p90",
+           "p99", "max");
+    std::vector<uint64_t> all;
+    uint64_t timedOut = 0;
+    unsigned notReady = 0;
+    for (size_t i = 0; i < stats.size(); i++) {
+        const auto &latencies = stats[i]->latencies;
+        all.insert(all.end(), latencies.begin(), latencies.end());
+        timedOut += stats[i]->timedOut;
+        notReady += !stats[i]->ready;
+    }
+    printLatencies("all", all);
+    for (size_t i = 0; i < stats.size(); i++) {
+        printLatencies(("session " + std::to_string(i + 1)).c_str(),
+                       stats[i]->latencies);
+    }
+    if (config.mock || daemonPid) {
+        printf("daemon CPU %.1f%% of a core\n", 100.0 * daemonCpu / elapsed);
+    } else {
+        printf("daemon CPU unknown, fcitx5 not found\n");
+    }
+    printf("%llu key events timed out, %llu PutText sent, %u sessions "
+           "never connected\n",
+           static_cast<unsigned long long>(timedOut),
+           static_cast<unsigned long long>(texts), notReady);
+    return 0;
+}
+
+void printUsage(std::string_view arg0) {
+    std::cout << "Usage: " << arg0 << " [options]" << std::endl
+              << "Options:" << std::endl
+              << "  --sessions=<n>  simulated FbTerm sessions, default 8"
+              << std::endl
+              << "  --workers=<n>   threads serving the sessions, default 2"
+              << std::endl
+              << "  --drivers=<n>   threads typing into them, default 1"
+              << std::endl
+              << "  --profile=<steady|burst|pinyin> how keys are typed: "
+                 "evenly, in bursts of 8, or words committed with space"
+              << std::endl
+              << "  --rate=<n>      keys per second in each session, "
+                 "default 10"
+              << std::endl
+              << "  --keys=<n>      keys typed in each session, default 200"
+              << std::endl
+              << "  --backend=<gclient|dbus> how to talk to fcitx5"
+              << std::endl
+              << "  --mock[=<usec>] serve the keys with a mock fcitx5 "
+                 "taking this CPU time per key event, default 100"
+              << std::endl
+              << "  --daemon-pid=<pid> fcitx5 to report the CPU of, found "
+                 "in /proc by default"
+              << std::endl
+              << "  --keymap=<file> type with a keymap written by dumpkeys "
+                 "instead of the US keymap"
+              << std::endl
+              << "  --help          show this message" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    const struct option longOptions[] = {
+        {"sessions", required_argument, nullptr, 's'},
+        {"workers", required_argument, nullptr, 'w'},
+        {"drivers", required_argument, nullptr, 'd'},
+        {"profile", required_argument, nullptr, 'p'},
+        {"rate", required_argument, nullptr, 'r'},
+        {"keys", required_argument, nullptr, 'n'},
+        {"backend", required_argument, nullptr, 'k'},
+        {"mock", optional_argument, nullptr, 'm'},
+        {"daemon-pid", required_argument, nullptr, 'i'},
+        {"keymap", required_argument, nullptr, 'l'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+    LoadConfig config;
+    int r;
+    while ((r = getopt_long_only(argc, argv, "", longOptions, nullptr)) != -1) {
+        switch (r) {
+        case 's':
+            config.sessions = std::max(1, atoi(optarg));
+            break;
+        case 'w':
+            config.workers = std::max(1, atoi(optarg));
+            break;
+        case 'd':
+            config.drivers = std::max(1, atoi(optarg));
+            break;
+        case 'p': {
+            auto iter = std::find_if(
+                std::begin(profiles), std::end(profiles),
+                [](const auto &profile) {
+                    return std::string_view(profile.name) == optarg;
+                });
+            if (iter == std::end(profiles)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            config.profile = &*iter;
+            break;
+        }
+        case 'r':
+            config.rate = std::max(0.1, atof(optarg));
+            break;
+        case 'n':
+            config.keys = std::max(1, atoi(optarg));
+            break;
+        case 'k':
+            if (!parseBackendType(optarg, config.backend)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'm':
+            config.mock = true;
+            if (optarg) {
+                config.serviceTime = strtoull(optarg, nullptr, 10);
+            }
+            break;
+        case 'i':
+            config.daemonPid = atoi(optarg);
+            break;
+        case 'l':
+            config.keymap = optarg;
+            break;
+        case 'h':
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    return runLoad(config);
+}
@@ -0,0 +1,175 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "lowjitter.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <mutex>
+#include <fcitx-utils/log.h>
+#include "imapi.h"
+
+namespace {
+
+// From linux/ioprio.h, which is not installed everywhere.
+constexpr int IoprioClassShift = 13;
+constexpr int IoprioClassBestEffort = 2;
+constexpr int IoprioWhoProcess = 1;
+
+/// nice value asked for, needs CAP_SYS_NICE or RLIMIT_NICE
+constexpr int BoostedNice = -10;
+
+/// stack touched so key processing doesn't fault it in
+constexpr size_t PrefaultStackSize = 128 * 1024;
+
+std::once_flag lockMemoryOnce;
+
+std::string lockMemory() {
+    // MCL_FUTURE makes allocations fail once RLIMIT_MEMLOCK is reached, only
+    // use it when there is no limit.
+    int flags = MCL_CURRENT;
+    rlimit limit;
+    if (geteuid() == 0 ||
+        (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 &&
+         limit.rlim_cur == RLIM_INFINITY)) {
+        flags |= MCL_FUTURE;
+    }
+    if (mlockall(flags) == -1) {
+        return std::string("memory not locked (") + strerror(errno) + ")";
+    }
+    return flags & MCL_FUTURE ? "memory locked"
+                              : "current memory locked";
+}
+
+void prefaultStack() {
+    volatile char stack[PrefaultStackSize];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+std::string boostNice() {
+    std::string result;
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), BoostedNice) == -1) {
+        result = std::string("nice not raised (") + strerror(errno) + ")";
+    } else {
+        result = "nice " + std::to_string(BoostedNice);
+    }
+    if (syscall(SYS_ioprio_set, IoprioWhoProcess, syscall(SYS_gettid),
+                IoprioClassBestEffort << IoprioClassShift) == -1) {
+        result += std::string(", I/O priority not raised (") +
+                  strerror(errno) + ")";
+    } else {
+        result += ", best effort I/O priority 0";
+    }
+    return result;
+}
+
+std::string setScheduler(const LowJitterConfig &config) {
+    int policy = SCHED_OTHER;
+    const char *name = "";
+    switch (config.policy) {
+    case LowJitterConfig::Policy::Fifo:
+        policy = SCHED_FIFO;
+        name = "SCHED_FIFO";
+        break;
+    case LowJitterConfig::Policy::RoundRobin:
+        policy = SCHED_RR;
+        name = "SCHED_RR";
+        break;
+    default:
+        return boostNice();
+    }
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config.realtimePriority;
+    if (int err = pthread_setschedparam(pthread_self(), policy, &param)) {
+        return std::string(name) + " not permitted (" + strerror(err) +
+               "), " + boostNice();
+    }
+    return std::string(name) + " priority " +
+           std::to_string(config.realtimePriority);
+}
+
+/// parse a CPU list like "0,2-3"
+bool parseCpus(const std::string &cpus, cpu_set_t &set) {
+    CPU_ZERO(&set);
+    const char *cur = cpus.c_str();
+    while (*cur) {
+        char *end;
+        unsigned long first = strtoul(cur, &end, 10);
+        unsigned long last = first;
+        if (end != cur && *end == '-') {
+            cur = end + 1;
+            last = strtoul(cur, &end, 10);
+        }
+        if (end == cur || (*end && *end != ',') || last < first ||
+            last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (auto cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+        cur = *end ? end + 1 : end;
+    }
+    return CPU_COUNT(&set) > 0;
+}
+
+std::string pinThread(const std::string &cpus) {
+    cpu_set_t set;
+    if (!parseCpus(cpus, set)) {
+        return "invalid CPU list " + cpus;
+    }
+    if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        return "not pinned to CPUs " + cpus + " (" + strerror(err) + ")";
+    }
+    return "pinned to CPUs " + cpus;
+}
+
+} // namespace
+
+bool LowJitterConfig::parsePolicy(std::string_view value) {
+    if (value == "nice") {
+        policy = Policy::Nice;
+    } else if (value == "fifo") {
+        policy = Policy::Fifo;
+    } else if (value == "rr") {
+        policy = Policy::RoundRobin;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void enterLowJitterMode(const LowJitterConfig &config) {
+    static thread_local bool entered = false;
+    if (config.policy == LowJitterConfig::Policy::Off) {
+        return;
+    }
+    // Every session has its own buffers.
+    prefault_im_buffers();
+    if (entered) {
+        return;
+    }
+    entered = true;
+
+    prefaultStack();
+    std::string report = "buffers pre-faulted";
+    std::call_once(lockMemoryOnce,
+                   [&report]() { report += ", " + lockMemory(); });
+    report += ", " + setScheduler(config);
+    if (!config.cpus.empty()) {
+        report += ", " + pinThread(config.cpus);
+    }
+    FCITX_INFO() << "Low jitter mode: " << report;
+}
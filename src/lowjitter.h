@@ -0,0 +1,51 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_LOWJITTER_H_
+#define _FCITX5_FBTERM_LOWJITTER_H_
+
+#include <string>
+#include <string_view>
+
+/**
+ * Opt-in measures against the IM process being descheduled or paged out
+ * while a key is processed.
+ *
+ * Each measure is attempted on its own and skipped when not permitted, the
+ * startup log reports which ones were obtained.
+ */
+struct LowJitterConfig {
+    enum class Policy {
+        Off,
+        /// lock memory and raise the nice and I/O priority
+        Nice,
+        /// as Nice, but with SCHED_FIFO, falling back to Nice
+        Fifo,
+        /// as Nice, but with SCHED_RR, falling back to Nice
+        RoundRobin,
+    };
+
+    Policy policy = Policy::Off;
+    /// priority for SCHED_FIFO and SCHED_RR
+    int realtimePriority = 10;
+    /// CPUs the thread serving FbTerm is pinned to, e.g. "2,4-5", empty
+    /// for no pinning
+    std::string cpus;
+
+    /// @return false if the value is not one of nice, fifo and rr
+    bool parsePolicy(std::string_view value);
+};
+
+/**
+ * @brief enter low jitter mode after the caches have been warmed up
+ *
+ * The buffers of the current session are pre-faulted every time. Memory is
+ * locked once per process, the scheduling policy and the CPU set apply to
+ * the calling thread and are set once per thread.
+ */
+void enterLowJitterMode(const LowJitterConfig &config);
+
+#endif // _FCITX5_FBTERM_LOWJITTER_H_
@@ -0,0 +1,152 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "mainloop.h"
+#include <exception>
+#include <fcitx-utils/dbus/bus.h>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/eventdispatcher.h>
+#include <fcitx-utils/log.h>
+
+namespace {
+
+/// usec a timer may fire late, the default of sd-event is 250ms
+constexpr uint64_t TimerAccuracy = 1000;
+
+class FcitxLoopSource : public LoopSource {
+public:
+    explicit FcitxLoopSource(std::unique_ptr<fcitx::EventSource> source)
+        : source_(std::move(source)) {}
+
+    bool rearm() override {
+        source_->setOneShot();
+        return true;
+    }
+
+private:
+    std::unique_ptr<fcitx::EventSource> source_;
+};
+
+/// runs on fcitx::EventLoop, the backends share one bus connection
+class FcitxMainLoop : public MainLoop {
+public:
+    FcitxMainLoop() { dispatcher_.attach(&loop_); }
+
+    ~FcitxMainLoop() {
+        bus_.reset();
+        dispatcher_.detach();
+    }
+
+    std::unique_ptr<LoopSource>
+    addWatch(int fd, IOCondition condition,
+             std::function<bool()> callback) override {
+        auto flags = fcitx::IOEventFlags{fcitx::IOEventFlag::Err} |
+                     fcitx::IOEventFlag::Hup;
+        flags = flags | (condition == IOCondition::Input
+                             ? fcitx::IOEventFlag::In
+                             : fcitx::IOEventFlag::Out);
+        // The callback may destroy the source, keep it alive while it runs.
+        auto shared = std::make_shared<std::function<bool()>>(
+            std::move(callback));
+        return std::make_unique<FcitxLoopSource>(loop_.addIOEvent(
+            fd, flags,
+            [shared](fcitx::EventSourceIO *, int, fcitx::IOEventFlags) {
+                auto callback = shared;
+                return (*callback)();
+            }));
+    }
+
+    std::unique_ptr<LoopSource>
+    addIdle(std::function<void()> callback) override {
+        auto shared = std::make_shared<std::function<void()>>(
+            std::move(callback));
+        auto source = loop_.addDeferEvent([shared](fcitx::EventSource *) {
+            auto callback = shared;
+            (*callback)();
+            return true;
+        });
+        source->setOneShot();
+        return std::make_unique<FcitxLoopSource>(std::move(source));
+    }
+
+    std::unique_ptr<LoopSource>
+    addTimer(uint64_t interval, std::function<void()> callback) override {
+        auto shared = std::make_shared<std::function<void()>>(
+            std::move(callback));
+        return std::make_unique<FcitxLoopSource>(loop_.addTimeEvent(
+            CLOCK_MONOTONIC, fcitx::now(CLOCK_MONOTONIC) + interval,
+            TimerAccuracy,
+            [shared, interval](fcitx::EventSourceTime *source,
+                               uint64_t time) {
+                // Re-arm first, the callback may destroy the source.
+                source->setTime(time + interval);
+                source->setOneShot();
+                auto callback = shared;
+                (*callback)();
+                return true;
+            }));
+    }
+
+    void invoke(std::function<void()> callback) override {
+        dispatcher_.schedule(std::move(callback));
+    }
+
+    void run() override { loop_.exec(); }
+
+    void quit() override {
+        dispatcher_.schedule([this]() { loop_.exit(); });
+    }
+
+    std::unique_ptr<FcitxBackend> createBackend() override {
+        if (!bus_ && !busFailed_) {
+            try {
+                bus_ = std::make_unique<fcitx::dbus::Bus>(
+                    fcitx::dbus::BusType::Session);
+                bus_->attachEventLoop(&loop_);
+            } catch (const std::exception &e) {
+                FCITX_ERROR() << "Failed to connect to the session bus: "
+                              << e.what();
+                busFailed_ = true;
+            }
+        }
+        return createDBusBackend(bus_.get());
+    }
+
+private:
+    fcitx::EventLoop loop_;
+    fcitx::EventDispatcher dispatcher_;
+    std::unique_ptr<fcitx::dbus::Bus> bus_;
+    bool busFailed_ = false;
+};
+
+} // namespace
+
+bool parseBackendType(std::string_view name, BackendType &type) {
+#ifdef ENABLE_GCLIENT
+    if (name == "gclient") {
+        type = BackendType::GClient;
+        return true;
+    }
+#endif
+    if (name == "dbus") {
+        type = BackendType::DBus;
+        return true;
+    }
+    return false;
+}
+
+std::unique_ptr<MainLoop> createMainLoop(BackendType type, bool ownContext) {
+#ifdef ENABLE_GCLIENT
+    if (type == BackendType::GClient) {
+        return createGLibMainLoop(ownContext);
+    }
+#else
+    FCITX_UNUSED(type);
+    FCITX_UNUSED(ownContext);
+#endif
+    return std::make_unique<FcitxMainLoop>();
+}
@@ -0,0 +1,79 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_MAINLOOP_H_
+#define _FCITX5_FBTERM_MAINLOOP_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include "backend.h"
+
+/// a watch, idle or timer callback, removed when the object is destroyed
+class LoopSource {
+public:
+    virtual ~LoopSource() = default;
+
+    /**
+     * @brief make an idle source that has fired call its callback once more
+     * @return false if the loop can't reuse the source, add a new one then
+     */
+    virtual bool rearm() { return false; }
+};
+
+/**
+ * Event loop of one thread serving FbTerm sessions.
+ *
+ * The GClient backend needs a GMainContext, the D-Bus backend a
+ * fcitx::EventLoop, so the loop is chosen together with the backend. A
+ * source may be destroyed from its own callback.
+ */
+class MainLoop {
+public:
+    enum class IOCondition {
+        /// readable, hung up or failed
+        Input,
+        /// writable, hung up or failed
+        Output,
+    };
+
+    virtual ~MainLoop() = default;
+
+    /// @param callback returns false to stop watching
+    virtual std::unique_ptr<LoopSource>
+    addWatch(int fd, IOCondition condition, std::function<bool()> callback) = 0;
+
+    /// call callback once when there is nothing else to do
+    virtual std::unique_ptr<LoopSource>
+    addIdle(std::function<void()> callback) = 0;
+
+    /// call callback every interval usec
+    virtual std::unique_ptr<LoopSource>
+    addTimer(uint64_t interval, std::function<void()> callback) = 0;
+
+    /// call callback from the loop, may be called from any thread
+    virtual void invoke(std::function<void()> callback) = 0;
+
+    virtual void run() = 0;
+
+    /// make run() return, may be called from any thread
+    virtual void quit() = 0;
+
+    /// a connection to fcitx served by this loop
+    virtual std::unique_ptr<FcitxBackend> createBackend() = 0;
+};
+
+/**
+ * @param ownContext for GClient, true if the loop is run by a thread of its
+ * own, false to use the default GMainContext of the process
+ */
+std::unique_ptr<MainLoop> createMainLoop(BackendType type, bool ownContext);
+
+#ifdef ENABLE_GCLIENT
+std::unique_ptr<MainLoop> createGLibMainLoop(bool ownContext);
+#endif
+
+#endif // _FCITX5_FBTERM_MAINLOOP_H_
@@ -0,0 +1,248 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "metrics.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcitx-utils/log.h>
+#include "imapi.h"
+#include "utils.h"
+
+Metrics metrics;
+
+namespace {
+
+uint64_t load(const std::atomic<uint64_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+}
+
+void appendHeader(std::string &out, const char *name, const char *type,
+                  const char *help) {
+    out += "# HELP fcitx5_fbterm_";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE fcitx5_fbterm_";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+}
+
+void appendMetric(std::string &out, const char *name, const char *type,
+                  const char *help, uint64_t value) {
+    appendHeader(out, name, type, help);
+    out += "fcitx5_fbterm_";
+    out += name;
+    out += " ";
+    out += std::to_string(value);
+    out += "\n";
+}
+
+void appendSample(std::string &out, const char *name, const char *label,
+                  const std::string &labelValue, uint64_t value) {
+    out += "fcitx5_fbterm_";
+    out += name;
+    out += "{";
+    out += label;
+    out += "=\"";
+    out += labelValue;
+    out += "\"} ";
+    out += std::to_string(value);
+    out += "\n";
+}
+
+void appendHistogram(std::string &out, const char *name, const char *help,
+                     const LatencyHistogram &histogram) {
+    appendHeader(out, name, "histogram", help);
+    std::string bucketName = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < MetricsLatencyBuckets; i++) {
+        cumulative += load(histogram.buckets[i]);
+        appendSample(out, bucketName.c_str(), "le",
+                     i < std::size(MetricsLatencyBounds)
+                         ? std::to_string(MetricsLatencyBounds[i])
+                         : "+Inf",
+                     cumulative);
+    }
+    out += "fcitx5_fbterm_" + std::string(name) + "_sum " +
+           std::to_string(load(histogram.sum)) + "\n";
+    out += "fcitx5_fbterm_" + std::string(name) + "_count " +
+           std::to_string(load(histogram.count)) + "\n";
+}
+
+} // namespace
+
+uint64_t residentMemory() {
+    FILE *file = fopen("/proc/self/statm", "re");
+    if (!file) {
+        return 0;
+    }
+    unsigned long long size = 0, resident = 0;
+    if (fscanf(file, "%llu %llu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(file);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+void metricLatency(LatencyHistogram &histogram, uint64_t latency) {
+    metricAdd(histogram.count);
+    metricAdd(histogram.sum, latency);
+    size_t bucket = 0;
+    while (bucket < std::size(MetricsLatencyBounds) &&
+           latency > MetricsLatencyBounds[bucket]) {
+        bucket++;
+    }
+    metricAdd(histogram.buckets[bucket]);
+}
+
+std::string formatMetrics() {
+    std::string out;
+    appendMetric(out, "keys_processed_total", "counter",
+                 "Keys sent to fcitx.", load(metrics.keysProcessed));
+    appendMetric(out, "keys_passed_through_total", "counter",
+                 "Keys not handled by fcitx and written to the terminal.",
+                 load(metrics.keysPassedThrough));
+
+    appendHistogram(out, "dbus_call_duration_microseconds",
+                    "Latency of ProcessKeyEvent calls.", metrics.dbusCalls);
+    appendMetric(out, "coalesced_repeats_total", "counter",
+                 "Autorepeats not sent to fcitx while composing, the next "
+                 "was queued.",
+                 load(metrics.coalescedRepeats));
+    appendMetric(out, "key_deadline_misses_total", "counter",
+                 "Keys fcitx did not answer in time, passed through.",
+                 load(metrics.keyDeadlineMisses));
+    appendMetric(out, "speculation_hits_total", "counter",
+                 "Preedits drawn ahead of fcitx that it confirmed.",
+                 load(metrics.speculationHits));
+    appendMetric(out, "speculation_misses_total", "counter",
+                 "Preedits drawn ahead of fcitx that it contradicted.",
+                 load(metrics.speculationMisses));
+    appendMetric(out, "focus_changes_total", "counter",
+                 "FocusIn and FocusOut calls.", load(metrics.focusChanges));
+
+    appendMetric(out, "setwin_round_trips_total", "counter",
+                 "SetWin messages acknowledged by fbterm.",
+                 load(metrics.setWinRoundTrips));
+    appendMetric(out, "setwin_wait_microseconds_total", "counter",
+                 "Time spent waiting for AckWin.",
+                 load(metrics.setWinLatencySum));
+    appendMetric(out, "redraws_total", "counter",
+                 "Input method windows drawn.", load(metrics.redraws));
+    appendHistogram(out, "ping_round_trip_microseconds",
+                    "Time fbterm took to answer a Ping.",
+                    metrics.pingRoundTrips);
+    appendMetric(out, "fbterm_stalls_total", "counter",
+                 "Pings fbterm did not answer in time.",
+                 load(metrics.fbtermStalls));
+    appendMetric(out, "deferred_redraws_total", "counter",
+                 "Redraws postponed because fbterm was slow.",
+                 load(metrics.deferredRedraws));
+
+    appendHeader(out, "written_messages_total", "counter",
+                 "Messages sent to fbterm by type.");
+    for (size_t type = 0; type < MetricsMessageTypes; type++) {
+        if (auto value = load(metrics.messagesWritten[type])) {
+            appendSample(out, "written_messages_total", "type",
+                         message_type_name(type), value);
+        }
+    }
+    appendHeader(out, "written_bytes_total", "counter",
+                 "Bytes sent to fbterm by message type.");
+    for (size_t type = 0; type < MetricsMessageTypes; type++) {
+        if (auto value = load(metrics.bytesWritten[type])) {
+            appendSample(out, "written_bytes_total", "type",
+                         message_type_name(type), value);
+        }
+    }
+
+    appendMetric(out, "pending_input_high_water_bytes", "gauge",
+                 "Most bytes buffered from fbterm while waiting for an "
+                 "acknowledgement.",
+                 load(metrics.pendingInputHighWater));
+    appendMetric(out, "output_queue_high_water_bytes", "gauge",
+                 "Most bytes queued because fbterm was not reading.",
+                 load(metrics.outputQueueHighWater));
+    appendMetric(out, "resident_memory_bytes", "gauge",
+                 "Resident set size of the process.", residentMemory());
+    appendMetric(out, "idle_trims_total", "counter",
+                 "Sessions that released their memory after being idle.",
+                 load(metrics.idleTrims));
+    appendMetric(out, "idle_trim_resident_before_bytes", "gauge",
+                 "Resident set size before the last idle trim.",
+                 load(metrics.idleTrimResidentBefore));
+    appendMetric(out, "idle_trim_resident_after_bytes", "gauge",
+                 "Resident set size after the last idle trim.",
+                 load(metrics.idleTrimResidentAfter));
+    return out;
+}
+
+std::string MetricsServer::defaultPath() {
+    return runtimePath("fcitx5-fbterm-metrics-" + std::to_string(getpid()));
+}
+
+std::unique_ptr<MetricsServer>
+MetricsServer::create(const std::string &path, MainLoop &loop) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return nullptr;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    unlink(addr.sun_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        return nullptr;
+    }
+    auto oldMask = umask(0077);
+    auto ret = bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    umask(oldMask);
+    if (ret == -1 || listen(fd, 4) == -1) {
+        FCITX_ERROR() << "Failed to listen on " << path << ": "
+                      << strerror(errno);
+        close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<MetricsServer>(
+        new MetricsServer(fd, path, loop));
+}
+
+MetricsServer::MetricsServer(int fd, std::string path, MainLoop &loop)
+    : fd_(fd), path_(std::move(path)),
+      source_(loop.addWatch(fd_, MainLoop::IOCondition::Input,
+                            [this]() { return acceptClient(); })) {}
+
+bool MetricsServer::acceptClient() {
+    int client =
+        accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client == -1) {
+        return true;
+    }
+    // The exposition is a few KiB, it fits in the socket buffer of a fresh
+    // connection, a client that can't take it loses.
+    auto text = formatMetrics();
+    if (send(client, text.data(), text.size(), MSG_NOSIGNAL) == -1) {
+        FCITX_DEBUG() << "Failed to send metrics: " << strerror(errno);
+    }
+    close(client);
+    return true;
+}
+
+MetricsServer::~MetricsServer() {
+    source_.reset();
+    close(fd_);
+    unlink(path_.c_str());
+}
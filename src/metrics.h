@@ -0,0 +1,128 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_METRICS_H_
+#define _FCITX5_FBTERM_METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include "immessage.h"
+#include "mainloop.h"
+
+/// upper bounds of the latency histogram buckets in usec, plus +Inf
+constexpr uint64_t MetricsLatencyBounds[] = {100, 500, 1000, 5000, 20000,
+                                             100000};
+constexpr size_t MetricsLatencyBuckets = std::size(MetricsLatencyBounds) + 1;
+constexpr size_t MetricsMessageTypes = AckPing + 1;
+
+/// latencies in usec, bucketed by MetricsLatencyBounds
+struct LatencyHistogram {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> buckets[MetricsLatencyBuckets] = {};
+};
+
+/**
+ * Counters of the whole process, summed over all sessions.
+ *
+ * Updated with relaxed atomics from every thread serving a session, a reader
+ * only gets a consistent value for each counter on its own.
+ */
+struct Metrics {
+    /// keys sent to fcitx
+    std::atomic<uint64_t> keysProcessed{0};
+    /// keys not handled by fcitx and written back to FbTerm
+    std::atomic<uint64_t> keysPassedThrough{0};
+    /// ProcessKeyEvent calls
+    LatencyHistogram dbusCalls;
+    /// autorepeat not sent to fcitx while composing, the next repeat was
+    /// queued
+    std::atomic<uint64_t> coalescedRepeats{0};
+    /// keys fcitx didn't answer before the deadline
+    std::atomic<uint64_t> keyDeadlineMisses{0};
+    /// preedits drawn before fcitx sent them which it confirmed or not
+    std::atomic<uint64_t> speculationHits{0};
+    std::atomic<uint64_t> speculationMisses{0};
+    /// FocusIn and FocusOut calls
+    std::atomic<uint64_t> focusChanges{0};
+    /// SetWin messages and the time waiting for AckWin in usec
+    std::atomic<uint64_t> setWinRoundTrips{0};
+    std::atomic<uint64_t> setWinLatencySum{0};
+    std::atomic<uint64_t> redraws{0};
+    /// Ping to AckPing, @see send_im_ping()
+    LatencyHistogram pingRoundTrips;
+    /// times FbTerm did not answer a Ping in time
+    std::atomic<uint64_t> fbtermStalls{0};
+    /// redraws postponed because FbTerm was slow
+    std::atomic<uint64_t> deferredRedraws{0};
+    /// messages sent to FbTerm by type, including queued ones
+    std::atomic<uint64_t> messagesWritten[MetricsMessageTypes] = {};
+    std::atomic<uint64_t> bytesWritten[MetricsMessageTypes] = {};
+    /// bytes read from FbTerm while waiting for an acknowledgement
+    std::atomic<uint64_t> pendingInputHighWater{0};
+    /// bytes queued because FbTerm was not reading
+    std::atomic<uint64_t> outputQueueHighWater{0};
+    /// sessions trimmed after being idle, and the resident memory in bytes
+    /// before and after the last one
+    std::atomic<uint64_t> idleTrims{0};
+    std::atomic<uint64_t> idleTrimResidentBefore{0};
+    std::atomic<uint64_t> idleTrimResidentAfter{0};
+};
+
+extern Metrics metrics;
+
+inline void metricAdd(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void metricMax(std::atomic<uint64_t> &counter, uint64_t value) {
+    auto current = counter.load(std::memory_order_relaxed);
+    while (value > current &&
+           !counter.compare_exchange_weak(current, value,
+                                          std::memory_order_relaxed)) {
+    }
+}
+
+/// @return bytes of resident memory of the process, 0 if unknown
+uint64_t residentMemory();
+
+/// count an operation that took latency usec
+void metricLatency(LatencyHistogram &histogram, uint64_t latency);
+
+/// the counters in the Prometheus text exposition format
+std::string formatMetrics();
+
+/**
+ * Read-only socket serving formatMetrics().
+ *
+ * Each connection gets the current counters and is closed, e.g.
+ * `socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/fcitx5-fbterm-metrics-<pid>`.
+ * The socket is served from the loop passed in.
+ */
+class MetricsServer {
+public:
+    /// @return nullptr if the socket can't be created
+    static std::unique_ptr<MetricsServer> create(const std::string &path,
+                                                 MainLoop &loop);
+    ~MetricsServer();
+
+    /// default path of the socket of this process
+    static std::string defaultPath();
+
+private:
+    MetricsServer(int fd, std::string path, MainLoop &loop);
+
+    bool acceptClient();
+
+    int fd_;
+    std::string path_;
+    std::unique_ptr<LoopSource> source_;
+};
+
+#endif // _FCITX5_FBTERM_METRICS_H_
@@ -0,0 +1,133 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "render.h"
+#include <cstring>
+#include "utils.h"
+
+void DisplayList::clear() {
+    data_.clear();
+    messages_.clear();
+    x_ = y_ = 0;
+}
+
+void DisplayList::release() {
+    std::string().swap(data_);
+    std::vector<size_t>().swap(messages_);
+    x_ = y_ = 0;
+}
+
+void DisplayList::append(const ImOutMessage &msg) {
+    messages_.push_back(data_.size());
+    data_.append(reinterpret_cast<const char *>(&msg.header), msg.headerSize);
+    data_.append(msg.payload);
+}
+
+void DisplayList::fillRect(const Rectangle &rect, unsigned char color) {
+    auto msg = imEncode<FillRect>();
+    msg.header.fillRect.rect = rect;
+    msg.header.fillRect.color = color;
+    append(msg);
+}
+
+void DisplayList::drawText(unsigned x, unsigned y, unsigned char fc,
+                           unsigned char bc, std::string_view text) {
+    if (text.empty() || text.size() > ImMaxPayload<DrawText>) {
+        return;
+    }
+    auto msg = imEncode<DrawText>(text);
+    msg.header.drawText.x = x;
+    msg.header.drawText.y = y;
+    msg.header.drawText.fc = fc;
+    msg.header.drawText.bc = bc;
+    append(msg);
+}
+
+void DisplayList::moveTo(unsigned x, unsigned y) {
+    // Unsigned arithmetic wraps, moving left or up works as well.
+    unsigned dx = x - x_, dy = y - y_;
+    if (!dx && !dy) {
+        return;
+    }
+    x_ = x;
+    y_ = y;
+    for (auto offset : messages_) {
+        char *msg = data_.data() + offset;
+        unsigned short type;
+        memcpy(&type, msg + offsetof(Message, type), sizeof(type));
+        size_t xOffset = type == FillRect ? offsetof(Message, fillRect.rect.x)
+                                          : offsetof(Message, drawText.x);
+        size_t yOffset = type == FillRect ? offsetof(Message, fillRect.rect.y)
+                                          : offsetof(Message, drawText.y);
+        unsigned value;
+        memcpy(&value, msg + xOffset, sizeof(value));
+        value += dx;
+        memcpy(msg + xOffset, &value, sizeof(value));
+        memcpy(&value, msg + yOffset, sizeof(value));
+        value += dy;
+        memcpy(msg + yOffset, &value, sizeof(value));
+    }
+}
+
+void StyledLine::clear() {
+    size_ = 0;
+    width_ = 0;
+}
+
+void StyledLine::release() {
+    std::vector<StyledSpan>().swap(spans_);
+    clear();
+}
+
+void StyledLine::append(std::string_view text, unsigned char foreground,
+                        unsigned char background) {
+    if (text.empty()) {
+        return;
+    }
+    width_ += text_width(text);
+    if (size_ && spans_[size_ - 1].foreground == foreground &&
+        spans_[size_ - 1].background == background) {
+        spans_[size_ - 1].text.append(text);
+        return;
+    }
+    if (size_ == spans_.size()) {
+        spans_.emplace_back();
+    }
+    auto &span = spans_[size_++];
+    span.text.assign(text);
+    span.foreground = foreground;
+    span.background = background;
+}
+
+bool StyledLine::operator==(const StyledLine &other) const {
+    if (size_ != other.size_ || width_ != other.width_) {
+        return false;
+    }
+    for (size_t i = 0; i < size_; i++) {
+        const auto &lhs = spans_[i];
+        const auto &rhs = other.spans_[i];
+        if (lhs.foreground != rhs.foreground ||
+            lhs.background != rhs.background || lhs.text != rhs.text) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void StyledLine::draw(DisplayList &list, unsigned x, unsigned y,
+                      unsigned fontWidth, unsigned char background) const {
+    for (size_t i = 0; i < size_; i++) {
+        const auto &span = spans_[i];
+        auto width = text_width(span.text);
+        if (span.background != background ||
+            span.text.find_first_not_of(' ') != std::string::npos) {
+            list.drawText(x, y, span.foreground, span.background,
+                          span.text);
+        }
+        x += width * fontWidth;
+    }
+}
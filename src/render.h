@@ -0,0 +1,105 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_RENDER_H_
+#define _FCITX5_FBTERM_RENDER_H_
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "imcodec.h"
+
+/// text drawn with one pair of colors
+struct StyledSpan {
+    std::string text;
+    unsigned char foreground;
+    unsigned char background;
+};
+
+/**
+ * The FillRect and DrawText messages drawing a window, kept encoded.
+ *
+ * The messages of the last frame are sent again when FbTerm asks for a
+ * redraw or the window only moves, without laying the text out again.
+ * Coordinates are patched in place by moveTo(), so the list can be sent
+ * as it is in one write.
+ */
+class DisplayList {
+public:
+    /// start a new frame drawn at the origin 0, 0
+    void clear();
+
+    /// clear and free the buffers
+    void release();
+
+    bool empty() const { return data_.empty(); }
+
+    void fillRect(const Rectangle &rect, unsigned char color);
+
+    /// text is skipped if empty or longer than a message can carry
+    void drawText(unsigned x, unsigned y, unsigned char fc, unsigned char bc,
+                  std::string_view text);
+
+    /// translate the messages to draw the frame with its origin at x, y
+    void moveTo(unsigned x, unsigned y);
+
+    /// the encoded messages, @see send_im_messages()
+    std::string_view data() const { return data_; }
+
+private:
+    void append(const ImOutMessage &msg);
+
+    std::string data_;
+    /// offsets of the messages in data_
+    std::vector<size_t> messages_;
+    /// origin of the coordinates in data_
+    unsigned x_ = 0, y_ = 0;
+};
+
+/**
+ * A line of text in several colors.
+ *
+ * Text appended in the same colors as the previous span is merged into it,
+ * so drawing the line takes one DrawText message per color change. The spans
+ * are reused after clear() to avoid allocating for every frame.
+ */
+class StyledLine {
+public:
+    void clear();
+
+    /// clear and free the spans kept for reuse
+    void release();
+
+    bool empty() const { return width_ == 0; }
+
+    void append(std::string_view text, unsigned char foreground,
+                unsigned char background);
+
+    /// columns taken on the console
+    unsigned width() const { return width_; }
+
+    size_t spanCount() const { return size_; }
+
+    const StyledSpan &span(size_t index) const { return spans_[index]; }
+
+    bool operator==(const StyledLine &other) const;
+
+    /**
+     * @brief add the line to a display list with its top left corner at x, y
+     * @param background color already filled behind the line, blank spans
+     * in this color are not drawn
+     */
+    void draw(DisplayList &list, unsigned x, unsigned y, unsigned fontWidth,
+              unsigned char background) const;
+
+private:
+    std::vector<StyledSpan> spans_;
+    size_t size_ = 0;
+    unsigned width_ = 0;
+};
+
+#endif // _FCITX5_FBTERM_RENDER_H_
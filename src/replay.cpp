@@ -0,0 +1,1730 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+/**
+ * Replays a session log written with `fcitx5-fbterm --record` against
+ * FcitxFbterm, with a fake FbTerm feeding the recorded messages and a mock
+ * fcitx answering keys and emitting signals as recorded.
+ *
+ * With --scenario, canonical sessions are synthesized instead, typed with a
+ * US keymap, and the messages sent for them are checked against budgets and
+ * the final frame against a snapshot. Scenarios run on a simulated clock, so
+ * their results don't depend on how loaded the machine is.
+ *
+ * Scenarios marking a steady state count the heap allocations made on the
+ * thread of FcitxFbterm for each key typed in it, and print where they were
+ * made.
+ *
+ * With --keymap, keys are translated with a keymap written by dumpkeys, both
+ * when replaying a log, which otherwise needs the console it was recorded on,
+ * and when typing a scenario.
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/utf8.h>
+#include <getopt.h>
+#include <linux/input.h>
+#ifdef __GLIBC__
+#include <dlfcn.h>
+#include <execinfo.h>
+#endif
+#include "fcitxfbterm.h"
+#include "imrecord.h"
+#include "keymapfile.h"
+#include "mainloop.h"
+#include "metrics.h"
+#include "uskeymap.h"
+#include "utils.h"
+
+namespace {
+
+/**
+ * Heap allocations made while a steady state key is handled, counted on the
+ * thread running FcitxFbterm only. Allocations by C libraries are not
+ * counted.
+ *
+ * An allocation is attributed to the first frame of its call stack outside
+ * the C++ runtime. Those made by shared libraries, e.g. the event loop of
+ * fcitx, are reported but not budgeted.
+ */
+struct AllocationCounter {
+    static constexpr size_t MaxSites = 16;
+    static constexpr int MaxFrames = 24;
+
+    struct Site {
+        void *frames[MaxFrames];
+        int depth;
+        bool own;
+        uint64_t count;
+    };
+
+    /// set by the fake FbTerm while a measured key is handled
+    std::atomic<bool> measuring{false};
+    /// allocations made by this executable and by shared libraries
+    uint64_t own = 0;
+    uint64_t library = 0;
+    /// distinct call stacks of the allocations, the first MaxSites of them
+    Site sites[MaxSites];
+    size_t siteCount = 0;
+
+    void record();
+    void reset() {
+        own = library = 0;
+        siteCount = 0;
+    }
+};
+
+AllocationCounter allocations;
+
+/// non-zero on the thread running FcitxFbterm, zero while the mock fcitx
+/// works on it, @see MockWork
+thread_local int countAllocations = 0;
+/// the allocations made while recording one are not counted
+thread_local bool recordingAllocation = false;
+
+#ifdef __GLIBC__
+enum class FrameOwner { Executable, Runtime, Library };
+
+FrameOwner frameOwner(void *frame) {
+    static void *executable = []() {
+        Dl_info info;
+        dladdr(reinterpret_cast<void *>(&frameOwner), &info);
+        return info.dli_fbase;
+    }();
+    Dl_info info;
+    if (!dladdr(frame, &info)) {
+        return FrameOwner::Library;
+    }
+    if (info.dli_fbase == executable) {
+        return FrameOwner::Executable;
+    }
+    if (info.dli_fname && strstr(info.dli_fname, "libstdc++")) {
+        return FrameOwner::Runtime;
+    }
+    return FrameOwner::Library;
+}
+#endif
+
+[[gnu::noinline]] void AllocationCounter::record() {
+#ifdef __GLIBC__
+    Site site;
+    recordingAllocation = true;
+    site.depth = backtrace(site.frames, MaxFrames);
+    recordingAllocation = false;
+    // The first frames are record() and operator new.
+    site.own = false;
+    for (int i = 2; i < site.depth; i++) {
+        auto owner = frameOwner(site.frames[i]);
+        if (owner != FrameOwner::Runtime) {
+            site.own = owner == FrameOwner::Executable;
+            break;
+        }
+    }
+    (site.own ? own : library)++;
+    for (size_t i = 0; i < siteCount; i++) {
+        if (sites[i].depth == site.depth &&
+            std::equal(site.frames, site.frames + site.depth,
+                       sites[i].frames)) {
+            sites[i].count++;
+            return;
+        }
+    }
+    if (siteCount < MaxSites) {
+        site.count = 1;
+        sites[siteCount++] = site;
+    }
+#else
+    own++;
+#endif
+}
+
+/// the mock fcitx is not part of the keystroke path being measured
+class MockWork {
+public:
+    MockWork() : saved_(countAllocations) { countAllocations = 0; }
+    ~MockWork() { countAllocations = saved_; }
+
+private:
+    int saved_;
+};
+
+} // namespace
+
+[[gnu::noinline]] void *operator new(size_t size) {
+    if (countAllocations && !recordingAllocation &&
+        allocations.measuring.load(std::memory_order_relaxed)) {
+        allocations.record();
+    }
+    if (void *ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+using namespace fcitx;
+
+namespace {
+
+using Record = ImRecordReader::Record;
+
+unsigned messageType(std::string_view message) {
+    Message header = {};
+    memcpy(&header, message.data(), std::min(message.size(), sizeof(header)));
+    return header.type;
+}
+
+/// answers keys and emits signals the way fcitx did in the recording
+class ReplayBackend : public FcitxBackend {
+public:
+    /// @param connectDelay usec before the signals recorded before the
+    /// first key, e.g. Connected, are emitted
+    ReplayBackend(MainLoop &loop, std::vector<Record> records,
+                  uint64_t connectDelay = 0)
+        : loop_(loop), records_(std::move(records)) {
+        if (!connectDelay) {
+            scheduleSignals();
+            return;
+        }
+        connectTimer_ = loop_.addTimer(connectDelay, [this]() {
+            connectTimer_.reset();
+            scheduleSignals();
+        });
+    }
+
+    bool isValid() const override { return valid_; }
+
+    void focusIn() override { focusChanges_++; }
+
+    void focusOut() override { focusChanges_++; }
+
+    /// FocusIn and FocusOut calls
+    uint64_t focusChanges() const { return focusChanges_; }
+
+    void setCapability(uint64_t) override {}
+
+    int processKeySync(uint32_t, uint32_t, uint32_t, bool, uint32_t,
+                       uint64_t) override {
+        // Signals of the previous keys that have not been delivered yet.
+        emitSignals();
+        MockWork mock;
+        int result = 0;
+        if (cursor_ < records_.size()) {
+            RecordKey key;
+            memcpy(&key, records_[cursor_].payload.data(),
+                   std::min(sizeof(key), records_[cursor_].payload.size()));
+            result = key.result;
+            cursor_++;
+        }
+        scheduleSignals();
+        return result;
+    }
+
+    void ping(uint64_t, std::function<void(bool)> callback) override {
+        // Pings aren't recorded, fcitx answers them at once.
+        MockWork mock;
+        pingCallback_ = std::move(callback);
+        pingIdle_ = loop_.addIdle([this]() {
+            pingIdle_.reset();
+            auto callback = std::move(pingCallback_);
+            callback(true);
+        });
+    }
+
+private:
+    void scheduleSignals() {
+        if (idle_) {
+            return;
+        }
+        MockWork mock;
+        idle_ = loop_.addIdle([this]() {
+            idle_.reset();
+            emitSignals();
+        });
+    }
+
+    void emitSignals() {
+        while (cursor_ < records_.size() &&
+               records_[cursor_].type != RecordKeyResult) {
+            // Advance first, a callback may send keys, which emit the rest.
+            const auto &record = records_[cursor_++];
+            std::string payload;
+            {
+                MockWork mock;
+                payload = record.payload;
+            }
+            switch (record.type) {
+            case RecordConnected:
+                valid_ = true;
+                if (callbacks_.connected) {
+                    callbacks_.connected();
+                }
+                break;
+            case RecordCommitString:
+                if (callbacks_.commitString) {
+                    callbacks_.commitString(payload.c_str());
+                }
+                break;
+            case RecordCurrentIM: {
+                {
+                    MockWork mock;
+                    payload.resize(payload.size() + 3);
+                }
+                const char *name = payload.c_str();
+                const char *uniqueName = name + strlen(name) + 1;
+                const char *langCode = uniqueName + strlen(uniqueName) + 1;
+                if (callbacks_.currentIM) {
+                    callbacks_.currentIM(name, uniqueName, langCode);
+                }
+                break;
+            }
+            case RecordClientSideUI: {
+                bool valid;
+                {
+                    MockWork mock;
+                    valid = deserializeClientSideUI(record.payload, ui_);
+                }
+                if (valid && callbacks_.updateClientSideUI) {
+                    callbacks_.updateClientSideUI(ui_);
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    MainLoop &loop_;
+    std::vector<Record> records_;
+    size_t cursor_ = 0;
+    std::unique_ptr<LoopSource> idle_;
+    std::unique_ptr<LoopSource> connectTimer_;
+    std::unique_ptr<LoopSource> pingIdle_;
+    std::function<void(bool)> pingCallback_;
+    bool valid_ = false;
+    ClientSideUI ui_;
+    uint64_t focusChanges_ = 0;
+};
+
+/// usec of the clock of the scenarios, @see SimulatedMainLoop
+std::atomic<uint64_t> simulatedTime{0};
+/// a second after boot, for the code taking 0 as unset
+constexpr uint64_t SimulatedStartTime = 1000000;
+
+uint64_t simulatedNow() { return simulatedTime.load(); }
+
+/**
+ * Main loop of the scenarios, on the simulated clock.
+ *
+ * The clock is only advanced by the fake FbTerm, once the loop has nothing
+ * left to do and FbTerm has read everything, so timers fire at the same point
+ * of every run.
+ */
+class SimulatedMainLoop : public MainLoop {
+public:
+    SimulatedMainLoop() : wakeFd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+
+    ~SimulatedMainLoop() { close(wakeFd_); }
+
+    std::unique_ptr<LoopSource>
+    addWatch(int fd, IOCondition condition,
+             std::function<bool()> callback) override {
+        MockWork mock;
+        auto source = std::make_shared<Source>(Source::Kind::Watch);
+        source->fd = fd;
+        source->condition = condition;
+        source->watch = std::move(callback);
+        return add(std::move(source));
+    }
+
+    std::unique_ptr<LoopSource>
+    addIdle(std::function<void()> callback) override {
+        MockWork mock;
+        auto source = std::make_shared<Source>(Source::Kind::Idle);
+        source->callback = std::move(callback);
+        return add(std::move(source));
+    }
+
+    std::unique_ptr<LoopSource>
+    addTimer(uint64_t interval, std::function<void()> callback) override {
+        MockWork mock;
+        auto source = std::make_shared<Source>(Source::Kind::Timer);
+        source->interval = interval;
+        source->due = simulatedNow() + interval;
+        source->callback = std::move(callback);
+        return add(std::move(source));
+    }
+
+    void invoke(std::function<void()> callback) override {
+        {
+            MockWork mock;
+            std::lock_guard<std::mutex> lock(mutex_);
+            invoked_.push_back(std::move(callback));
+        }
+        wake();
+    }
+
+    void run() override {
+        while (!quit_) {
+            if (!dispatch()) {
+                wait();
+            }
+        }
+        quit_ = false;
+    }
+
+    void quit() override {
+        quit_ = true;
+        wake();
+    }
+
+    std::unique_ptr<FcitxBackend> createBackend() override { return nullptr; }
+
+    /**
+     * @brief check whether the loop waits for something only FbTerm or the
+     * clock can bring
+     *
+     * Called from the thread of the fake FbTerm.
+     */
+    bool quiet() {
+        std::vector<pollfd> fds;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!waiting_) {
+                return false;
+            }
+            fds = waitFds_;
+        }
+        return poll(fds.data(), fds.size(), 0) == 0;
+    }
+
+    /// time the next timer is due, valid while quiet()
+    uint64_t nextTimer() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return nextTimer_;
+    }
+
+    /// move the clock to time, the timers due by then fire
+    void advance(uint64_t time) {
+        simulatedTime = time;
+        wake();
+    }
+
+private:
+    struct Source {
+        enum class Kind { Watch, Idle, Timer };
+
+        explicit Source(Kind kind) : kind(kind) {}
+
+        Kind kind;
+        bool enabled = true;
+        int fd = -1;
+        IOCondition condition = IOCondition::Input;
+        std::function<bool()> watch;
+        std::function<void()> callback;
+        uint64_t interval = 0;
+        uint64_t due = 0;
+    };
+
+    class Handle : public LoopSource {
+    public:
+        Handle(SimulatedMainLoop &loop, Source *source)
+            : loop_(loop), source_(source) {}
+
+        ~Handle() override { loop_.remove(source_); }
+
+        bool rearm() override {
+            if (source_->kind != Source::Kind::Idle) {
+                return false;
+            }
+            source_->enabled = true;
+            return true;
+        }
+
+    private:
+        SimulatedMainLoop &loop_;
+        Source *source_;
+    };
+
+    std::unique_ptr<LoopSource> add(std::shared_ptr<Source> source) {
+        auto *raw = source.get();
+        sources_.push_back(std::move(source));
+        return std::make_unique<Handle>(*this, raw);
+    }
+
+    void remove(Source *source) {
+        MockWork mock;
+        // A source being dispatched stays alive in ready_ until it returns.
+        source->enabled = false;
+        sources_.erase(std::find_if(
+            sources_.begin(), sources_.end(),
+            [source](const auto &item) { return item.get() == source; }));
+    }
+
+    void wake() {
+        uint64_t value = 1;
+        (void)!write(wakeFd_, &value, sizeof(value));
+    }
+
+    static short pollEvents(IOCondition condition) {
+        return condition == IOCondition::Input ? POLLIN : POLLOUT;
+    }
+
+    /// enabled watches, and the wake up event last if wakeup is true
+    void collectWatches(bool wakeup) {
+        MockWork mock;
+        ready_.clear();
+        pollFds_.clear();
+        for (const auto &source : sources_) {
+            if (source->enabled && source->kind == Source::Kind::Watch) {
+                ready_.push_back(source);
+                pollFds_.push_back(
+                    {source->fd, pollEvents(source->condition), 0});
+            }
+        }
+        if (wakeup) {
+            pollFds_.push_back({wakeFd_, POLLIN, 0});
+        }
+    }
+
+    /**
+     * Dispatch the invoked callbacks, else the ready watches, else one due
+     * timer, else the idle sources.
+     * @return false if there was nothing to do
+     */
+    bool dispatch() {
+        std::vector<std::function<void()>> invoked;
+        {
+            MockWork mock;
+            std::lock_guard<std::mutex> lock(mutex_);
+            invoked.swap(invoked_);
+        }
+        for (auto &callback : invoked) {
+            callback();
+        }
+        bool dispatched = !invoked.empty();
+
+        collectWatches(false);
+        if (poll(pollFds_.data(), pollFds_.size(), 0) > 0) {
+            for (size_t i = 0; i < pollFds_.size(); i++) {
+                auto &source = *ready_[i];
+                if (pollFds_[i].revents && source.enabled) {
+                    dispatched = true;
+                    if (!source.watch()) {
+                        source.enabled = false;
+                    }
+                }
+            }
+        }
+        if (dispatched) {
+            return true;
+        }
+
+        // Held, the callback may destroy the source.
+        std::shared_ptr<Source> timer;
+        for (const auto &source : sources_) {
+            if (source->enabled && source->kind == Source::Kind::Timer &&
+                source->due <= simulatedNow() &&
+                (!timer || source->due < timer->due)) {
+                timer = source;
+            }
+        }
+        if (timer) {
+            timer->due += timer->interval;
+            timer->callback();
+            return true;
+        }
+
+        {
+            MockWork mock;
+            ready_.clear();
+            for (const auto &source : sources_) {
+                if (source->enabled && source->kind == Source::Kind::Idle) {
+                    ready_.push_back(source);
+                }
+            }
+        }
+        for (const auto &source : ready_) {
+            if (source->enabled) {
+                source->enabled = false;
+                source->callback();
+                dispatched = true;
+            }
+        }
+        return dispatched;
+    }
+
+    /// block until a watch is ready or the loop is woken up
+    void wait() {
+        collectWatches(true);
+        {
+            MockWork mock;
+            std::lock_guard<std::mutex> lock(mutex_);
+            waiting_ = true;
+            waitFds_ = pollFds_;
+            nextTimer_ = UINT64_MAX;
+            for (const auto &source : sources_) {
+                if (source->enabled && source->kind == Source::Kind::Timer) {
+                    nextTimer_ = std::min(nextTimer_, source->due);
+                }
+            }
+        }
+        while (poll(pollFds_.data(), pollFds_.size(), -1) == -1 &&
+               errno == EINTR) {
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            waiting_ = false;
+        }
+        uint64_t value;
+        (void)!read(wakeFd_, &value, sizeof(value));
+    }
+
+    int wakeFd_;
+    std::atomic<bool> quit_{false};
+    std::vector<std::shared_ptr<Source>> sources_;
+    /// sources being dispatched and the watched fds, reused
+    std::vector<std::shared_ptr<Source>> ready_;
+    std::vector<pollfd> pollFds_;
+
+    std::mutex mutex_;
+    std::vector<std::function<void()>> invoked_;
+    /// the loop is blocked in wait() on waitFds_
+    bool waiting_ = false;
+    std::vector<pollfd> waitFds_;
+    uint64_t nextTimer_ = UINT64_MAX;
+};
+
+/// plays FbTerm's side of the recording
+class FakeFbterm {
+public:
+    struct MessageStats {
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+    };
+
+    FakeFbterm(std::vector<Record> inputs, bool maxSpeed, unsigned settleMs)
+        : inputs_(std::move(inputs)), maxSpeed_(maxSpeed),
+          settleMs_(settleMs) {}
+
+    void run(int fd) {
+        fd_ = fd;
+        auto replayStart = monotonicTime();
+        auto logStart = inputs_.empty() ? 0 : inputs_.front().time;
+        // The Connect message sent on startup.
+        drain();
+        bool disconnected = false;
+        for (size_t i = 0; i < inputs_.size(); i++) {
+            const auto &input = inputs_[i];
+            auto due = replayStart + (input.time - logStart);
+            if (loop_) {
+                // The timers due before the message fire first, in order.
+                for (auto next = loop_->nextTimer(); next <= due;
+                     next = loop_->nextTimer()) {
+                    loop_->advance(next);
+                    drain();
+                }
+                loop_->advance(due);
+            } else if (!maxSpeed_) {
+                auto current = monotonicTime();
+                if (due > current) {
+                    usleep(due - current);
+                }
+            }
+            auto type = messageType(input.payload);
+            bool measured = i >= measureFrom_ && type == SendKey;
+            if (measured) {
+                allocations.measuring = true;
+                measuredKeys_ +=
+                    input.payload.size() - offsetof(Message, keys);
+            }
+            auto sent = monotonicTime();
+            writeAll(input.payload);
+            received_++;
+            if (type == Disconnect) {
+                disconnected = true;
+                break;
+            }
+            if (type == FbTermInfo) {
+                resize(input.payload);
+            } else if (type == HideUI) {
+                // Another sub-window is shown.
+                std::fill(cells_.begin(), cells_.end(), Cell());
+            }
+            auto lastOutput = drain();
+            allocations.measuring = false;
+            if (type == SendKey && lastOutput) {
+                latencies_.push_back(lastOutput - sent);
+            }
+        }
+        if (!disconnected) {
+            Message msg;
+            msg.type = Disconnect;
+            msg.len = sizeof(msg);
+            writeAll(std::string_view(reinterpret_cast<char *>(&msg),
+                                      sizeof(msg)));
+        }
+        elapsed_ = monotonicTime() - replayStart;
+    }
+
+    const MessageStats &sent(unsigned type) const { return sent_[type]; }
+
+    /**
+     * @brief run on the simulated clock of loop
+     *
+     * The messages are sent at their simulated time, each once loop is done
+     * with the previous one, instead of after the output has settled.
+     */
+    void simulate(SimulatedMainLoop &loop) { loop_ = &loop; }
+
+    /// count the allocations made for the keys from this input on
+    void measureFrom(size_t input) { measureFrom_ = input; }
+
+    uint64_t measuredKeys() const { return measuredKeys_; }
+
+    /**
+     * @brief the cells drawn on when the session ended
+     *
+     * Every row with something drawn on it is a line of text, followed by a
+     * line with the background color of each cell in hex. The text written
+     * to the terminal with PutText comes last, control characters in caret
+     * notation.
+     */
+    std::string frame() const {
+        std::string out;
+        for (unsigned row = 0; row < rows_; row++) {
+            const auto *cells = &cells_[row * columns_];
+            if (std::none_of(cells, cells + columns_, [](const Cell &cell) {
+                    return cell.background != -1;
+                })) {
+                continue;
+            }
+            std::string text, colors;
+            for (unsigned column = 0; column < columns_; column++) {
+                const auto &cell = cells[column];
+                if (cell.background == -1) {
+                    text += ' ';
+                    colors += ' ';
+                    continue;
+                }
+                text += cell.text;
+                colors += cell.background < 16
+                              ? "0123456789abcdef"[cell.background]
+                              : '+';
+            }
+            auto label = std::to_string(row);
+            label.insert(0, label.size() < 3 ? 3 - label.size() : 0, ' ');
+            out += label + " |" + trimRight(text) + "\n";
+            out += "    |" + trimRight(colors) + "\n";
+        }
+        if (!typed_.empty()) {
+            out += "  > |";
+            for (unsigned char c : typed_) {
+                if (c < 0x20 || c == 0x7f) {
+                    out += '^';
+                    c ^= 0x40;
+                }
+                out += c;
+            }
+            out += "\n";
+        }
+        return out;
+    }
+
+    void report(std::ostream &out) {
+        out << "Replayed " << received_ << " messages in " << elapsed_ / 1000
+            << "ms";
+        if (elapsed_) {
+            out << " (" << received_ * 1000000 / elapsed_ << " msg/s)";
+        }
+        out << std::endl;
+
+        if (!latencies_.empty()) {
+            std::sort(latencies_.begin(), latencies_.end());
+            uint64_t total = 0;
+            for (auto latency : latencies_) {
+                total += latency;
+            }
+            auto percentile = [this](unsigned p) {
+                return latencies_[(latencies_.size() - 1) * p / 100];
+            };
+            out << "SendKey latency (us): count " << latencies_.size()
+                << " mean " << total / latencies_.size() << " p50 "
+                << percentile(50) << " p90 " << percentile(90) << " p99 "
+                << percentile(99) << " max " << latencies_.back()
+                << std::endl;
+        }
+
+        out << "Messages sent by the IM server:" << std::endl;
+        for (unsigned type = 0; type < std::size(sent_); type++) {
+            if (sent_[type].count) {
+                out << "  " << message_type_name(type) << ": "
+                    << sent_[type].count << " messages, "
+                    << sent_[type].bytes << " bytes" << std::endl;
+            }
+        }
+    }
+
+private:
+    /// a character cell of the screen
+    struct Cell {
+        /// empty for the right half of a double width character
+        std::string text;
+        /// -1 if the IM server hasn't drawn on the cell
+        int background = -1;
+    };
+
+    static std::string trimRight(std::string str) {
+        str.erase(str.find_last_not_of(' ') + 1);
+        return str;
+    }
+
+    void writeAll(std::string_view data) {
+        while (!data.empty()) {
+            auto ret = write(fd_, data.data(), data.size());
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                return;
+            }
+            data.remove_prefix(ret);
+        }
+    }
+
+    void reply(MessageType type) {
+        Message msg;
+        msg.type = type;
+        msg.len = sizeof(msg);
+        writeAll(
+            std::string_view(reinterpret_cast<char *>(&msg), sizeof(msg)));
+    }
+
+    /// read everything the IM server sends until it is quiet
+    /// @return time of the last message, 0 if there was none
+    uint64_t drain() {
+        uint64_t lastOutput = 0;
+        pollfd pfd = {fd_, POLLIN, 0};
+        while (true) {
+            if (poll(&pfd, 1, loop_ ? 1 : settleMs_) <= 0) {
+                // Nothing is on the way once the loop is quiet, but it may
+                // have written before getting there.
+                if (!loop_ || (loop_->quiet() && poll(&pfd, 1, 0) <= 0)) {
+                    break;
+                }
+                continue;
+            }
+            char buf[4096];
+            auto len = read(fd_, buf, sizeof(buf));
+            if (len <= 0) {
+                break;
+            }
+            lastOutput = monotonicTime();
+            pending_.append(buf, len);
+
+            Message header;
+            while (pending_.size() >= offsetof(Message, raw)) {
+                memcpy(&header, pending_.data(), offsetof(Message, raw));
+                if (header.len < offsetof(Message, raw) ||
+                    header.len > pending_.size()) {
+                    break;
+                }
+                if (header.type < std::size(sent_)) {
+                    sent_[header.type].count++;
+                    sent_[header.type].bytes += header.len;
+                }
+                if (header.type == SetWin) {
+                    reply(AckWin);
+                } else if (header.type == Ping) {
+                    reply(AckPing);
+                } else if (header.type == PutText) {
+                    typed_.append(pending_, offsetof(Message, texts),
+                                  header.len - offsetof(Message, texts));
+                }
+                render(std::string_view(pending_.data(), header.len));
+                pending_.erase(0, header.len);
+            }
+        }
+        return lastOutput;
+    }
+
+    /// start a blank screen of the size in a FbTermInfo message
+    void resize(std::string_view message) {
+        Message msg;
+        memcpy(&msg, message.data(), std::min(message.size(), sizeof(msg)));
+        fontWidth_ = std::max(msg.info.fontWidth, 2u);
+        fontHeight_ = std::max(msg.info.fontHeight, 2u);
+        columns_ = msg.info.screenWidth / fontWidth_;
+        rows_ = msg.info.screenHeight / fontHeight_;
+        cells_.assign(columns_ * rows_, Cell());
+        std::fill(std::begin(windows_), std::end(windows_),
+                  Rectangle{0, 0, 0, 0});
+    }
+
+    /// cells whose center is in [pos, pos + size), @return the first one
+    static unsigned cellRange(unsigned pos, unsigned size, unsigned cell,
+                              unsigned limit, unsigned &end) {
+        end = std::min((pos + size + cell / 2 + cell - 1) / cell - 1, limit);
+        return std::min((pos + cell / 2 + cell - 1) / cell - 1, end);
+    }
+
+    void fill(const Rectangle &rect, int background) {
+        unsigned rowEnd, columnEnd;
+        auto row = cellRange(rect.y, rect.h, fontHeight_, rows_, rowEnd);
+        auto column =
+            cellRange(rect.x, rect.w, fontWidth_, columns_, columnEnd);
+        for (; row < rowEnd; row++) {
+            for (auto i = column; i < columnEnd; i++) {
+                cells_[row * columns_ + i] = {" ", background};
+            }
+        }
+    }
+
+    /// apply a message of the IM server to the cells
+    void render(std::string_view message) {
+        if (cells_.empty()) {
+            return;
+        }
+        Message msg;
+        memcpy(&msg, message.data(), std::min(message.size(), sizeof(msg)));
+        switch (msg.type) {
+        case SetWin:
+            // FbTerm redraws the terminal where the window was.
+            if (msg.win.winid < NR_IM_WINS) {
+                fill(windows_[msg.win.winid], -1);
+                windows_[msg.win.winid] = msg.win.rect;
+            }
+            break;
+        case FillRect:
+            fill(msg.fillRect.rect, msg.fillRect.color);
+            break;
+        case DrawText: {
+            std::string text(
+                message.substr(offsetof(Message, drawText.texts)));
+            auto row = (msg.drawText.y + fontHeight_ / 2) / fontHeight_;
+            auto column = (msg.drawText.x + fontWidth_ / 2) / fontWidth_;
+            for (size_t offset = 0; offset < text.size() && row < rows_;) {
+                auto len = utf8::ncharByteLength(text.begin() + offset, 1);
+                auto character = text.substr(offset, len);
+                offset += len;
+                for (auto width = text_width(character);
+                     width && column < columns_; width--, column++) {
+                    cells_[row * columns_ + column] = {
+                        character, msg.drawText.bc};
+                    character.clear();
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    int fd_ = -1;
+    std::vector<Record> inputs_;
+    bool maxSpeed_;
+    unsigned settleMs_;
+    SimulatedMainLoop *loop_ = nullptr;
+    std::string pending_;
+    uint64_t received_ = 0;
+    uint64_t elapsed_ = 0;
+    std::vector<uint64_t> latencies_;
+    MessageStats sent_[AckPing + 1];
+    size_t measureFrom_ = SIZE_MAX;
+    uint64_t measuredKeys_ = 0;
+
+    unsigned fontWidth_ = 0;
+    unsigned fontHeight_ = 0;
+    unsigned columns_ = 0;
+    unsigned rows_ = 0;
+    std::vector<Cell> cells_;
+    Rectangle windows_[NR_IM_WINS] = {};
+    /// the texts of the PutText messages
+    std::string typed_;
+};
+
+/**
+ * A session synthesized in process: FbTerm's messages, and what fcitx
+ * answers to each key.
+ */
+class Scenario {
+public:
+    explicit Scenario(const StaticKeymap &keymap) : keymap_(keymap) {}
+
+    std::vector<Record> inputs;
+    std::vector<Record> fcitxRecords;
+    /// usec from the start until the input context is ready
+    uint64_t connectDelay = 0;
+    /// the inputs from this one on are a steady state, @see measure()
+    size_t measureFrom = SIZE_MAX;
+
+    void connected() { fcitx(RecordConnected, {}); }
+
+    /// delay the next message from FbTerm
+    void wait(uint64_t usec) { time_ += usec; }
+
+    /// count the allocations made for the keys typed from now on
+    void measure() { measureFrom = inputs.size(); }
+
+    void info(unsigned fontWidth, unsigned fontHeight, unsigned screenWidth,
+              unsigned screenHeight) {
+        Message msg;
+        msg.type = FbTermInfo;
+        msg.info = {fontHeight, fontWidth, screenHeight, screenWidth};
+        fbterm(msg);
+    }
+
+    void active() {
+        Message msg;
+        msg.type = Active;
+        fbterm(msg);
+    }
+
+    void deactive() {
+        Message msg;
+        msg.type = Deactive;
+        fbterm(msg);
+    }
+
+    void hideUI() {
+        Message msg;
+        msg.type = HideUI;
+        fbterm(msg);
+    }
+
+    void showUI() {
+        Message msg;
+        msg.type = ShowUI;
+        msg.winid = -1;
+        fbterm(msg);
+    }
+
+    void termMode() {
+        Message msg;
+        msg.type = TermMode;
+        msg.term = {0, 0, 0};
+        fbterm(msg);
+    }
+
+    void cursor(unsigned x, unsigned y) {
+        Message msg;
+        msg.type = CursorPosition;
+        msg.cursor = {x, y};
+        fbterm(msg);
+    }
+
+    /// press and release a key, fcitx handles it and updates the panel
+    void tap(unsigned short keycode, const ClientSideUI &ui,
+             std::string commit = {}) {
+        sendKey(keycode, true);
+        if (!commit.empty()) {
+            fcitx(RecordCommitString, std::move(commit));
+        }
+        std::string payload;
+        serializeClientSideUI(ui, payload);
+        fcitx(RecordClientSideUI, std::move(payload));
+        sendKey(keycode, false);
+    }
+
+    /// tap the key of a character typed without shift
+    void type(char c, const ClientSideUI &ui) { tap(keycode(c), ui); }
+
+    /// type a character fcitx doesn't answer in time
+    void typeTimedOut(char c) {
+        sendKey(keycode(c), true, FcitxBackend::KeyTimedOut);
+        typeWithoutFcitx(c, false);
+    }
+
+    /**
+     * @brief commit with a key, then press c, which fcitx doesn't answer in
+     * time
+     *
+     * FbTerm sends both presses in one message, and the commit is delivered
+     * after the second key timed out, the way D-Bus signals wait for the loop.
+     */
+    void commitTimedOut(unsigned short commitKey, std::string commit, char c) {
+        fbtermKeys({rawKey(commitKey, true), rawKey(keycode(c), true)});
+        keyResult(commitKey, true);
+        keyResult(keycode(c), true, FcitxBackend::KeyTimedOut);
+        fcitx(RecordCommitString, std::move(commit));
+        std::string payload;
+        serializeClientSideUI(ClientSideUI(), payload);
+        fcitx(RecordClientSideUI, std::move(payload));
+        fbtermKey(commitKey, false);
+        typeWithoutFcitx(c, false);
+    }
+
+    /// type a character which doesn't reach fcitx
+    void typeWithoutFcitx(char c, bool press = true) {
+        if (press) {
+            fbtermKey(keycode(c), true);
+        }
+        fbtermKey(keycode(c), false);
+    }
+
+private:
+    void fbterm(Message &msg) {
+        msg.len = sizeof(msg);
+        inputs.push_back(record(
+            RecordFbtermIn,
+            std::string(reinterpret_cast<char *>(&msg), sizeof(msg))));
+    }
+
+    unsigned short keycode(char c) const {
+        unsigned short keycode = 0;
+        bool shift = false;
+        keymap_.find(c, keycode, shift);
+        return keycode;
+    }
+
+    static char rawKey(unsigned short keycode, bool down) {
+        return static_cast<char>(down ? keycode : keycode | 0x80);
+    }
+
+    void fbtermKey(unsigned short keycode, bool down) {
+        fbtermKeys(std::string(1, rawKey(keycode, down)));
+    }
+
+    /// a SendKey message with the raw keys
+    void fbtermKeys(const std::string &keys) {
+        Message msg;
+        msg.type = SendKey;
+        msg.len = offsetof(Message, keys) + keys.size();
+        std::string payload(reinterpret_cast<char *>(&msg),
+                            offsetof(Message, keys));
+        payload += keys;
+        inputs.push_back(record(RecordFbtermIn, std::move(payload)));
+    }
+
+    /// a key FbTerm sends and fcitx answers with result
+    void sendKey(unsigned short keycode, bool down, int result = 1) {
+        fbtermKey(keycode, down);
+        keyResult(keycode, down, result);
+    }
+
+    /// fcitx answers a key with result
+    void keyResult(unsigned short keycode, bool down, int result = 1) {
+        RecordKey key = {};
+        key.keycode = keycode;
+        key.isRelease = !down;
+        key.result = result;
+        fcitx(RecordKeyResult,
+              std::string(reinterpret_cast<char *>(&key), sizeof(key)));
+    }
+
+    void fcitx(RecordType type, std::string payload) {
+        fcitxRecords.push_back(record(type, std::move(payload)));
+    }
+
+    Record record(RecordType type, std::string payload) {
+        // The records only point to their payload, which must not move.
+        payloads_.push_back(std::move(payload));
+        time_ += 10000;
+        return {type, time_, payloads_.back()};
+    }
+
+    const StaticKeymap &keymap_;
+    std::deque<std::string> payloads_;
+    uint64_t time_ = 0;
+};
+
+const char *const scenarioNames[] = {
+    "type",    "page",    "cursor", "commit",      "deactivate", "switch",
+    "connect", "timeout", "hang",   "hang-commit", "steady"};
+
+/// the panel of a pinyin input method, the first candidate highlighted
+ClientSideUI pinyinPanel(const std::string &preedit,
+                         std::vector<std::string> candidates, int cursor,
+                         bool hasPrev = false) {
+    ClientSideUI ui;
+    ui.preedit.push_back({preedit, 0});
+    ui.cursorPos = cursor;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        ui.candidates.push_back(
+            {std::to_string(i + 1) + ".", std::move(candidates[i]) + " "});
+    }
+    ui.highlight = 0;
+    ui.hasPrev = hasPrev;
+    ui.hasNext = true;
+    return ui;
+}
+
+/**
+ * Every scenario activates the input method on a 80x30 console and types
+ * "nihao", then does what it is named after. Messages are 10ms apart.
+ */
+void buildScenario(std::string_view name, Scenario &scenario) {
+    constexpr unsigned FontWidth = 8, FontHeight = 16;
+    if (name == "connect") {
+        // The keys are typed before the input context is ready.
+        scenario.connectDelay = 200000;
+    }
+    if (name != "timeout") {
+        scenario.connected();
+    }
+    scenario.info(FontWidth, FontHeight, 80 * FontWidth, 30 * FontHeight);
+    scenario.active();
+    scenario.cursor(10 * FontWidth, 5 * FontHeight);
+
+    const struct {
+        char key;
+        const char *preedit;
+        std::vector<std::string> candidates;
+    } syllable[] = {
+        {'n', "n", {"你", "呢", "能", "年", "那"}},
+        {'i', "ni", {"你", "呢", "泥", "尼", "逆"}},
+        {'h', "ni h", {"你好", "你会", "你还", "拟合", "你"}},
+        {'a', "ni ha", {"你还", "你好", "你哈", "拟", "你"}},
+        {'o', "ni hao", {"你好", "你号", "拟好", "你", "泥"}},
+    };
+    bool hung = false;
+    auto typeNihao = [&]() {
+        for (const auto &step : syllable) {
+            if (hung) {
+                scenario.typeWithoutFcitx(step.key);
+                continue;
+            }
+            if (name == "hang" && step.key == 'h') {
+                // fcitx hangs on h, it and the rest are passed through.
+                scenario.typeTimedOut(step.key);
+                hung = true;
+                continue;
+            }
+            std::string preedit = step.preedit;
+            scenario.type(step.key, pinyinPanel(preedit, step.candidates,
+                                                preedit.size()));
+        }
+    };
+    typeNihao();
+
+    if (name == "page") {
+        scenario.tap(KEY_EQUAL, pinyinPanel("ni hao",
+                                            {"你", "泥", "尼", "逆", "拟"},
+                                            6, true));
+    } else if (name == "cursor") {
+        // The terminal cursor moved to the bottom, the windows flip above it,
+        // then the caret moves back in the preedit.
+        scenario.cursor(2 * FontWidth, 28 * FontHeight);
+        scenario.tap(KEY_LEFT,
+                     pinyinPanel("ni hao",
+                                 {"你好", "你号", "拟好", "你", "泥"}, 5));
+    } else if (name == "commit") {
+        scenario.tap(KEY_SPACE, ClientSideUI(), "你好");
+        scenario.cursor(14 * FontWidth, 5 * FontHeight);
+    } else if (name == "deactivate") {
+        scenario.deactive();
+    } else if (name == "switch") {
+        // Switch to another sub-window of FbTerm and back.
+        scenario.hideUI();
+        scenario.showUI();
+    } else if (name == "connect") {
+        scenario.wait(scenario.connectDelay);
+        scenario.cursor(10 * FontWidth, 5 * FontHeight);
+    } else if (name == "timeout") {
+        // fcitx never comes, the keys are passed through after a while.
+        // A redraw would hide the error, end with a message drawing nothing.
+        scenario.wait(1500000);
+        scenario.termMode();
+    } else if (name == "steady") {
+        // Type, page, move the caret and commit twice, the second round is
+        // measured once the first one has grown the buffers.
+        for (unsigned round = 0; round < 2; round++) {
+            if (round) {
+                scenario.measure();
+                typeNihao();
+            }
+            scenario.tap(KEY_EQUAL,
+                         pinyinPanel("ni hao", {"你", "泥", "尼", "逆", "拟"},
+                                     6, true));
+            scenario.tap(KEY_LEFT,
+                         pinyinPanel("ni hao", {"你", "泥", "尼", "逆", "拟"},
+                                     5, true));
+            scenario.tap(KEY_SPACE, ClientSideUI(), "你好");
+            scenario.cursor((14 + 4 * round) * FontWidth, 5 * FontHeight);
+        }
+    } else if (name == "hang") {
+        // fcitx answers the next ping, the error goes away.
+        scenario.wait(1500000);
+        scenario.cursor(14 * FontWidth, 5 * FontHeight);
+    } else if (name == "hang-commit") {
+        // fcitx hangs on the key right after the commit, which is written
+        // before the key passed through.
+        scenario.commitTimedOut(KEY_SPACE, "你好", 'x');
+        scenario.wait(1500000);
+        scenario.cursor(15 * FontWidth, 5 * FontHeight);
+    }
+}
+
+/// counters and their budgets, in the order they are reported
+using Counters = std::vector<std::pair<std::string, uint64_t>>;
+
+/// what FcitxFbterm did during a replay
+struct ReplayMetrics {
+    /// SetWin round trips FcitxFbterm waited for
+    uint64_t roundTrips = 0;
+    /// FocusIn and FocusOut sent to fcitx
+    uint64_t focusChanges = 0;
+    /// keys typed in the steady state and the allocations made for them,
+    /// @see AllocationCounter
+    uint64_t measuredKeys = 0;
+    uint64_t allocations = 0;
+    uint64_t libraryAllocations = 0;
+};
+
+/// Pings are sent on a timer, they are not part of the budgets
+Counters budgetCounters(const FakeFbterm &fake, const ReplayMetrics &result) {
+    Counters counters;
+    uint64_t bytes = 0;
+    for (unsigned type = 0; type <= AckPing; type++) {
+        const auto &stats = fake.sent(type);
+        if (type == Ping || !stats.count) {
+            continue;
+        }
+        counters.emplace_back(message_type_name(type), stats.count);
+        bytes += stats.bytes;
+    }
+    counters.emplace_back("bytes", bytes);
+    counters.emplace_back("round_trips", result.roundTrips);
+    counters.emplace_back("focus_changes", result.focusChanges);
+    if (result.measuredKeys) {
+        // Rounded up, so that a single allocation is over a budget of 0.
+        counters.emplace_back("allocations_per_key",
+                              (result.allocations + result.measuredKeys - 1) /
+                                  result.measuredKeys);
+    }
+    return counters;
+}
+
+/// print the call stacks of the allocations counted in the steady state
+void printAllocationSites() {
+#ifdef __GLIBC__
+    for (size_t i = 0; i < allocations.siteCount; i++) {
+        const auto &site = allocations.sites[i];
+        std::cout << "  " << site.count << " allocations by "
+                  << (site.own ? "fcitx5-fbterm" : "a library")
+                  << " at:" << std::endl;
+        // The first frames are AllocationCounter::record and operator new.
+        char **symbols = backtrace_symbols(site.frames, site.depth);
+        for (int frame = 2; symbols && frame < site.depth; frame++) {
+            std::cout << "    " << symbols[frame] << std::endl;
+        }
+        free(symbols);
+    }
+    if (allocations.siteCount == AllocationCounter::MaxSites) {
+        std::cout << "  ..." << std::endl;
+    }
+#endif
+}
+
+/// lines of "<scenario> <counter> <budget>", # starts a comment
+bool readBudgets(const std::string &path,
+                 std::map<std::string, Counters> &budgets) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        line.erase(std::min(line.find('#'), line.size()));
+        std::istringstream fields(line);
+        std::string scenario, counter;
+        uint64_t budget;
+        if (fields >> scenario >> counter >> budget) {
+            budgets[scenario].emplace_back(counter, budget);
+        }
+    }
+    return true;
+}
+
+bool writeBudgets(const std::string &path,
+                  const std::map<std::string, Counters> &budgets) {
+    std::ofstream file(path);
+    file << "# Messages sent to FbTerm by fcitx5-fbterm-replay --scenario,"
+         << std::endl
+         << "# regenerate with --update." << std::endl;
+    for (const auto *name : scenarioNames) {
+        auto iter = budgets.find(name);
+        if (iter == budgets.end()) {
+            continue;
+        }
+        for (const auto &[counter, budget] : iter->second) {
+            file << name << " " << counter << " " << budget << std::endl;
+        }
+    }
+    return static_cast<bool>(file);
+}
+
+/// sections of a frame each, starting with a line "== <scenario> =="
+bool readSnapshots(const std::string &path,
+                   std::map<std::string, std::string> &snapshots) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line, *snapshot = nullptr;
+    while (std::getline(file, line)) {
+        if (line.size() > 6 && line.compare(0, 3, "== ") == 0 &&
+            line.compare(line.size() - 3, 3, " ==") == 0) {
+            snapshot = &snapshots[line.substr(3, line.size() - 6)];
+        } else if (snapshot) {
+            *snapshot += line + "\n";
+        }
+    }
+    return true;
+}
+
+bool writeSnapshots(const std::string &path,
+                    const std::map<std::string, std::string> &snapshots) {
+    std::ofstream file(path);
+    for (const auto *name : scenarioNames) {
+        auto iter = snapshots.find(name);
+        if (iter != snapshots.end()) {
+            file << "== " << name << " ==" << std::endl << iter->second;
+        }
+    }
+    return static_cast<bool>(file);
+}
+
+/// @return false if a counter is over budget
+bool checkBudget(const std::string &name, const Counters &counters,
+                 const Counters &budgets) {
+    bool ok = true;
+    for (const auto &[counter, value] : counters) {
+        auto iter = std::find_if(
+            budgets.begin(), budgets.end(),
+            [&counter = counter](const auto &item) {
+                return item.first == counter;
+            });
+        uint64_t budget = iter == budgets.end() ? 0 : iter->second;
+        if (value > budget) {
+            std::cout << "  FAIL " << name << ": " << counter << " " << value
+                      << " over budget " << budget << std::endl;
+            ok = false;
+        } else if (value < budget) {
+            std::cout << "  " << name << ": " << counter << " " << value
+                      << " under budget " << budget
+                      << ", tighten it with --update" << std::endl;
+        }
+    }
+    return ok;
+}
+
+/// replay inputs of fake against FcitxFbterm running on mainloop
+bool replay(std::unique_ptr<MainLoop> mainloop, KeycodeState *keycodeState,
+            FakeFbterm &fake, std::vector<Record> fcitxRecords,
+            uint64_t connectDelay, ReplayMetrics &result) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        return false;
+    }
+
+    auto roundTrips = metrics.setWinRoundTrips.load();
+    ImSession *session = im_session_new(fds[0]);
+    {
+        auto fcitxBackend = std::make_unique<ReplayBackend>(
+            *mainloop, std::move(fcitxRecords), connectDelay);
+        auto *replayBackend = fcitxBackend.get();
+        FcitxFbterm fbterm(*mainloop, session, keycodeState,
+                           FcitxFbtermConfig(), std::move(fcitxBackend));
+        fbterm.setDisconnectedCallback([&mainloop]() { mainloop->quit(); });
+
+        allocations.reset();
+        std::thread thread(&FakeFbterm::run, &fake, fds[1]);
+        countAllocations = 1;
+        mainloop->run();
+        countAllocations = 0;
+        thread.join();
+        result.focusChanges = replayBackend->focusChanges();
+        result.measuredKeys = fake.measuredKeys();
+        result.allocations = allocations.own;
+        result.libraryAllocations = allocations.library;
+    }
+    result.roundTrips = metrics.setWinRoundTrips.load() - roundTrips;
+    im_session_free(session);
+    close(fds[1]);
+    return true;
+}
+
+int runScenarios(const std::string &selected, const StaticKeymap &keymap,
+                 const std::string &budgetPath,
+                 const std::string &snapshotPath, bool update) {
+    std::vector<std::string> names;
+    for (const auto *name : scenarioNames) {
+        if (selected == "all" || selected == name) {
+            names.push_back(name);
+        }
+    }
+    if (names.empty()) {
+        std::cerr << "Unknown scenario " << selected << std::endl;
+        return 1;
+    }
+
+    // Files that don't exist yet are created by --update.
+    std::map<std::string, Counters> budgets;
+    if (!budgetPath.empty() && !readBudgets(budgetPath, budgets) && !update) {
+        std::cerr << "Failed to read " << budgetPath << std::endl;
+        return 1;
+    }
+    std::map<std::string, std::string> snapshots;
+    if (!snapshotPath.empty() && !readSnapshots(snapshotPath, snapshots) &&
+        !update) {
+        std::cerr << "Failed to read " << snapshotPath << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    setMonotonicClock(simulatedNow);
+    for (const auto &name : names) {
+        Scenario scenario(keymap);
+        buildScenario(name, scenario);
+        // Every scenario starts at the same time, whichever ran before.
+        simulatedTime = SimulatedStartTime;
+
+        KeycodeState *keycodeState = keycode_state_new(-1);
+        KeycodeState *oldState = set_current_keycode_state(keycodeState);
+        keymap.install();
+        set_current_keycode_state(oldState);
+
+        auto mainloop = std::make_unique<SimulatedMainLoop>();
+        FakeFbterm fake(std::move(scenario.inputs), false, 0);
+        fake.simulate(*mainloop);
+        fake.measureFrom(scenario.measureFrom);
+        ReplayMetrics result;
+        bool replayed =
+            replay(std::move(mainloop), keycodeState, fake,
+                   std::move(scenario.fcitxRecords), scenario.connectDelay,
+                   result);
+        keycode_state_free(keycodeState);
+        if (!replayed) {
+            return 1;
+        }
+
+        auto counters = budgetCounters(fake, result);
+        std::cout << name << ":";
+        for (const auto &[counter, value] : counters) {
+            std::cout << " " << counter << " " << value;
+        }
+        std::cout << std::endl;
+        if (result.allocations || result.libraryAllocations) {
+            std::cout << "  " << result.allocations << " allocations by "
+                      << "fcitx5-fbterm and " << result.libraryAllocations
+                      << " by libraries for " << result.measuredKeys
+                      << " steady state keys" << std::endl;
+            printAllocationSites();
+        }
+
+        if (update) {
+            budgets[name] = std::move(counters);
+            snapshots[name] = fake.frame();
+            continue;
+        }
+        if (!budgetPath.empty()) {
+            auto iter = budgets.find(name);
+            if (iter == budgets.end()) {
+                std::cout << "  FAIL " << name << ": no budget" << std::endl;
+                ok = false;
+            } else {
+                ok = checkBudget(name, counters, iter->second) && ok;
+            }
+        }
+        if (!snapshotPath.empty() && snapshots[name] != fake.frame()) {
+            std::cout << "  FAIL " << name
+                      << ": final frame differs from the snapshot"
+                      << std::endl
+                      << "expected:" << std::endl
+                      << snapshots[name] << "actual:" << std::endl
+                      << fake.frame();
+            ok = false;
+        }
+    }
+    setMonotonicClock(nullptr);
+
+    if (update) {
+        if (!budgetPath.empty() && !writeBudgets(budgetPath, budgets)) {
+            std::cerr << "Failed to write " << budgetPath << std::endl;
+            return 1;
+        }
+        if (!snapshotPath.empty() &&
+            !writeSnapshots(snapshotPath, snapshots)) {
+            std::cerr << "Failed to write " << snapshotPath << std::endl;
+            return 1;
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+void printUsage(std::string_view arg0) {
+    std::cout << "Usage: " << arg0 << " [options] <log>" << std::endl
+              << "       " << arg0
+              << " --scenario=<name|all> [--budget=<file>] "
+                 "[--snapshot=<file>] [--update]"
+              << std::endl
+              << "Options:" << std::endl
+              << "  --max-speed     don't wait between messages" << std::endl
+              << "  --settle=<ms>   time without output after which a "
+                 "message of a log is done, default 5"
+              << std::endl
+              << "  --backend=<gclient|dbus> main loop to replay a log on"
+              << std::endl
+              << "  --scenario=<name|all> replay a built-in session instead "
+                 "of a log: type, page, cursor, commit, deactivate, switch, "
+                 "connect, timeout, hang, hang-commit or steady"
+              << std::endl
+              << "  --budget=<file> fail if a scenario sends more messages, "
+                 "bytes or round trips than budgeted"
+              << std::endl
+              << "  --snapshot=<file> fail if the final frame of a scenario "
+                 "differs"
+              << std::endl
+              << "  --update        write the results to the budget and "
+                 "snapshot files"
+              << std::endl
+              << "  --keymap=<file> translate keys with a keymap written by "
+                 "dumpkeys"
+              << std::endl
+              << "  --help          show this message" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    const struct option longOptions[] = {
+        {"max-speed", no_argument, nullptr, 'm'},
+        {"settle", required_argument, nullptr, 's'},
+        {"backend", required_argument, nullptr, 'k'},
+        {"scenario", required_argument, nullptr, 'c'},
+        {"budget", required_argument, nullptr, 'b'},
+        {"snapshot", required_argument, nullptr, 'n'},
+        {"update", no_argument, nullptr, 'u'},
+        {"keymap", required_argument, nullptr, 'l'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+    bool maxSpeed = false;
+    unsigned settleMs = 5;
+    BackendType backend = DefaultBackendType;
+    std::string scenario, budgetPath, snapshotPath, keymapPath;
+    bool update = false;
+    int r;
+    while ((r = getopt_long_only(argc, argv, "", longOptions, nullptr)) != -1) {
+        switch (r) {
+        case 'm':
+            maxSpeed = true;
+            break;
+        case 's':
+            settleMs = atoi(optarg);
+            break;
+        case 'k':
+            if (!parseBackendType(optarg, backend)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            scenario = optarg;
+            break;
+        case 'b':
+            budgetPath = optarg;
+            break;
+        case 'n':
+            snapshotPath = optarg;
+            break;
+        case 'u':
+            update = true;
+            break;
+        case 'l':
+            keymapPath = optarg;
+            break;
+        case 'h':
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    static const UsKeymap usKeymap;
+    const StaticKeymap *keymap = &usKeymap;
+    std::unique_ptr<KeymapFile> keymapFile;
+    if (!keymapPath.empty()) {
+        keymapFile = KeymapFile::load(keymapPath);
+        if (!keymapFile) {
+            return 1;
+        }
+        keymap = keymapFile.get();
+    }
+    if (!scenario.empty()) {
+        return runScenarios(scenario, *keymap, budgetPath, snapshotPath,
+                            update);
+    }
+    if (optind >= argc) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    auto reader = ImRecordReader::open(argv[optind]);
+    if (!reader) {
+        std::cerr << argv[optind] << " is not a session log" << std::endl;
+        return 1;
+    }
+    std::vector<Record> inputs;
+    std::vector<Record> fcitxRecords;
+    Record record;
+    while (reader->next(record)) {
+        if (record.type == RecordFbtermIn) {
+            // Acknowledgements are generated by the fake FbTerm.
+            auto type = messageType(record.payload);
+            if (type != AckWin && type != AckPing) {
+                inputs.push_back(record);
+            }
+        } else if (record.type != RecordFbtermOut) {
+            fcitxRecords.push_back(record);
+        }
+    }
+
+    KeycodeState *keycodeState =
+        keycode_state_new(keymapFile ? -1 : dup(STDIN_FILENO));
+    if (keymapFile) {
+        KeycodeState *oldState = set_current_keycode_state(keycodeState);
+        keymapFile->install();
+        set_current_keycode_state(oldState);
+    }
+    FakeFbterm fake(std::move(inputs), maxSpeed, settleMs);
+    ReplayMetrics result;
+    bool replayed = replay(createMainLoop(backend, false), keycodeState, fake,
+                           std::move(fcitxRecords), 0, result);
+    keycode_state_free(keycodeState);
+    if (!replayed) {
+        return 1;
+    }
+    fake.report(std::cout);
+    return 0;
+}
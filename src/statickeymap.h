@@ -0,0 +1,32 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_STATICKEYMAP_H_
+#define _FCITX5_FBTERM_STATICKEYMAP_H_
+
+/**
+ * A keymap held in memory, translating keys without a console.
+ *
+ * By default keys are translated with the keymap of the console, read with
+ * ioctl() as they are first used. Installing a StaticKeymap replaces it for
+ * the current keycode state, @see set_static_keymap().
+ */
+class StaticKeymap {
+public:
+    virtual ~StaticKeymap() = default;
+
+    /// use the keymap for the current keycode state
+    virtual void install() const = 0;
+
+    /**
+     * @brief find the key typing a character
+     * @param shift set if the key has to be pressed with shift
+     * @return false if the character is not on the keyboard
+     */
+    virtual bool find(char c, unsigned short &keycode, bool &shift) const = 0;
+};
+
+#endif // _FCITX5_FBTERM_STATICKEYMAP_H_
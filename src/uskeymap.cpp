@@ -0,0 +1,127 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include "uskeymap.h"
+#include <algorithm>
+#include <iterator>
+#include <linux/input.h>
+#include "keycode.h"
+
+namespace {
+
+const char *const functionStrings[] = {
+    "\e[[A",  "\e[[B",  "\e[[C",  "\e[[D",  "\e[[E",  "\e[17~", "\e[18~",
+    "\e[19~", "\e[20~", "\e[21~", "\e[23~", "\e[24~", nullptr,  nullptr,
+    nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  "\e[1~",
+    "\e[2~",  "\e[3~",  "\e[4~",  "\e[5~",  "\e[6~",
+};
+
+} // namespace
+
+UsKeymap::UsKeymap() {
+    for (auto &table : tables) {
+        std::fill(std::begin(table), std::end(table), K_HOLE);
+    }
+
+    struct {
+        unsigned short keycode;
+        char plain, shifted;
+    } chars[] = {
+        {KEY_1, '1', '!'},          {KEY_2, '2', '@'},
+        {KEY_3, '3', '#'},          {KEY_4, '4', '$'},
+        {KEY_5, '5', '%'},          {KEY_6, '6', '^'},
+        {KEY_7, '7', '&'},          {KEY_8, '8', '*'},
+        {KEY_9, '9', '('},          {KEY_0, '0', ')'},
+        {KEY_MINUS, '-', '_'},      {KEY_EQUAL, '=', '+'},
+        {KEY_LEFTBRACE, '[', '{'},  {KEY_RIGHTBRACE, ']', '}'},
+        {KEY_SEMICOLON, ';', ':'},  {KEY_APOSTROPHE, '\'', '"'},
+        {KEY_GRAVE, '`', '~'},      {KEY_BACKSLASH, '\\', '|'},
+        {KEY_COMMA, ',', '<'},      {KEY_DOT, '.', '>'},
+        {KEY_SLASH, '/', '?'},      {KEY_SPACE, ' ', ' '},
+        {KEY_TAB, '\t', '\t'},      {KEY_ESC, '\e', '\e'},
+        {KEY_BACKSPACE, 127, 127},
+    };
+    for (const auto &item : chars) {
+        set(item.keycode, K(KT_LATIN, item.plain),
+            K(KT_LATIN, item.shifted));
+    }
+
+    const char *rows[] = {"qwertyuiop", "asdfghjkl", "zxcvbnm"};
+    const unsigned short rowStart[] = {KEY_Q, KEY_A, KEY_Z};
+    for (size_t row = 0; row < std::size(rows); row++) {
+        for (size_t i = 0; rows[row][i]; i++) {
+            unsigned char c = rows[row][i];
+            set(rowStart[row] + i, K(KT_LETTER, c),
+                K(KT_LETTER, c - 'a' + 'A'), K(KT_LATIN, c & 0x1f));
+        }
+    }
+
+    for (unsigned i = 0; i < 10; i++) {
+        set(KEY_F1 + i, K(KT_FN, i));
+    }
+    set(KEY_F11, K(KT_FN, 10));
+    set(KEY_F12, K(KT_FN, 11));
+
+    const struct {
+        unsigned short keycode, keysym;
+    } specials[] = {
+        {KEY_ENTER, K_ENTER},       {KEY_LEFTSHIFT, K_SHIFT},
+        {KEY_RIGHTSHIFT, K_SHIFT},  {KEY_LEFTCTRL, K_CTRL},
+        {KEY_RIGHTCTRL, K_CTRL},    {KEY_LEFTALT, K_ALT},
+        {KEY_CAPSLOCK, K_CAPS},     {KEY_UP, K_UP},
+        {KEY_DOWN, K_DOWN},         {KEY_LEFT, K_LEFT},
+        {KEY_RIGHT, K_RIGHT},       {KEY_HOME, K_FIND},
+        {KEY_END, K_SELECT},        {KEY_INSERT, K_INSERT},
+        {KEY_DELETE, K_REMOVE},     {KEY_PAGEUP, K_PGUP},
+        {KEY_PAGEDOWN, K_PGDN},     {KEY_KP5, K_P5},
+        {KEY_KPENTER, K_PENTER},
+    };
+    for (const auto &item : specials) {
+        set(item.keycode, item.keysym);
+    }
+}
+
+void UsKeymap::install() const {
+    const unsigned short *keymaps[NrTables];
+    for (size_t i = 0; i < NrTables; i++) {
+        keymaps[i] = tables[i];
+    }
+    set_static_keymap(keymaps, NrTables, functionStrings,
+                      std::size(functionStrings));
+}
+
+void UsKeymap::set(unsigned short keycode, unsigned short plain) {
+    set(keycode, plain, plain, plain);
+}
+
+void UsKeymap::set(unsigned short keycode, unsigned short plain,
+                   unsigned short shifted) {
+    set(keycode, plain, shifted, plain);
+}
+
+void UsKeymap::set(unsigned short keycode, unsigned short plain,
+                   unsigned short shifted, unsigned short ctrl) {
+    tables[0][keycode] = plain;
+    tables[1 << KG_SHIFT][keycode] = shifted;
+    tables[1 << KG_CTRL][keycode] = ctrl;
+    tables[(1 << KG_SHIFT) | (1 << KG_CTRL)][keycode] = ctrl;
+}
+
+bool UsKeymap::find(char c, unsigned short &keycode, bool &shift) const {
+    for (unsigned table : {0, 1 << KG_SHIFT}) {
+        for (unsigned short code = 0; code < NR_KEYS; code++) {
+            auto keysym = tables[table][code];
+            if (KVAL(keysym) == static_cast<unsigned char>(c) &&
+                (KTYP(keysym) == KT_LATIN || KTYP(keysym) == KT_LETTER)) {
+                keycode = code;
+                shift = table;
+                return true;
+            }
+        }
+    }
+    return false;
+}
@@ -0,0 +1,36 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+#ifndef _FCITX5_FBTERM_USKEYMAP_H_
+#define _FCITX5_FBTERM_USKEYMAP_H_
+
+#include <linux/keyboard.h>
+#include "statickeymap.h"
+
+/**
+ * The plain, shift, ctrl and shift+ctrl tables of a US keyboard, for
+ * translating keys without a console.
+ */
+struct UsKeymap : public StaticKeymap {
+    static constexpr unsigned NrTables = 6;
+
+    unsigned short tables[NrTables][NR_KEYS];
+
+    UsKeymap();
+
+    void install() const override;
+
+    bool find(char c, unsigned short &keycode, bool &shift) const override;
+
+private:
+    void set(unsigned short keycode, unsigned short plain);
+    void set(unsigned short keycode, unsigned short plain,
+             unsigned short shifted);
+    void set(unsigned short keycode, unsigned short plain,
+             unsigned short shifted, unsigned short ctrl);
+};
+
+#endif // _FCITX5_FBTERM_USKEYMAP_H_
@@ -6,10 +6,29 @@
  */
 
 #include "utils.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <tuple>
+#include <fcitx-utils/event.h>
 #include <fcitx-utils/log.h>
-#include <glib.h>
+#include <fcitx-utils/utf8.h>
+
+namespace {
+
+uint64_t (*monotonicClock)() = nullptr;
+
+} // namespace
+
+uint64_t monotonicTime() {
+    return monotonicClock ? monotonicClock() : fcitx::now(CLOCK_MONOTONIC);
+}
+
+void setMonotonicClock(uint64_t (*clock)()) { monotonicClock = clock; }
 
 ColorType stringToColorType(std::string_view s, ColorType fallback) {
 #define COLOR_NAME(NAME)                                                       \
@@ -31,3 +50,55 @@ ColorType stringToColorType(std::string_view s, ColorType fallback) {
     }
     return fallback;
 }
+
+std::string runtimePath(std::string_view name) {
+    std::string path;
+    if (const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+        runtimeDir && runtimeDir[0]) {
+        path = runtimeDir;
+    } else {
+        path = "/tmp/fcitx5-fbterm-" + std::to_string(getuid());
+        // /tmp is shared, another user may have created the directory to
+        // listen where our sockets are expected.
+        struct stat st;
+        if ((mkdir(path.c_str(), 0700) == -1 && errno != EEXIST) ||
+            lstat(path.c_str(), &st) == -1 || !S_ISDIR(st.st_mode) ||
+            st.st_uid != getuid() || (st.st_mode & 0777) != 0700) {
+            FCITX_ERROR() << "Refusing to use " << path
+                          << ", it is not a private directory of this user";
+            return {};
+        }
+    }
+    path += "/";
+    path += name;
+    return path;
+}
+
+int is_double_width(uint32_t ucs) {
+    static const std::tuple<uint32_t, uint32_t> double_width[] = {
+        {0x1100, 0x115F}, {0x2329, 0x232A},   {0x2E80, 0x303E},
+        {0x3040, 0xA4CF}, {0xAC00, 0xD7A3},   {0xF900, 0xFAFF},
+        {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},   {0xFF00, 0xFF60},
+        {0xFFE0, 0xFFE6}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}};
+    // this is tricky, upper_bound means, first item that larger than value.
+    auto iter =
+        std::upper_bound(std::begin(double_width), std::end(double_width), ucs,
+                         [](uint32_t ucs, const auto &item) {
+                             return ucs < std::get<1>(item) + 1;
+                         });
+    if (iter == std::end(double_width)) {
+        return false;
+    }
+    return (ucs >= std::get<0>(*iter));
+}
+
+unsigned int text_width(std::string_view str) {
+    int width = 0;
+    for (auto c : fcitx::utf8::MakeUTF8CharRange(str)) {
+        if (is_double_width(c))
+            width += 2;
+        else
+            width += 1;
+    }
+    return width;
+}
@@ -7,10 +7,39 @@
 #ifndef FCITX5_FBTERM_UTILS_H
 #define FCITX5_FBTERM_UTILS_H
 
+#include <cstdint>
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <vector>
 #include "imapi.h"
 
 ColorType stringToColorType(std::string_view s, ColorType fallback);
 
+/**
+ * @brief path of a file in the user's runtime directory
+ *
+ * Falls back to a private directory under /tmp if XDG_RUNTIME_DIR is not set.
+ * @return an empty path if that directory exists but isn't private to the user
+ */
+std::string runtimePath(std::string_view name);
+
+/// usec of CLOCK_MONOTONIC, or of the clock set with setMonotonicClock()
+uint64_t monotonicTime();
+
+/**
+ * @brief replace the clock read by monotonicTime()
+ * @param clock nullptr restores CLOCK_MONOTONIC
+ *
+ * For harnesses simulating time, e.g. replaying scenarios. Must be set before
+ * the threads reading it start.
+ */
+void setMonotonicClock(uint64_t (*clock)());
+
+/// true if the character takes two columns on the console
+int is_double_width(uint32_t ucs);
+
+/// columns taken by an UTF-8 string on the console
+unsigned int text_width(std::string_view str);
+
 #endif // FCITX5_FBTERM_UTILS_H
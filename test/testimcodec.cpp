@@ -0,0 +1,183 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fcitx-utils/log.h>
+#include "imcodec.h"
+
+namespace {
+
+/// the bytes writev() sends for msg
+std::string wire(const ImOutMessage &msg) {
+    iovec iov[2];
+    std::string data;
+    for (int i = 0, count = msg.toIovec(iov); i < count; i++) {
+        data.append(static_cast<const char *>(iov[i].iov_base),
+                    iov[i].iov_len);
+    }
+    FCITX_ASSERT(data.size() == msg.size());
+    return data;
+}
+
+/// a message with the given length field, padded with zeros to size bytes
+std::string rawMessage(unsigned short type, unsigned short len, size_t size) {
+    std::string data(size, '\0');
+    memcpy(data.data() + offsetof(Message, type), &type, sizeof(type));
+    memcpy(data.data() + offsetof(Message, len), &len, sizeof(len));
+    return data;
+}
+
+template <MessageType Type>
+void testFixed() {
+    auto msg = imEncode<Type>();
+    msg.header.win.rect = {1, 2, 3, 4};
+    msg.header.win.winid = 5;
+    auto data = wire(msg);
+    FCITX_ASSERT(data.size() == sizeof(Message));
+
+    ImInMessage in;
+    FCITX_ASSERT(imDecode(data, in) == static_cast<ssize_t>(data.size()));
+    FCITX_ASSERT(in.type() == Type);
+    FCITX_ASSERT(memcmp(&in.header, &msg.header, sizeof(Message)) == 0);
+    FCITX_ASSERT(in.payload.empty());
+}
+
+template <MessageType Type>
+void testPayload(std::string_view payload) {
+    auto msg = imEncode<Type>(payload);
+    FCITX_ASSERT(msg.payload.data() == payload.data());
+    auto data = wire(msg);
+    FCITX_ASSERT(data.size() == ImHeaderSize<Type> + payload.size());
+
+    ImInMessage in;
+    FCITX_ASSERT(imDecode(data, in) == static_cast<ssize_t>(data.size()));
+    FCITX_ASSERT(in.type() == Type);
+    FCITX_ASSERT(in.header.len == data.size());
+    FCITX_ASSERT(in.payload == payload);
+    // The payload is not copied, it points into the buffer decoded.
+    FCITX_ASSERT(payload.empty() ||
+                 in.payload.data() == data.data() + ImHeaderSize<Type>);
+}
+
+void testRoundTrip() {
+    testFixed<Connect>();
+    testFixed<Disconnect>();
+    testFixed<Active>();
+    testFixed<Deactive>();
+    testFixed<SetWin>();
+    testFixed<AckWin>();
+    testFixed<CursorPosition>();
+    testFixed<FbTermInfo>();
+    testFixed<TermMode>();
+    testFixed<ShowUI>();
+    testFixed<HideUI>();
+    testFixed<AckHideUI>();
+    testFixed<FillRect>();
+    testFixed<Ping>();
+    testFixed<AckPing>();
+
+    testPayload<SendKey>("\x1e\x9e");
+    testPayload<SendKey>("");
+    testPayload<PutText>("你好");
+    testPayload<DrawText>("ni hao");
+
+    auto msg = imEncode<DrawText>("1.你好");
+    msg.header.drawText.x = 80;
+    msg.header.drawText.y = 16;
+    msg.header.drawText.fc = 7;
+    msg.header.drawText.bc = 1;
+    auto data = wire(msg);
+    ImInMessage in;
+    FCITX_ASSERT(imDecode(data, in) == static_cast<ssize_t>(data.size()));
+    FCITX_ASSERT(in.header.drawText.x == 80 && in.header.drawText.y == 16);
+    FCITX_ASSERT(in.header.drawText.fc == 7 && in.header.drawText.bc == 1);
+    FCITX_ASSERT(in.payload == "1.你好");
+
+    // The longest payload still fits the length field.
+    std::string text(ImMaxPayload<PutText>, 'a');
+    testPayload<PutText>(text);
+}
+
+void testIncomplete() {
+    ImInMessage in;
+    auto data = wire(imEncode<PutText>("hello"));
+    // Not even the type and length yet.
+    for (size_t size = 0; size < offsetof(Message, raw); size++) {
+        FCITX_ASSERT(imDecode(std::string_view(data).substr(0, size), in) ==
+                     0);
+    }
+    // The length field is larger than what has arrived.
+    for (size_t size = offsetof(Message, raw); size < data.size(); size++) {
+        FCITX_ASSERT(imDecode(std::string_view(data).substr(0, size), in) ==
+                     0);
+    }
+    FCITX_ASSERT(imDecode(rawMessage(Active, sizeof(Message), 8), in) == 0);
+}
+
+void testMalformed() {
+    ImInMessage in;
+    // A length shorter than the type and length fields.
+    for (unsigned short len = 0; len < offsetof(Message, raw); len++) {
+        FCITX_ASSERT(imDecode(rawMessage(SendKey, len, sizeof(Message)),
+                              in) == -1);
+    }
+
+    // A fixed message shorter than Message, the missing fields are zero.
+    auto data = rawMessage(SetWin, 8, sizeof(Message));
+    memset(data.data() + offsetof(Message, raw), 0xff,
+           data.size() - offsetof(Message, raw));
+    FCITX_ASSERT(imDecode(data, in) == 8);
+    FCITX_ASSERT(in.type() == SetWin);
+    FCITX_ASSERT(in.header.win.rect.x == 0xffff'ffffu);
+    FCITX_ASSERT(in.header.win.rect.y == 0 && in.header.win.winid == 0);
+    FCITX_ASSERT(in.payload.empty());
+
+    // A DrawText message ending in its header has no text.
+    FCITX_ASSERT(imDecode(rawMessage(DrawText, 10, 10), in) == 10);
+    FCITX_ASSERT(in.payload.empty());
+
+    // An unknown type is skipped by its length, without a payload.
+    FCITX_ASSERT(imDecode(rawMessage(AckPing + 1, 12, 12), in) == 12);
+    FCITX_ASSERT(in.payload.empty());
+
+    // A fixed message longer than Message carries no payload either.
+    constexpr size_t longer = sizeof(Message) + 8;
+    FCITX_ASSERT(imDecode(rawMessage(Ping, longer, longer), in) ==
+                 static_cast<ssize_t>(longer));
+    FCITX_ASSERT(in.payload.empty());
+}
+
+void testStream() {
+    auto first = wire(imEncode<SendKey>("\x1e"));
+    auto second = wire(imEncode<AckWin>());
+    auto data = first + second + second.substr(0, 6);
+
+    ImInMessage in;
+    std::string_view rest = data;
+    auto len = imDecode(rest, in);
+    FCITX_ASSERT(len == static_cast<ssize_t>(first.size()));
+    FCITX_ASSERT(in.type() == SendKey && in.payload == "\x1e");
+    rest.remove_prefix(len);
+    len = imDecode(rest, in);
+    FCITX_ASSERT(len == static_cast<ssize_t>(second.size()));
+    FCITX_ASSERT(in.type() == AckWin);
+    rest.remove_prefix(len);
+    // The third message has not arrived completely.
+    FCITX_ASSERT(imDecode(rest, in) == 0);
+}
+
+} // namespace
+
+int main() {
+    testRoundTrip();
+    testIncomplete();
+    testMalformed();
+    testStream();
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ */
+
+#include <linux/input.h>
+#include <linux/keyboard.h>
+#include <memory>
+#include <string>
+#include <fcitx-utils/log.h>
+#include "keycode.h"
+#include "keymapfile.h"
+
+namespace {
+
+/// translates keys with a keymap instead of the console's
+class KeymapScope {
+public:
+    explicit KeymapScope(const StaticKeymap &keymap)
+        : state_(keycode_state_new(-1)),
+          old_(set_current_keycode_state(state_)) {
+        keymap.install();
+        init_keycode_state();
+        update_term_mode(0, 0, 0);
+    }
+
+    ~KeymapScope() {
+        set_current_keycode_state(old_);
+        keycode_state_free(state_);
+    }
+
+private:
+    KeycodeState *state_;
+    KeycodeState *old_;
+};
+
+/// what the terminal gets for pressing and releasing the keys in turn
+std::string type(std::initializer_list<unsigned short> keycodes) {
+    std::string text;
+    for (auto keycode : keycodes) {
+        for (char down : {1, 0}) {
+            auto keysym = keycode_to_keysym(keycode, down);
+            if (const char *str = keysym_to_term_string(keysym, down)) {
+                text += str;
+            }
+        }
+    }
+    return text;
+}
+
+std::unique_ptr<KeymapFile> load(const std::string &dir,
+                                  const std::string &layout) {
+    auto keymap = KeymapFile::load(dir + "/" + layout + ".map");
+    FCITX_ASSERT(keymap);
+    return keymap;
+}
+
+void testLayouts(const std::string &dir) {
+    {
+        auto keymap = load(dir, "us");
+        KeymapScope scope(*keymap);
+        FCITX_ASSERT(type({KEY_H, KEY_I}) == "hi");
+    }
+    {
+        // The key right of ß has the acute and the grave accent.
+        auto keymap = load(dir, "de");
+        KeymapScope scope(*keymap);
+        FCITX_ASSERT(type({KEY_Z, KEY_Y}) == "yz");
+        FCITX_ASSERT(type({KEY_EQUAL, KEY_E}) == "é");
+        FCITX_ASSERT(type({KEY_EQUAL, KEY_SPACE}) == "'");
+        FCITX_ASSERT(type({KEY_EQUAL, KEY_X}) == "'x");
+    }
+    {
+        // The dead circumflex is right of p.
+        auto keymap = load(dir, "fr");
+        KeymapScope scope(*keymap);
+        FCITX_ASSERT(type({KEY_Q, KEY_A}) == "aq");
+        FCITX_ASSERT(type({KEY_LEFTBRACE, KEY_E}) == "ê");
+    }
+    {
+        auto keymap = load(dir, "jp106");
+        KeymapScope scope(*keymap);
+        FCITX_ASSERT(type({KEY_A}) == "a");
+    }
+}
+
+void testUnknownKeysym() {
+    // Not rejected, the key does nothing.
+    auto keymap = KeymapFile::parse("keymaps 0-1\n"
+                                    "keycode 30 = a A\n"
+                                    "keycode 31 = NoSuchKeysym\n",
+                                    "unknown");
+    FCITX_ASSERT(keymap);
+    KeymapScope scope(*keymap);
+    FCITX_ASSERT(type({KEY_A, KEY_S, KEY_A}) == "aa");
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    FCITX_ASSERT(argc == 2);
+    testLayouts(argv[1]);
+    testUnknownKeysym();
+    return 0;
+}